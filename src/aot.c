@@ -0,0 +1,646 @@
+/* aot.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Ahead-of-time translation of fixed firmware to C. Everything reachable from the entry points is cut into
+// blocks of straight-line code, each ending at a write to PC, a JSR or anything left to the interpreter
+// (special opcodes other than JSR, invalid instructions). A block becomes a function over locals that
+// returns the index of the block to run next, or CPU_AOT_LOOKUP when PC is only known at run time (SET PC,
+// POP and friends), so indirect jumps into translated code stay native and anywhere else falls back to
+// the interpreter.
+//
+// cpu_run only enters a block when its longest path fits before the next deadline, as with the JIT, so
+// devices, interrupts and cycle counts see exactly what they would interpreting. Each block carries the
+// words it was translated from. Writes to them (by the guest, devices or loaders) are trapped through
+// the page flags and the block is compared against memory again before it next runs, so self-modifying
+// code or a different image just runs interpreted.
+
+#define AOT_MAX_INSTRUCTIONS 64
+
+enum {
+    SET = 0x01,
+    ADD, SUB, MUL, MLI, DIV, DVI, MOD, MDI,
+    AND, BOR, XOR, SHR, ASR, SHL,
+    IFB, IFC, IFE, IFN, IFG, IFA, IFL, IFU,
+    ADX = 0x1A, SBX,
+    STI = 0x1E, STD
+};
+
+enum {
+    JSR = 0x01,
+    INT = 0x08, IAG, IAS, RFI, IAQ,
+    HWN = 0x10, HWQ, HWI
+};
+
+enum { PC = 8, SP, EX };
+
+struct aot_t {
+    const struct cpu_aot_t *aot;
+    uint32_t dirty; // Covered words written since they were last compared
+    uint64_t written[0x10000 / 64];
+};
+
+// cpu.c
+void decode_words(struct instruction_t *ins, uint16_t pc, const uint16_t words[3]);
+void jit_written(struct cpu_t *cpu, uint16_t address);
+void code_watch(struct cpu_t *cpu, uint16_t address);
+
+static int covers(const struct cpu_aot_t *aot, uint16_t address) {
+    return aot->covered[address >> 6] >> (address & 63) & 1;
+}
+
+// Called from cpu.c for writes to pages holding code
+void aot_written(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    struct aot_t *state = cpu->aot;
+    for (uint32_t i = 0; i < count && i < 0x10000; i++) {
+        uint16_t at = address + i;
+        uint64_t bit = 1ull << (at & 63);
+        if ((state->aot->covered[at >> 6] & bit) && !(state->written[at >> 6] & bit)) {
+            state->written[at >> 6] |= bit;
+            state->dirty++;
+        }
+    }
+}
+
+int cpu_aot_written(struct cpu_t *cpu, uint16_t address) {
+    jit_written(cpu, address);
+    return cpu->aot && covers(cpu->aot->aot, address);
+}
+
+static int intact(struct cpu_t *cpu, struct aot_t *state, const struct cpu_aot_block_t *blk) {
+    uint64_t stale = 0;
+    for (uint32_t a = blk->pc; a < blk->end; a++)
+        stale |= state->written[a >> 6] & 1ull << (a & 63);
+    if (!stale)
+        return 1;
+    if (memcmp(&cpu->memory[blk->pc], blk->words, (blk->end - blk->pc) * sizeof(uint16_t)))
+        return 0;
+    // Written back the same, or the image was loaded after enabling
+    for (uint32_t a = blk->pc; a < blk->end; a++) {
+        uint64_t bit = 1ull << (a & 63);
+        if (state->written[a >> 6] & bit) {
+            state->written[a >> 6] &= ~bit;
+            state->dirty--;
+        }
+    }
+    return 1;
+}
+
+static int find(const struct cpu_aot_t *aot, uint16_t pc) {
+    int low = 0, high = aot->count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (aot->blocks[mid].pc == pc)
+            return mid;
+        if (aot->blocks[mid].pc < pc)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return -1;
+}
+
+// Called from cpu_run, returns 0 if nothing ran
+int aot_enter(struct cpu_t *cpu, uint64_t end) {
+    struct aot_t *state = cpu->aot;
+    int index = find(state->aot, cpu->reg[PC]), ran = 0;
+    while (index >= 0) {
+        const struct cpu_aot_block_t *blk = &state->aot->blocks[index];
+        if (cpu->cycles > end || end - cpu->cycles < blk->max_cycles || (state->dirty && !intact(cpu, state, blk)))
+            break;
+        index = blk->fn(cpu, end);
+        ran = 1;
+        // Posted interrupts wait no longer than a block, as with the JIT
+        if (__atomic_load_n(&cpu->posted_pending, __ATOMIC_RELAXED))
+            break;
+        if (index == CPU_AOT_LOOKUP)
+            index = find(state->aot, cpu->reg[PC]);
+    }
+    return ran;
+}
+
+const struct cpu_aot_t* aot_program(struct cpu_t *cpu) {
+    return cpu->aot->aot;
+}
+
+int cpu_aot_enable(struct cpu_t *cpu, const struct cpu_aot_t *aot) {
+    struct aot_t *state = malloc(sizeof(struct aot_t));
+    if (!state)
+        return 0;
+    cpu_aot_disable(cpu);
+    state->aot = aot;
+    // Nothing is trusted until it's been compared against memory
+    memcpy(state->written, aot->covered, sizeof(state->written));
+    state->dirty = 0;
+    for (int i = 0; i < 0x10000 / 64; i++)
+        state->dirty += __builtin_popcountll(aot->covered[i]);
+    for (uint32_t page = 0; page < CPU_PAGE_COUNT; page++)
+        for (uint32_t i = 0; i < (1 << CPU_PAGE_SHIFT) / 64; i++)
+            if (aot->covered[(page << CPU_PAGE_SHIFT) / 64 + i]) {
+                code_watch(cpu, page << CPU_PAGE_SHIFT);
+                break;
+            }
+    cpu->aot = state;
+    return 1;
+}
+
+void cpu_aot_disable(struct cpu_t *cpu) {
+    free(cpu->aot);
+    cpu->aot = NULL;
+}
+
+// Translation
+
+typedef struct {
+    const uint16_t *image;
+    uint8_t *queued;
+    uint16_t *stack;
+    int depth;
+    int32_t *index; // Block number by start address, -1 where none starts
+    FILE *out;
+    // Per block while emitting
+    uint32_t regs, assigned;
+    int uses_a, uses_ad, uses_ex, uses_m, loops;
+} translator_t;
+
+typedef struct {
+    struct instruction_t list[AOT_MAX_INSTRUCTIONS];
+    int count;
+    uint32_t end, cover, max_cycles;
+} block_t;
+
+static const char *names[] = { "A", "B", "C", "X", "Y", "Z", "I", "J", "PC", "SP", "EX" };
+
+static void decode_at(const uint16_t *image, uint32_t pc, struct instruction_t *ins) {
+    uint16_t words[3] = { image[pc & 0xFFFF], image[(pc + 1) & 0xFFFF], image[(pc + 2) & 0xFFFF] };
+    decode_words(ins, pc, words);
+}
+
+static int is_if(const struct instruction_t *ins) {
+    return ins->op >= IFB && ins->op <= IFU;
+}
+
+static int translatable(const struct instruction_t *ins) {
+    if (ins->op & 0x20)
+        return ins->op == (0x20 | JSR);
+    return ins->op != 0x18 && ins->op != 0x19 && ins->op != 0x1C && ins->op != 0x1D;
+}
+
+static int ends_block(const struct instruction_t *ins) {
+    return ins->op == (0x20 | JSR) || (!(ins->op & 0x20) && !is_if(ins) && ins->b == 0x1C);
+}
+
+// The value of a when it's known before running, -1 otherwise
+static int32_t constant_a(const struct instruction_t *ins) {
+    if (ins->a >= 0x20)
+        return (uint16_t)(ins->a - 0x21);
+    return ins->a == 0x1F ? ins->a_word : -1;
+}
+
+// Where a failed IFx lands and what skipping there costs, UINT32_MAX if the chain runs off the end of memory
+static uint32_t skip_chain(const uint16_t *image, uint32_t pc, uint32_t *cycles) {
+    struct instruction_t ins;
+    *cycles = 0;
+    do {
+        if (pc > 0xFFFF)
+            return UINT32_MAX;
+        decode_at(image, pc, &ins);
+        *cycles += 2;
+        pc += ins.length;
+    } while (is_if(&ins));
+    return pc;
+}
+
+static void gather(const uint16_t *image, uint16_t start, block_t *blk) {
+    uint32_t pc = start;
+    blk->count = 0;
+    blk->cover = start;
+    blk->max_cycles = 0;
+    while (blk->count < AOT_MAX_INSTRUCTIONS) {
+        struct instruction_t *ins = &blk->list[blk->count];
+        decode_at(image, pc, ins);
+        if (pc + ins->length > 0x10000 || !translatable(ins))
+            break;
+        if (is_if(ins)) {
+            uint32_t cycles, target = skip_chain(image, pc + ins->length, &cycles);
+            if (target > 0xFFFF)
+                break;
+            blk->max_cycles += cycles;
+            if (target > blk->cover)
+                blk->cover = target;
+        }
+        blk->count++;
+        blk->max_cycles += ins->cycles;
+        pc += ins->length;
+        if (ends_block(ins))
+            break;
+    }
+    blk->end = pc;
+    if (pc > blk->cover)
+        blk->cover = pc;
+}
+
+static void enqueue(translator_t *t, uint32_t pc) {
+    if (pc > 0xFFFF || t->queued[pc])
+        return;
+    t->queued[pc] = 1;
+    t->stack[t->depth++] = pc;
+}
+
+static void successors(translator_t *t, const block_t *blk) {
+    struct instruction_t stop;
+    for (int i = 0; i < blk->count; i++) {
+        const struct instruction_t *ins = &blk->list[i];
+        int32_t target = constant_a(ins);
+        if (is_if(ins)) {
+            uint32_t cycles;
+            enqueue(t, skip_chain(t->image, ins->pc + ins->length, &cycles));
+        } else if (ins->op == (0x20 | JSR)) {
+            enqueue(t, ins->pc + ins->length);
+            if (target >= 0)
+                enqueue(t, target);
+        } else if (ins->b == 0x1C && ins->op == SET && target >= 0)
+            enqueue(t, target);
+    }
+    if (blk->count && ends_block(&blk->list[blk->count - 1]))
+        return;
+    if (blk->end > 0xFFFF)
+        return;
+    decode_at(t->image, blk->end, &stop);
+    if (translatable(&stop)) {
+        enqueue(t, blk->end);
+        return;
+    }
+    // The interpreter runs whatever stopped the block, carry on after it where that's where it goes next
+    switch (stop.op) {
+        case 0x20 | IAS:
+            if (constant_a(&stop) >= 0)
+                enqueue(t, constant_a(&stop));
+            // fallthrough
+        case 0x20 | INT:
+        case 0x20 | IAG:
+        case 0x20 | IAQ:
+        case 0x20 | HWN:
+        case 0x20 | HWQ:
+        case 0x20 | HWI:
+            enqueue(t, blk->end + stop.length);
+            break;
+    }
+}
+
+static const char* reg(translator_t *t, int r) {
+    t->regs |= 1 << r;
+    return names[r];
+}
+
+static const char* assign(translator_t *t, int r) {
+    t->assigned |= 1 << r;
+    return reg(t, r);
+}
+
+// a as the basic opcodes read it
+static void operand_a(translator_t *t, const struct instruction_t *ins, char *dst) {
+    uint16_t v = ins->a, pc = ins->pc;
+    switch (v) {
+        case 0x00 ... 0x07: sprintf(dst, "%s", reg(t, v)); break;
+        case 0x08 ... 0x0F: sprintf(dst, "m[%s]", reg(t, v - 0x08)); break;
+        case 0x10 ... 0x17: sprintf(dst, "m[(uint16_t)(%s + 0x%04x)]", reg(t, v - 0x10), ins->a_word); break;
+        case 0x18:          sprintf(dst, "m[%s++]", assign(t, SP)); break;
+        case 0x19:          sprintf(dst, "m[%s]", reg(t, SP)); break;
+        case 0x1A:          sprintf(dst, "m[(uint16_t)(%s + 0x%04x)]", reg(t, SP), ins->a_word); break;
+        case 0x1B:          sprintf(dst, "%s", reg(t, SP)); break;
+        case 0x1C:          sprintf(dst, "0x%04x", (uint16_t)(pc + 1)); break;
+        case 0x1D:          sprintf(dst, "%s", reg(t, EX)); break;
+        case 0x1E:          sprintf(dst, "m[0x%04x]", ins->a_word); break;
+        default:            sprintf(dst, "0x%04x", (uint16_t)constant_a(ins)); break;
+    }
+    t->uses_m |= *dst == 'm';
+}
+
+// a as the special opcodes read it, through the same path as b
+static void operand_special(translator_t *t, const struct instruction_t *ins, char *dst) {
+    switch (ins->a) {
+        case 0x18: sprintf(dst, "m[--%s]", assign(t, SP)); break;
+        case 0x1C: sprintf(dst, "0x%04x", (uint16_t)(ins->pc + ins->length)); break;
+        case 0x1F: sprintf(dst, "m[0x%04x]", (uint16_t)(ins->pc + 1)); break;
+        default:   operand_a(t, ins, dst); break;
+    }
+    t->uses_m |= *dst == 'm';
+}
+
+// Emits the address calculation for b in memory (returns 1), or names the register b is
+static int operand_b(translator_t *t, const struct instruction_t *ins, char *dst) {
+    FILE *out = t->out;
+    uint16_t v = ins->b;
+    switch (v) {
+        case 0x00 ... 0x07:
+        case 0x1B ... 0x1D:
+            sprintf(dst, "%s", assign(t, v < 0x08 ? v : v == 0x1B ? SP : v == 0x1C ? PC : EX));
+            return 0;
+    }
+    t->uses_ad = 1;
+    switch (v) {
+        case 0x08 ... 0x0F: fprintf(out, "    ad = %s;\n", reg(t, v - 0x08)); break;
+        case 0x10 ... 0x17: fprintf(out, "    ad = %s + 0x%04x;\n", reg(t, v - 0x10), ins->b_word); break;
+        case 0x18:          fprintf(out, "    ad = --%s;\n", assign(t, SP)); break;
+        case 0x19:          fprintf(out, "    ad = %s;\n", reg(t, SP)); break;
+        case 0x1A:          fprintf(out, "    ad = %s + 0x%04x;\n", reg(t, SP), ins->b_word); break;
+        case 0x1E:          fprintf(out, "    ad = 0x%04x;\n", ins->b_word); break;
+        case 0x1F:          fprintf(out, "    ad = 0x%04x;\n", (uint16_t)(ins->pc + ins->length - 1)); break;
+    }
+    strcpy(dst, "m[ad]");
+    return 1;
+}
+
+static void jump(translator_t *t, uint32_t pc) {
+    int32_t next = pc <= 0xFFFF ? t->index[pc] : -1;
+    fprintf(t->out, "    PC = 0x%04x;\n", pc & 0xFFFF);
+    if (next >= 0)
+        fprintf(t->out, "    next = %d;\n    goto out;\n", next);
+    else
+        fprintf(t->out, "    next = CPU_AOT_EXIT;\n    goto out;\n");
+}
+
+// The same expressions as cpu_run on the same values, shift counts wrap at 32 as the host's do there
+static void operation(translator_t *t, const struct instruction_t *ins, const char *b) {
+    FILE *out = t->out;
+    const char *ex = NULL;
+    switch (ins->op) {
+        case ADD ... MLI:
+        case DIV ... DVI:
+        case SHR ... SHL:
+        case ADX ... SBX:
+            ex = assign(t, EX);
+            break;
+    }
+    switch (ins->op) {
+        case SET: fprintf(out, "    %s = a;\n", b); break;
+        case ADD:
+            fprintf(out, "    %s = (((uint32_t)%s + (uint32_t)a) >> 16) & 0xFFFF;\n    %s = %s + a;\n", ex, b, b, b);
+            break;
+        case SUB:
+            fprintf(out, "    %s = (((int32_t)%s - (int32_t)a) >> 16) & 0xFFFF;\n    %s = %s - a;\n", ex, b, b, b);
+            break;
+        case MUL:
+            fprintf(out, "    %s = (((uint32_t)%s * (uint32_t)a) >> 16) & 0xFFFF;\n    %s = (uint32_t)%s * a;\n",
+                    ex, b, b, b);
+            break;
+        case MLI:
+            fprintf(out, "    %s = ((int32_t)((uint32_t)%s * (uint32_t)a) >> 16) & 0xFFFF;\n"
+                         "    %s = (int16_t)%s * (int16_t)a;\n",
+                    ex, b, b, b);
+            break;
+        case DIV:
+            fprintf(out, "    if (a == 0) {\n        %s = 0;\n        %s = 0;\n    } else {\n"
+                         "        %s = (((uint32_t)%s << 16) / (uint32_t)a) & 0xFFFF;\n        %s = %s / a;\n    }\n",
+                    ex, b, ex, b, b, b);
+            break;
+        case DVI:
+            fprintf(out, "    if (a == 0) {\n        %s = 0;\n        %s = 0;\n    } else {\n"
+                         "        %s = ((int32_t)((uint32_t)%s << 16) / (int32_t)a) & 0xFFFF;\n"
+                         "        %s = (int16_t)%s / (int16_t)a;\n    }\n",
+                    ex, b, ex, b, b, b);
+            break;
+        case MOD: fprintf(out, "    %s = a == 0 ? 0 : %s %% a;\n", b, b); break;
+        case MDI: fprintf(out, "    %s = a == 0 ? 0 : (int16_t)%s %% (int16_t)a;\n", b, b); break;
+        case AND: fprintf(out, "    %s = %s & a;\n", b, b); break;
+        case BOR: fprintf(out, "    %s = %s | a;\n", b, b); break;
+        case XOR: fprintf(out, "    %s = %s ^ a;\n", b, b); break;
+        case SHR:
+            fprintf(out, "    %s = (((uint32_t)%s << 16) >> (a & 31)) & 0xFFFF;\n    %s = %s >> (a & 31);\n",
+                    ex, b, b, b);
+            break;
+        case ASR:
+            fprintf(out, "    %s = (((uint32_t)%s << 16) >> (a & 31)) & 0xFFFF;\n    %s = (int16_t)%s >> (a & 31);\n",
+                    ex, b, b, b);
+            break;
+        case SHL:
+            fprintf(out, "    %s = (((uint32_t)%s << (a & 31)) >> 16) & 0xFFFF;\n    %s = (uint32_t)%s << (a & 31);\n",
+                    ex, b, b, b);
+            break;
+        case ADX:
+            t->uses_ex = 1;
+            fprintf(out, "    ex = (((uint32_t)%s + (uint32_t)a + (uint32_t)EX) >> 16) & 0xFFFF;\n"
+                         "    %s += (a + EX);\n    EX = ex;\n", b, b);
+            break;
+        case SBX:
+            t->uses_ex = 1;
+            fprintf(out, "    ex = (((int32_t)%s - ((int32_t)a + (int32_t)EX)) >> 16) & 0xFFFF;\n"
+                         "    %s -= (a + EX);\n    EX = ex;\n", b, b);
+            break;
+        case STI:
+        case STD:
+            fprintf(out, "    %s = a;\n    %s %s= 1;\n    %s %s= 1;\n", b, assign(t, 6), ins->op == STI ? "+" : "-",
+                    assign(t, 7), ins->op == STI ? "+" : "-");
+            break;
+    }
+}
+
+static const char* condition(int op) {
+    switch (op) {
+        case IFB: return "(%s & a) != 0";
+        case IFC: return "(%s & a) == 0";
+        case IFE: return "%s == a";
+        case IFN: return "%s != a";
+        case IFG: return "%s > a";
+        case IFL: return "%s < a";
+        case IFA: return "(int16_t)%s > (int16_t)a";
+        default:  return "(int16_t)%s < (int16_t)a";
+    }
+}
+
+// Leave the block if that store hit translated code, it may have been this block
+static void stored(translator_t *t, uint16_t pc_after) {
+    fprintf(t->out, "    if (cpu->page_flags[ad >> CPU_PAGE_SHIFT] && cpu_aot_written(cpu, ad)) {\n"
+                    "        PC = 0x%04x;\n        next = CPU_AOT_LOOKUP;\n        goto out;\n    }\n", pc_after);
+}
+
+static void instruction(translator_t *t, const block_t *blk, const struct instruction_t *ins) {
+    FILE *out = t->out;
+    uint16_t pc = ins->pc, pc_after = pc + ins->length;
+    uint16_t words[3] = { t->image[pc], t->image[(uint16_t)(pc + 1)], t->image[(uint16_t)(pc + 2)] };
+    char text[32], a[48], b[48];
+    disassemble(words, text);
+    fprintf(out, "    // %04x: %s\n    cycles += %d;\n", pc, text, ins->cycles);
+    t->uses_a = 1;
+
+    if (ins->op == (0x20 | JSR)) {
+        operand_special(t, ins, a);
+        fprintf(out, "    a = %s;\n    ad = --%s;\n    m[ad] = 0x%04x;\n    PC = a;\n", a, assign(t, SP), pc_after);
+        t->uses_ad = 1;
+        fprintf(out, "    if (cpu->page_flags[ad >> CPU_PAGE_SHIFT] && cpu_aot_written(cpu, ad)) {\n"
+                     "        next = CPU_AOT_LOOKUP;\n        goto out;\n    }\n");
+        int32_t target = constant_a(ins);
+        if (target >= 0 && t->index[target] >= 0)
+            fprintf(out, "    next = %d;\n    goto out;\n", t->index[target]);
+        else
+            fprintf(out, "    next = CPU_AOT_LOOKUP;\n    goto out;\n");
+        return;
+    }
+
+    operand_a(t, ins, a);
+    fprintf(out, "    a = %s;\n", a);
+    if (ins->b == 0x1C)
+        fprintf(out, "    PC = 0x%04x;\n", pc_after);
+    int memory = operand_b(t, ins, b);
+
+    if (is_if(ins)) {
+        uint32_t cycles, target = skip_chain(t->image, pc_after, &cycles);
+        fprintf(out, "    if (!(");
+        fprintf(out, condition(ins->op), b);
+        fprintf(out, ")) {\n        cycles += %u;\n", cycles);
+        int32_t next = t->index[target];
+        fprintf(out, "        PC = 0x%04x;\n        next = %s;\n        goto out;\n    }\n", target,
+                next >= 0 ? (sprintf(a, "%d", next), a) : "CPU_AOT_EXIT");
+        return;
+    }
+
+    operation(t, ins, b);
+    if (memory)
+        stored(t, pc_after);
+    if (ins->b != 0x1C)
+        return;
+    int32_t target = constant_a(ins);
+    if (ins->op == SET && target == blk->list[0].pc) {
+        // Back to the top while another pass is sure to fit in the budget
+        t->loops = 1;
+        fprintf(out, "    if (cycles <= end && end - cycles >= %u &&\n"
+                     "        !__atomic_load_n(&cpu->posted_pending, __ATOMIC_RELAXED))\n        goto top;\n",
+                blk->max_cycles);
+    }
+    if (ins->op == SET && target >= 0 && t->index[target] >= 0)
+        fprintf(out, "    next = %d;\n    goto out;\n", t->index[target]);
+    else
+        fprintf(out, "    next = CPU_AOT_LOOKUP;\n    goto out;\n");
+}
+
+static int emit_block(translator_t *t, const block_t *blk, FILE *body) {
+    t->regs = t->assigned = (1 << PC);
+    t->uses_a = t->uses_ad = t->uses_ex = t->uses_m = t->loops = 0;
+    t->out = body;
+    for (int i = 0; i < blk->count; i++)
+        instruction(t, blk, &blk->list[i]);
+    const struct instruction_t *last = &blk->list[blk->count - 1];
+    if (!ends_block(last))
+        jump(t, blk->end);
+    return ferror(body) ? -1 : 0;
+}
+
+int aot_translate(const uint16_t image[0x10000], const uint16_t *entries, int count, const char *name, FILE *out) {
+    translator_t t = { image };
+    t.queued = calloc(0x10000, 1);
+    t.stack = malloc(0x10000 * sizeof(uint16_t));
+    t.index = malloc(0x10000 * sizeof(int32_t));
+    uint16_t *starts = malloc(0x10000 * sizeof(uint16_t));
+    int blocks = 0, result = -1;
+    char *text = NULL;
+    size_t length = 0;
+    FILE *body = NULL;
+    block_t *blk = malloc(sizeof(block_t));
+    if (!t.queued || !t.stack || !t.index || !starts || !blk)
+        goto FAIL;
+
+    // Find every block start reachable without running anything
+    if (count)
+        for (int i = 0; i < count; i++)
+            enqueue(&t, entries[i]);
+    else
+        enqueue(&t, 0);
+    while (t.depth) {
+        uint16_t pc = t.stack[--t.depth];
+        gather(image, pc, blk);
+        successors(&t, blk);
+    }
+    for (uint32_t pc = 0; pc < 0x10000; pc++) {
+        t.index[pc] = -1;
+        if (!t.queued[pc])
+            continue;
+        gather(image, pc, blk);
+        if (blk->count) {
+            t.index[pc] = blocks;
+            starts[blocks++] = pc;
+        }
+    }
+
+    fprintf(out, "// Translated by aot_translate, link against ccpu and pass &%s to cpu_aot_enable\n"
+                 "#include \"ccpu.h\"\n\n", name);
+    uint64_t covered[0x10000 / 64] = {0};
+    for (int i = 0; i < blocks; i++) {
+        gather(image, starts[i], blk);
+        for (uint32_t a = starts[i]; a < blk->cover; a++)
+            covered[a >> 6] |= 1ull << (a & 63);
+        fprintf(out, "static const uint16_t %s_words_%04x[] = {", name, starts[i]);
+        for (uint32_t a = starts[i]; a < blk->cover; a++)
+            fprintf(out, "%s0x%04x", a == starts[i] ? "" : ", ", image[a]);
+        fprintf(out, "};\n\n");
+
+        if (!(body = open_memstream(&text, &length)) || emit_block(&t, blk, body) < 0)
+            goto FAIL;
+        fclose(body);
+        body = NULL;
+        // Every access through ad is to memory
+        fprintf(out, "static int %s_block_%04x(struct cpu_t *cpu, uint64_t end) {\n%s", name, starts[i],
+                t.uses_m || t.uses_ad ? "    uint16_t *m = cpu->memory;\n" : "");
+        for (int r = 0; r <= EX; r++)
+            if (t.regs & 1 << r)
+                fprintf(out, "    uint16_t %s = cpu->reg[%d];\n", names[r], r);
+        fprintf(out, "    uint64_t cycles = cpu->cycles;\n%s%s%s    int next;\n",
+                t.uses_a ? "    uint16_t a;\n" : "", t.uses_ad ? "    uint16_t ad;\n" : "",
+                t.uses_ex ? "    uint16_t ex;\n" : "");
+        fprintf(out, "%s%sout:\n", t.loops ? "top:\n" : "", text);
+        for (int r = 0; r <= EX; r++)
+            if (t.assigned & 1 << r)
+                fprintf(out, "    cpu->reg[%d] = %s;\n", r, names[r]);
+        fprintf(out, "    cpu->cycles = cycles;\n    return next;\n}\n\n");
+        free(text);
+        text = NULL;
+    }
+
+    fprintf(out, "static const uint64_t %s_covered[] = {", name);
+    for (int i = 0; i < 0x10000 / 64; i++)
+        fprintf(out, "%s0x%llxull", i % 8 ? ", " : i ? ",\n    " : "\n    ", (unsigned long long)covered[i]);
+    fprintf(out, "\n};\n\nstatic const struct cpu_aot_block_t %s_blocks[] = {\n", name);
+    for (int i = 0; i < blocks; i++) {
+        gather(image, starts[i], blk);
+        fprintf(out, "    { 0x%04x, 0x%05x, %u, %s_words_%04x, %s_block_%04x },\n",
+                starts[i], blk->cover, blk->max_cycles, name, starts[i], name, starts[i]);
+    }
+    fprintf(out, "};\n\nconst struct cpu_aot_t %s = { %s_blocks, %d, %s_covered };\n", name, name, blocks, name);
+    result = ferror(out) ? -1 : blocks;
+
+FAIL:
+    if (body)
+        fclose(body);
+    free(text);
+    free(blk);
+    free(starts);
+    free(t.index);
+    free(t.stack);
+    free(t.queued);
+    return result;
+}
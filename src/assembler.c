@@ -26,20 +26,57 @@
 #include "ccpu.h"
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
 typedef struct label_t {
-    const char *name;
-    uint16_t pc;
-    struct label_t *next;
+    uint32_t name;    // Offset into the object's name arena
+    uint32_t length;
+    uint32_t hash;
+    int defined;
+    int statement;    // Index of the statement the label is attached to
+    uint32_t pc;
+    struct label_t *definition; // Set by the linker, the label itself when defined locally
 } label_t;
 
 typedef struct {
-    uint16_t *dst, buf[0x10000];
-    const char *src;
-    size_t src_length;
-    int col, row, pc;
+    uint8_t mode;     // Operand field, 0x1F for a literal in the next word
+    uint8_t has_word;
+    uint8_t inline_literal; // Encoded in the operand field (0x20-0x3F) instead of the next word
+    int label;        // Index into the object's labels, value is label pc + value when not -1
+    uint16_t value;
+} operand_t;
+
+enum {
+    sBOP, sSPC, sDAT
+};
+
+typedef struct {
+    int kind;
+    uint8_t op;
+    operand_t a, b;
+    operand_t *data;  // DAT words
+    int data_count;
+    uint32_t pc;
+    int row;
+} statement_t;
+
+// An assembled but unlinked translation unit. Instructions are kept parsed rather than encoded so
+// the linker can relax short form literals against final addresses across every unit
+struct object_t {
+    int row;
     label_t *labels;
-} assembler_t;
+    int label_count, label_capacity;
+    int *buckets;     // Open addressing symbol table of label index + 1
+    uint32_t bucket_mask;
+    char *names;
+    size_t names_length, names_capacity;
+    statement_t *statements;
+    int statement_count, statement_capacity;
+    uint32_t end;     // Address past the object's last word after layout
+};
+
+typedef struct object_t object_t;
 
 typedef struct {
     const char *name;
@@ -90,305 +127,753 @@ static opcode_t special_ops[] = {
 };
 #define SPECIAL_OP_LEN (sizeof(special_ops) / sizeof(special_ops[0]))
 
-static void to_upper(char *word, size_t length) {
-    for (char *cursor = word; *cursor; cursor++)
-        if (*cursor >= 'a' && *cursor <= 'z')
-            *cursor -= 32;
-}
-
-static char* read_word(char *cursor, size_t *length) {
-    static char buffer[128];
-    memset(buffer, 0, 128);
-    buffer[0] = '\0';
-    int _length = 0, off = 0;
-    char *word = cursor;
-    while (*word++ != ' ')
-        _length++;
-    if (!_length)
-        return NULL; // Unexpected error
-    if (_length > 128)
-        return NULL; // Overflow error, word too long
-    memcpy(buffer, cursor + off, _length * sizeof(char));
-    to_upper(buffer, _length);
-    if (length)
-        *length = _length;
-    return buffer;
-}
-
-static int lookup(char *word, size_t length, int *index) {
-    int i, result = 0;
-    for (i = 0; i < BASIC_OP_LEN; i++)
-        if (!strncmp(word, basic_ops[i].name, length)) {
-            result = 1;
-            goto END; // Name matches basic op
-        }
-    for (i = 0; i < SPECIAL_OP_LEN; i++)
-        if (!strncmp(word, special_ops[i].name, length)) {
-            result = 2;
-            goto END; // Name matches special op
-        }
-    i = -1;
-END:
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skip_whitespace(const char *cursor, const char *end) {
+    while (cursor < end && is_space(*cursor))
+        cursor++;
+    return cursor;
+}
+
+static const char* trim_end(const char *start, const char *end) {
+    while (end > start && is_space(end[-1]))
+        end--;
+    return end;
+}
+
+static int upper(char c) {
+    return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+// Case insensitive comparison of a word against a keyword
+static int match(const char *word, size_t length, const char *keyword) {
+    size_t i = 0;
+    for (; i < length && keyword[i]; i++)
+        if (upper(word[i]) != keyword[i])
+            return 0;
+    return i == length && !keyword[i];
+}
+
+// Perfect hash of the three letter mnemonics, five bits per letter so case doesn't matter.
+// Entries are kind << 5 | index, kind being 1 for basic ops, 2 for special ops and 3 for DAT
+#define MNEMONIC_HASH(w) ((uint32_t)(((w)[0] & 31) << 10 | ((w)[1] & 31) << 5 | ((w)[2] & 31)) * 0x5ef0edd5u >> 26)
+static const uint8_t mnemonics[64] = {
+    0x00, 0x25, 0x2b, 0x45, 0x00, 0x00, 0x00, 0x00,
+    0x37, 0x2c, 0x38, 0x00, 0x30, 0x39, 0x2a, 0x00,
+    0x46, 0x32, 0x20, 0x44, 0x00, 0x60, 0x42, 0x3a,
+    0x47, 0x29, 0x48, 0x27, 0x41, 0x34, 0x26, 0x22,
+    0x00, 0x00, 0x35, 0x00, 0x00, 0x00, 0x00, 0x23,
+    0x00, 0x00, 0x00, 0x33, 0x24, 0x21, 0x00, 0x28,
+    0x00, 0x00, 0x43, 0x40, 0x00, 0x2f, 0x00, 0x36,
+    0x00, 0x00, 0x2e, 0x2d, 0x31, 0x00, 0x00, 0x00,
+};
+
+static int lookup(const char *word, size_t length, int *index) {
+    if (length != 3)
+        return 0;
+    uint8_t entry = mnemonics[MNEMONIC_HASH(word)];
+    const char *name;
+    switch (entry >> 5) {
+        case 1:
+            name = basic_ops[entry & 31].name;
+            break;
+        case 2:
+            name = special_ops[entry & 31].name;
+            break;
+        case 3:
+            name = "DAT";
+            break;
+        default:
+            return 0;
+    }
+    if (!match(word, length, name))
+        return 0; // Hash collision with a non-mnemonic
     if (index)
-        *index = i;
-    return result;
+        *index = entry & 31;
+    return entry >> 5;
 }
 
-static int process_label(assembler_t *ass, char *word, size_t length) {
-    char *name = word + 1;
-    if (*name == '\0' || !name || length <= 1)
+// General purpose registers are 0-7, SP is 8
+static int lookup_register(const char *word, size_t length) {
+    static const char *regs = "ABCXYZIJ";
+    if (length == 1)
+        for (int i = 0; i < 8; i++)
+            if (regs[i] == upper(*word))
+                return i;
+    if (match(word, length, "SP"))
+        return 8;
+    return -1;
+}
+
+static int is_keyword(const char *word, size_t length) {
+    static const char *keywords[] = { "PC", "EX", "PUSH", "POP", "PEEK", "PICK" };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+        if (match(word, length, keywords[i]))
+            return 1;
+    return lookup_register(word, length) >= 0;
+}
+
+static int is_label_name(const char *word, size_t length) {
+    if (!length)
         return 0;
-    for (char *cursor = name; *cursor; cursor++) {
-        char c = *cursor;
-        switch (c) {
+    for (size_t i = 0; i < length; i++)
+        switch (word[i]) {
+            case '0' ... '9':
+                if (!i)
+                    return 0;
             case 'A' ... 'Z':
+            case 'a' ... 'z':
             case '_':
+            case '.':
                 break;
             default:
                 return 0; // Invalid character in label
         }
+    return !is_keyword(word, length);
+}
+
+static uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+static int grow_symbols(object_t *obj) {
+    uint32_t size = obj->bucket_mask ? (obj->bucket_mask + 1) * 2 : 256;
+    int *buckets = calloc(size, sizeof(int));
+    if (!buckets)
+        return 0;
+    for (int i = 0; i < obj->label_count; i++) {
+        uint32_t slot = obj->labels[i].hash & (size - 1);
+        while (buckets[slot])
+            slot = (slot + 1) & (size - 1);
+        buckets[slot] = i + 1;
     }
-    
-    int type = lookup(name, length-1, NULL);
-    if (type > 0)
-        return 0; // Name is an op
-    
-    label_t *cursor = ass->labels;
-    if (cursor)
-        for (;;) {
-            if (!strncmp(cursor->name, name, length-1))
-                return 0; // Already defined
-            if (!cursor->next)
+    free(obj->buckets);
+    obj->buckets = buckets;
+    obj->bucket_mask = size - 1;
+    return 1;
+}
+
+// Returns the index of the label, adding it undefined if it hasn't been seen before, or -1 on error
+static int find_label(object_t *obj, const char *name, size_t length) {
+    uint32_t hash = hash_name(name, length);
+    if (obj->bucket_mask) {
+        uint32_t slot = hash & obj->bucket_mask;
+        for (; obj->buckets[slot]; slot = (slot + 1) & obj->bucket_mask) {
+            label_t *label = &obj->labels[obj->buckets[slot] - 1];
+            if (label->hash == hash && label->length == length &&
+                !memcmp(obj->names + label->name, name, length))
+                return obj->buckets[slot] - 1;
+        }
+    }
+    if ((uint32_t)obj->label_count * 2 >= obj->bucket_mask && !grow_symbols(obj))
+        return -1;
+    if (obj->label_count == obj->label_capacity) {
+        int capacity = obj->label_capacity ? obj->label_capacity * 2 : 64;
+        label_t *labels = realloc(obj->labels, capacity * sizeof(label_t));
+        if (!labels)
+            return -1;
+        obj->labels = labels;
+        obj->label_capacity = capacity;
+    }
+    // Names are kept NUL terminated so object_symbols can hand them out directly
+    if (obj->names_length + length + 1 > obj->names_capacity) {
+        size_t capacity = obj->names_capacity ? obj->names_capacity * 2 : 4096;
+        while (capacity < obj->names_length + length + 1)
+            capacity *= 2;
+        char *names = realloc(obj->names, capacity);
+        if (!names)
+            return -1;
+        obj->names = names;
+        obj->names_capacity = capacity;
+    }
+    memcpy(obj->names + obj->names_length, name, length);
+    obj->names[obj->names_length + length] = '\0';
+    label_t *label = &obj->labels[obj->label_count];
+    memset(label, 0, sizeof(label_t));
+    label->name = (uint32_t)obj->names_length;
+    label->length = (uint32_t)length;
+    label->hash = hash;
+    obj->names_length += length + 1;
+    uint32_t slot = hash & obj->bucket_mask;
+    while (obj->buckets[slot])
+        slot = (slot + 1) & obj->bucket_mask;
+    obj->buckets[slot] = obj->label_count + 1;
+    return obj->label_count++;
+}
+
+static int process_label(object_t *obj, const char *name, size_t length) {
+    if (!is_label_name(name, length))
+        return 0; // Invalid label name
+    int index = find_label(obj, name, length);
+    if (index < 0 || obj->labels[index].defined)
+        return 0; // Already defined
+    label_t *label = &obj->labels[index];
+    label->defined = 1;
+    label->statement = obj->statement_count;
+    return 1;
+}
+
+static int parse_number(const char *word, size_t length, uint16_t *out) {
+    size_t i = 0;
+    int negative = 0, base = 10;
+    if (i < length && *word == '-') {
+        negative = 1;
+        i++;
+    }
+    if (length - i > 2 && word[i] == '0' && (word[i + 1] == 'x' || word[i + 1] == 'X')) {
+        base = 16;
+        i += 2;
+    } else if (length - i > 2 && word[i] == '0' && (word[i + 1] == 'b' || word[i + 1] == 'B')) {
+        base = 2;
+        i += 2;
+    }
+    if (i == length)
+        return 0;
+    uint32_t value = 0;
+    for (; i < length; i++) {
+        int digit;
+        switch (word[i]) {
+            case '0' ... '9':
+                digit = word[i] - '0';
+                break;
+            case 'a' ... 'f':
+                digit = word[i] - 'a' + 10;
+                break;
+            case 'A' ... 'F':
+                digit = word[i] - 'A' + 10;
                 break;
-            else
-                cursor = cursor->next;
+            default:
+                return 0; // Invalid number
         }
-    
-    label_t *new = malloc(sizeof(label_t));
-    new->name = strdup(name);
-    new->pc   = ass->pc;
-    new->next = NULL;
-    if (cursor)
-        cursor->next = new;
-    else
-        ass->labels = new;
+        if (digit >= base || (value = value * base + digit) > 0xFFFF)
+            return 0; // Invalid number or out of range
+    }
+    *out = negative ? -value : value;
     return 1;
 }
 
-#define INCR(N)      \
-do {                 \
-    ass->col += (N); \
-    cursor += (N);   \
-} while(0)
+// A sum of numbers, at most one label and (if reg isn't NULL) at most one register. Returns how many
+// numbers and labels were found, or -1 on error
+static int parse_terms(object_t *obj, const char *word, const char *end, operand_t *operand, int *reg) {
+    int values = 0;
+    operand->label = -1;
+    operand->value = 0;
+    if (reg)
+        *reg = -1;
+    for (const char *term = word; term <= end;) {
+        const char *plus = memchr(term, '+', end - term);
+        const char *term_end = plus ? plus : end;
+        const char *start = skip_whitespace(term, term_end);
+        term_end = trim_end(start, term_end);
+        size_t length = term_end - start;
+        uint16_t number;
+        int r;
+        if (!length)
+            return -1; // Missing term
+        if (reg && (r = lookup_register(start, length)) >= 0) {
+            if (*reg >= 0)
+                return -1; // Only one register can be used as a base
+            *reg = r;
+        } else if (parse_number(start, length, &number)) {
+            operand->value += number;
+            values++;
+        } else if (operand->label < 0 && is_label_name(start, length)) {
+            if ((operand->label = find_label(obj, start, length)) < 0)
+                return -1;
+            values++;
+        } else
+            return -1; // Invalid term
+        if (!plus)
+            break;
+        term = plus + 1;
+    }
+    return values;
+}
 
-static char* skip_whitespace(assembler_t *ass, char *cursor) {
-    int n = 0;
-    char *skip = cursor;
-    while (*skip == ' ' && *skip++ != '\0')
-        n++;
-    ass->col += n;
-    return skip;
+static int process_operand(object_t *obj, const char *word, const char *end, operand_t *operand, int is_a) {
+    size_t length = end - word;
+    int reg, values;
+    memset(operand, 0, sizeof(operand_t));
+    operand->label = -1;
+    if (!length)
+        return 0; // Missing operand
+    if (*word == '[') {
+        if (end[-1] != ']')
+            return 0; // Unterminated address
+        if ((values = parse_terms(obj, word + 1, end - 1, operand, &reg)) < 0)
+            return 0;
+        if (reg < 0) {
+            if (!values)
+                return 0; // Empty address
+            operand->mode = 0x1E;
+        } else if (reg == 8)
+            operand->mode = values ? 0x1A : 0x19;
+        else
+            operand->mode = (values ? 0x10 : 0x08) + reg;
+        operand->has_word = values > 0;
+        return 1;
+    }
+    if (match(word, length, "PUSH") || match(word, length, "POP")) {
+        operand->mode = 0x18;
+        return 1;
+    }
+    if (match(word, length, "PEEK")) {
+        operand->mode = 0x19;
+        return 1;
+    }
+    if (length > 4 && match(word, 4, "PICK") && is_space(word[4])) {
+        if (parse_terms(obj, word + 5, end, operand, NULL) <= 0)
+            return 0;
+        operand->mode = 0x1A;
+        operand->has_word = 1;
+        return 1;
+    }
+    if (match(word, length, "PC")) {
+        operand->mode = 0x1C;
+        return 1;
+    }
+    if (match(word, length, "EX")) {
+        operand->mode = 0x1D;
+        return 1;
+    }
+    if ((reg = lookup_register(word, length)) >= 0) {
+        operand->mode = reg == 8 ? 0x1B : reg;
+        return 1;
+    }
+    if (parse_terms(obj, word, end, operand, NULL) <= 0)
+        return 0;
+    // Only a can hold a literal inline, start optimistic and let relaxation widen it if the value doesn't fit
+    operand->mode = 0x1F;
+    operand->has_word = 1;
+    operand->inline_literal = is_a;
+    return 1;
 }
 
-enum {
-    tERROR, tOBRKT, tREG, tRADDR, tLITERAL, tINTEGER
-};
+static statement_t* new_statement(object_t *obj, int kind) {
+    if (obj->statement_count == obj->statement_capacity) {
+        int capacity = obj->statement_capacity ? obj->statement_capacity * 2 : 256;
+        statement_t *statements = realloc(obj->statements, capacity * sizeof(statement_t));
+        if (!statements)
+            return NULL;
+        obj->statements = statements;
+        obj->statement_capacity = capacity;
+    }
+    statement_t *st = &obj->statements[obj->statement_count++];
+    memset(st, 0, sizeof(statement_t));
+    st->kind = kind;
+    st->row = obj->row;
+    return st;
+}
 
-static uint16_t process_operand(assembler_t *ass, char *word, size_t length, int *type) {
-    switch (*word) {
-        case '[':
-            if (*type == tOBRKT)
-                *type = tERROR;
-            else
-                *type = tOBRKT;
-            char *w = skip_whitespace(ass, word + 1);
-            ass->col++;
-            return process_operand(ass, w, length - 1, type);
-        case '0' ... '9':;
-            if (*word == '0' &&
-                (length == 6 || length == 4) &&
-                (word[1] == 'X' || word[1] == 'x')) {
-                for (const char *tmp = word + 2; *tmp; tmp++)
-                    switch (*tmp) {
-                        case '0' ... '9':
-                        case 'a' ... 'f':
-                        case 'A' ... 'F':
-                            break;
-                        default:
-                            return -1; // Invalid number
-                    }
-                *type = tLITERAL;
-                return strtol(word, NULL, 16);
-            }
-            const char *tmp_number = word;
-            for (; *tmp_number; tmp_number++)
-                if (*tmp_number < '0' || *tmp_number > '9')
-                    return -1; // Invalid number
-            *type = tINTEGER;
-            return atoi(tmp_number);
-        case 'A' ... 'Z':
-        case 'a' ... 'z':
-        case '_':;
-            if (length == 1) {
-                switch (*word) {
-                    case 'A' ... 'C':
-                    case 'X' ... 'Z':
-                    case 'I':
-                    case 'J':;
-                        static const char *regs = "ABCXYZIJ";
-                        for (int i = 0; i < 8; i++)
-                            if (regs[i] == *word) {
-                                *type = tREG;
-                                return i & 7;
-                            }
-                }
-            } else if (length == 2) {
-                if (!strncmp(word, "SP", 2))
-                    return 0x1B;
-                if (!strncmp(word, "PC", 2))
-                    return 0x1C;
-                if (!strncmp(word, "EX", 2))
-                    return 0x1D;
+// Finds the next comma outside of brackets and quotes
+static const char* find_comma(const char *cursor, const char *end) {
+    int depth = 0, quoted = 0;
+    for (; cursor < end; cursor++)
+        switch (*cursor) {
+            case '"':
+                quoted = !quoted;
+                break;
+            case '[':
+                depth += !quoted;
+                break;
+            case ']':
+                depth -= !quoted;
+                break;
+            case ',':
+                if (!quoted && !depth)
+                    return cursor;
+                break;
+        }
+    return NULL;
+}
+
+static int process_bop(object_t *obj, const char *cursor, const char *end, int idx) {
+    const char *comma = find_comma(cursor, end);
+    if (!comma)
+        return 0; // Expected a comma
+    statement_t *st = new_statement(obj, sBOP);
+    if (!st)
+        return 0;
+    st->op = basic_ops[idx].value;
+    const char *second = skip_whitespace(comma + 1, end);
+    if (find_comma(second, end))
+        return 0; // Too many operands
+    return process_operand(obj, cursor, trim_end(cursor, comma), &st->b, 0) &&
+           process_operand(obj, second, trim_end(second, end), &st->a, 1);
+}
+
+static int process_spc(object_t *obj, const char *cursor, const char *end, int idx) {
+    if (find_comma(cursor, end))
+        return 0; // Too many operands
+    statement_t *st = new_statement(obj, sSPC);
+    if (!st)
+        return 0;
+    st->op = special_ops[idx].value;
+    return process_operand(obj, cursor, end, &st->a, 1);
+}
+
+static int process_dat(object_t *obj, const char *cursor, const char *end) {
+    statement_t *st = new_statement(obj, sDAT);
+    if (!st)
+        return 0;
+    int capacity = 0;
+    while (cursor < end) {
+        const char *comma = find_comma(cursor, end);
+        const char *item_end = trim_end(cursor, comma ? comma : end);
+        const char *chars = cursor + 1;
+        int count = 1;
+        if (item_end - cursor >= 2 && *cursor == '"' && item_end[-1] == '"')
+            count = (int)(item_end - cursor) - 2; // A string is a word per character
+        else if (item_end == cursor)
+            return 0; // Missing value
+        if (st->data_count + count > capacity) {
+            capacity = (st->data_count + count) * 2;
+            operand_t *data = realloc(st->data, capacity * sizeof(operand_t));
+            if (!data)
+                return 0;
+            st->data = data;
+        }
+        if (chars[-1] == '"' && item_end - cursor >= 2 && item_end[-1] == '"') {
+            for (int i = 0; i < count; i++) {
+                operand_t *word = &st->data[st->data_count++];
+                memset(word, 0, sizeof(operand_t));
+                word->label = -1;
+                word->value = (uint8_t)chars[i];
+                word->has_word = 1;
             }
-            const char *tmp_string = word;
-            for (; *tmp_string; tmp_string++)
-                switch (*tmp_string) {
-                    case 'A' ... 'Z':
-                    case 'a' ... 'z':
-                    case '_':
-                        break;
-                    default:
-                        return -1; // Invalid string
-                }
+        } else {
+            operand_t *word = &st->data[st->data_count++];
+            memset(word, 0, sizeof(operand_t));
+            if (parse_terms(obj, cursor, item_end, word, NULL) <= 0)
+                return 0;
+            word->has_word = 1;
+        }
+        if (!comma)
             break;
+        cursor = skip_whitespace(comma + 1, end);
+        if (cursor == end)
+            return 0; // Trailing comma
     }
-    return 0;
+    return 1;
 }
 
-static uint16_t read_first_operand(assembler_t *ass, char *cursor) {
-    size_t length;
-    cursor = skip_whitespace(ass, cursor);
-    char *word = read_word(cursor, &length);
-    if (!word || !length)
-        return -1;
-    if (word[length - 1] == ',')
-        word[--length] = '\0';
-    INCR(length);
-    int type;
-    return process_operand(ass, word, length, &type);
-}
-
-static int process_bop(assembler_t *ass, char *cursor, int idx) {
-    opcode_t *op = &basic_ops[idx];
-    
-    int prev_col = ass->col;
-    uint16_t b = read_first_operand(ass, cursor);
-    if (b < 0)
-        return 0; // Invalid operand
-    cursor += ass->col - prev_col;
-    
-    cursor = skip_whitespace(ass, cursor);
-    if (*cursor != ',')
-        return 0; // Expected a comma
-    else
-        INCR(1);
-    
-    cursor = skip_whitespace(ass, cursor);
-    size_t length;
-    char *second = read_word(cursor, &length);
-    int type;
-    uint16_t a = process_operand(ass, second, length, &type);
-    
+static int process_line(object_t *obj, const char *cursor, const char *end) {
+    // Strip comments, ignoring semicolons inside strings
+    int quoted = 0;
+    for (const char *c = cursor; c < end; c++)
+        if (*c == '"')
+            quoted = !quoted;
+        else if (*c == ';' && !quoted) {
+            end = c;
+            break;
+        }
+    end = trim_end(cursor, end);
+
+    for (;;) {
+        cursor = skip_whitespace(cursor, end);
+        if (cursor == end)
+            return 1;
+        const char *word = cursor;
+        while (cursor < end && !is_space(*cursor))
+            cursor++;
+        size_t length = cursor - word;
+        if (*word == ':') {
+            if (!process_label(obj, word + 1, length - 1))
+                return 0;
+            continue;
+        }
+        if (word[length - 1] == ':') {
+            if (!process_label(obj, word, length - 1))
+                return 0;
+            continue;
+        }
+
+        int idx;
+        const char *operands = skip_whitespace(cursor, end);
+        switch (lookup(word, length, &idx)) {
+            case 1:
+                return process_bop(obj, operands, end, idx);
+            case 2:
+                return process_spc(obj, operands, end, idx);
+            case 3:
+                return process_dat(obj, operands, end);
+            default:
+                return 0; // Unknown instruction
+        }
+    }
+}
+
+// Lines are slices of the source, so there's no limit on their length
+static int process(object_t *obj, const char *src, size_t length) {
+    const char *cursor = src, *end = src + length;
+    for (obj->row = 1; cursor < end; obj->row++) {
+        const char *eol = memchr(cursor, '\n', end - cursor);
+        if (!eol)
+            eol = end;
+        if (!process_line(obj, cursor, eol))
+            return 0;
+        cursor = eol + 1;
+    }
     return 1;
 }
 
-static void process_spc(assembler_t *ass, int idx) {
-    
+struct object_t* assemble_object(const char *src, size_t length) {
+    object_t *obj = calloc(1, sizeof(object_t));
+    if (!obj)
+        return NULL;
+    if (!process(obj, src, length)) {
+        object_destroy(obj);
+        return NULL;
+    }
+    return obj;
 }
 
-static int process_line(assembler_t *ass, char *line) {
-    char *cursor = line;
-    while (*cursor)
-        switch (*cursor) {
-            case ' ':
-            case '\r':
-                INCR(1);
-                break;
-            case '\n':
-            case ';':
-                return 1; // skip line
-            default:;
-                size_t length;
-                char *word = read_word(cursor, &length);
-                if (!word || !length)
-                    return 0;
-                else
-                    INCR(length);
-                switch (*word) {
-                    case 'A' ... 'Z':
-                    case '0' ... '9':
-                    case '_':;
-                        int idx = -1;
-                        switch (lookup(word, length, &idx)) {
-                            default:
-                            case 0:
-                                return 0; // Expected op
-                            case 1:
-                                if (!process_bop(ass, cursor, idx))
-                                    return 0;
-                                break;
-                            case 2:
-                                break;
-                        }
-                        break;
-                    case ':':
-                        if (!process_label(ass, word, length))
-                            return 0; // Invalid label or attempted redefine
-                        else
-                            INCR(length);
-                        break;
-                    default:
-                        return 0; // Expected label or op
+void object_destroy(struct object_t *obj) {
+    if (!obj)
+        return;
+    for (int i = 0; i < obj->statement_count; i++)
+        free(obj->statements[i].data);
+    free(obj->statements);
+    free(obj->labels);
+    free(obj->buckets);
+    free(obj->names);
+    free(obj);
+}
+
+typedef struct {
+    object_t *obj;
+    label_t *label;
+} symbol_t;
+
+// Labels are global across objects, point every label at its one definition
+static int resolve(object_t **objects, int count) {
+    int result = 0;
+    uint32_t total = 0, size = 16;
+    for (int i = 0; i < count; i++)
+        total += objects[i]->label_count;
+    while (size < total * 2)
+        size <<= 1;
+    symbol_t *symbols = calloc(size, sizeof(symbol_t));
+    if (!symbols)
+        return 0;
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < objects[i]->label_count; j++) {
+            label_t *label = &objects[i]->labels[j];
+            if (!label->defined)
+                continue;
+            uint32_t slot = label->hash & (size - 1);
+            for (; symbols[slot].label; slot = (slot + 1) & (size - 1))
+                if (symbols[slot].label->hash == label->hash && symbols[slot].label->length == label->length &&
+                    !memcmp(symbols[slot].obj->names + symbols[slot].label->name, objects[i]->names + label->name, label->length))
+                    goto END; // Defined in more than one place
+            symbols[slot].obj = objects[i];
+            symbols[slot].label = label;
+            label->definition = label;
+        }
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < objects[i]->label_count; j++) {
+            label_t *label = &objects[i]->labels[j];
+            if (label->defined)
+                continue;
+            uint32_t slot = label->hash & (size - 1);
+            for (label->definition = NULL; symbols[slot].label; slot = (slot + 1) & (size - 1))
+                if (symbols[slot].label->hash == label->hash && symbols[slot].label->length == label->length &&
+                    !memcmp(symbols[slot].obj->names + symbols[slot].label->name, objects[i]->names + label->name, label->length)) {
+                    label->definition = symbols[slot].label;
+                    break;
                 }
+            if (!label->definition)
+                goto END; // Undefined label
         }
-    return 1;
+    result = 1;
+END:
+    free(symbols);
+    return result;
 }
 
-static int process(assembler_t *ass) {
-    const char *line = ass->src;
-    int result = 1;
-    while (line) {
-        char buffer[128];
-        char *next_line = strchr(line, '\n');
-        long len = next_line ? (next_line-line) : strlen(line);
-        if (len > 128)
-            len = 128;
-        memcpy(buffer, line, len * sizeof(char));
-        if (len < 128)
-            buffer[len] = '\0';
-        if ((result = process_line(ass, buffer)) != 1)
-            return result;
-        line = next_line ? next_line + 1 : NULL;
-        ass->row++;
-        ass->col = 0;
+static uint16_t value(object_t *obj, operand_t *operand) {
+    return (operand->label >= 0 ? obj->labels[operand->label].definition->pc : 0) + operand->value;
+}
+
+static int length(statement_t *st) {
+    switch (st->kind) {
+        case sBOP:
+            return 1 + (st->a.has_word && !st->a.inline_literal) + st->b.has_word;
+        case sSPC:
+            return 1 + (st->a.has_word && !st->a.inline_literal);
+        default:
+            return st->data_count;
     }
+}
+
+static uint32_t layout(object_t **objects, int count) {
+    uint32_t pc = 0;
+    for (int i = 0; i < count; i++) {
+        object_t *obj = objects[i];
+        for (int j = 0; j < obj->statement_count; j++) {
+            obj->statements[j].pc = pc;
+            pc += length(&obj->statements[j]);
+        }
+        obj->end = pc;
+        for (int j = 0; j < obj->label_count; j++) {
+            label_t *label = &obj->labels[j];
+            if (label->defined)
+                label->pc = label->statement < obj->statement_count ? obj->statements[label->statement].pc : obj->end;
+        }
+    }
+    return pc;
+}
+
+// Short form literals cover -1 to 30
+static int fits(uint16_t v) {
+    return v == 0xFFFF || v <= 30;
+}
+
+// Every literal a operand starts out inline and relaxation only ever widens them, so the layout
+// converges in at most one pass per operand
+static uint32_t relax(object_t **objects, int count) {
+    int changed;
+    uint32_t words;
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < objects[i]->statement_count; j++) {
+            operand_t *a = &objects[i]->statements[j].a;
+            a->inline_literal = objects[i]->statements[j].kind != sDAT && a->mode == 0x1F;
+        }
+    do {
+        words = layout(objects, count);
+        changed = 0;
+        for (int i = 0; i < count; i++)
+            for (int j = 0; j < objects[i]->statement_count; j++) {
+                operand_t *a = &objects[i]->statements[j].a;
+                if (a->inline_literal && !fits(value(objects[i], a))) {
+                    a->inline_literal = 0;
+                    changed = 1;
+                }
+            }
+    } while (changed);
+    return words;
+}
+
+static uint16_t field(object_t *obj, operand_t *operand) {
+    return operand->inline_literal ? (uint16_t)(0x21 + value(obj, operand)) & 0x3F : operand->mode;
+}
+
+static void emit(object_t *obj, uint16_t *dst) {
+    for (int i = 0; i < obj->statement_count; i++) {
+        statement_t *st = &obj->statements[i];
+        uint32_t pc = st->pc;
+        switch (st->kind) {
+            case sBOP:
+                dst[pc++] = st->op | st->b.mode << 5 | field(obj, &st->a) << 10;
+                if (st->a.has_word && !st->a.inline_literal)
+                    dst[pc++] = value(obj, &st->a);
+                if (st->b.has_word)
+                    dst[pc++] = value(obj, &st->b);
+                break;
+            case sSPC:
+                dst[pc++] = st->op << 5 | field(obj, &st->a) << 10;
+                if (st->a.has_word && !st->a.inline_literal)
+                    dst[pc++] = value(obj, &st->a);
+                break;
+            default:
+                for (int j = 0; j < st->data_count; j++)
+                    dst[pc++] = value(obj, &st->data[j]);
+                break;
+        }
+    }
+}
+
+int link_objects(struct object_t **objects, int count, uint16_t dst[0x10000]) {
+    if (!resolve(objects, count))
+        return -1;
+    uint32_t words = relax(objects, count);
+    if (words > 0x10000)
+        return -1; // Program doesn't fit in memory
+    for (int i = 0; i < count; i++)
+        emit(objects[i], dst);
+    return (int)words;
+}
+
+static int compare_symbols(const void *x, const void *y) {
+    const struct symbol_t *a = x, *b = y;
+    return a->address - b->address;
+}
+
+int object_symbols(struct object_t *obj, struct symbol_t **symbols) {
+    int count = 0;
+    *symbols = malloc((obj->label_count ? obj->label_count : 1) * sizeof(struct symbol_t));
+    if (!*symbols)
+        return -1;
+    for (int i = 0; i < obj->label_count; i++)
+        if (obj->labels[i].defined) {
+            (*symbols)[count].address = obj->labels[i].pc;
+            (*symbols)[count++].name = obj->names + obj->labels[i].name;
+        }
+    qsort(*symbols, count, sizeof(struct symbol_t), compare_symbols);
+    return count;
+}
+
+typedef struct {
+    const char **srcs;
+    const size_t *lengths;
+    object_t **objects;
+    int count, next;
+} batch_t;
+
+static void* assemble_worker(void *arg) {
+    batch_t *batch = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+        batch->objects[i] = assemble_object(batch->srcs[i], batch->lengths ? batch->lengths[i] : strlen(batch->srcs[i]));
+    return NULL;
+}
+
+int assemble_units(const char **srcs, const size_t *lengths, int count, int threads, uint16_t dst[0x10000]) {
+    int result = -1;
+    if (count <= 0)
+        return 0;
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+    if (threads > count)
+        threads = count;
+    batch_t batch = { srcs, lengths, calloc(count, sizeof(object_t*)), count, 0 };
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (!batch.objects || !workers)
+        goto END;
+    int started = 1;
+    for (int i = 1; i < threads; i++, started++)
+        if (pthread_create(&workers[i], NULL, assemble_worker, &batch))
+            break;
+    assemble_worker(&batch);
+    for (int i = 1; i < started; i++)
+        pthread_join(workers[i], NULL);
+    for (int i = 0; i < count; i++)
+        if (!batch.objects[i])
+            goto END;
+    result = link_objects(batch.objects, count, dst);
+
+END:
+    if (batch.objects)
+        for (int i = 0; i < count; i++)
+            object_destroy(batch.objects[i]);
+    free(batch.objects);
+    free(workers);
     return result;
 }
 
 int assemble(const char *src, uint16_t dst[0x10000]) {
-    assembler_t ass;
-    memset(&ass, 0, sizeof(assembler_t));
-    ass.dst = dst;
-    ass.src = src;
-    ass.src_length = strlen(src);
-    int result = process(&ass);
-    // fix labels here ...
-    label_t *head = ass.labels;
-    while (head) {
-        label_t *next = head->next;
-        free((void*)next->name);
-        free(next);
-        head = next;
-    }
+    object_t *obj = assemble_object(src, strlen(src));
+    if (!obj)
+        return -1;
+    int result = link_objects(&obj, 1, dst);
+    object_destroy(obj);
     return result;
 }
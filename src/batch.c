@@ -0,0 +1,620 @@
+/* batch.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Lockstep execution of many copies of one program. Lanes are split into blocks of BLOCK that run one after
+// the other. Within a block every register is a row with a word per lane and memory is 0x10000 such rows,
+// so lanes touching the same register or address are adjacent.
+//
+// Each step picks the lowest PC among the lanes still running and executes that instruction for every
+// lane sitting there with the same instruction words. Lanes that branch elsewhere drop out of the group
+// and rejoin once theirs is the lowest PC again, which for loops and if/else is where the paths meet.
+// Basic ops are computed a row at a time with vector kernels (GCC vector extensions, so SSE2 by default
+// and AVX2 with -mavx2), memory operands are gathered and scattered lane by lane and special ops run per
+// lane. Keeping blocks small bounds what a fully diverged block costs per step.
+//
+// Every lane ends up exactly where cpu_run would have left a cpu_t, EX and cycles included. Lanes have no
+// devices: HWN reads 0, HWQ finds nothing and HWI does nothing.
+
+#define BLOCK 256
+#define WIDTH 16
+#define REGISTER 0x10000 // Locations past memory are registers
+
+typedef uint16_t vec_t __attribute__((vector_size(WIDTH * sizeof(uint16_t))));
+typedef int16_t svec_t __attribute__((vector_size(WIDTH * sizeof(int16_t))));
+typedef uint32_t wide_t __attribute__((vector_size(WIDTH * sizeof(uint32_t))));
+typedef int32_t swide_t __attribute__((vector_size(WIDTH * sizeof(int32_t))));
+
+#define ROW(R, C) (*(vec_t*)&(R)[C])
+#define SPLAT(V) ((vec_t){0} + (uint16_t)(V))
+#define BLEND(OLD, NEW, MASK) (((OLD) & ~(MASK)) | ((NEW) & (MASK)))
+#define WIDEN(V) __builtin_convertvector((V), wide_t)
+#define NARROW(V) __builtin_convertvector((V), vec_t)
+
+enum {
+    A = 0x00, B, C,
+    X, Y, Z,
+    I, J,
+    PC, SP, EX, IA
+};
+
+enum {
+    SET = 0x01,
+    ADD, SUB, MUL, MLI, DIV, DVI, MOD, MDI,
+    AND, BOR, XOR, SHR, ASR, SHL,
+    IFB, IFC, IFE, IFN, IFG, IFA, IFL, IFU,
+    ADX = 0x1A, SBX,
+    STI = 0x1E, STD
+};
+
+enum {
+    RES = 0x00,
+    JSR,
+    INT = 0x08, IAG, IAS, RFI, IAQ,
+    HWN = 0x10, HWQ, HWI
+};
+
+struct block_t {
+    uint16_t reg[12][BLOCK];
+    uint16_t running[BLOCK]; // All ones while the lane hasn't stopped or used up its budget
+    uint16_t group[BLOCK];   // All ones for lanes in this step
+    // Operands and results of this step
+    uint16_t a[BLOCK], b[BLOCK], result[BLOCK], ex[BLOCK];
+    int32_t address[BLOCK];
+    uint64_t cycles[BLOCK], end[BLOCK];
+    uint8_t state[BLOCK];
+    uint16_t iaq_enabled[BLOCK], iaq_count[BLOCK];
+    uint8_t iaq_head[BLOCK];
+    uint16_t iaq[BLOCK][256];
+    int queued; // Lanes with interrupts waiting
+    int lanes;
+    uint16_t (*memory)[BLOCK];
+};
+
+struct batch_t {
+    int lanes, blocks;
+    struct block_t **block;
+    uint64_t steps, instructions;
+};
+
+// cpu.c
+void decode_words(struct instruction_t *ins, uint16_t pc, const uint16_t words[3]);
+
+static void fetch(struct block_t *k, int l, uint16_t pc, struct instruction_t *ins) {
+    uint16_t words[3] = { k->memory[pc][l], k->memory[(uint16_t)(pc + 1)][l], k->memory[(uint16_t)(pc + 2)][l] };
+    decode_words(ins, pc, words);
+}
+
+static uint16_t get(struct block_t *k, int l, int32_t at) {
+    return at >= REGISTER ? k->reg[at - REGISTER][l] : k->memory[at][l];
+}
+
+static void put(struct block_t *k, int l, int32_t at, uint16_t value) {
+    if (at >= REGISTER)
+        k->reg[at - REGISTER][l] = value;
+    else
+        k->memory[at][l] = value;
+}
+
+static void push(struct block_t *k, int l, uint16_t value) {
+    k->memory[--k->reg[SP][l]][l] = value;
+}
+
+static uint16_t pop(struct block_t *k, int l) {
+    return k->memory[k->reg[SP][l]++][l];
+}
+
+// Same as lvalue() in cpu.c, for one lane
+static int32_t locate(struct block_t *k, int l, uint16_t v, uint16_t next, uint16_t at) {
+    if (v < 0x08)
+        return REGISTER + v;
+    else if (v < 0x10)
+        return k->reg[v - 0x08][l];
+    else if (v < 0x18)
+        return (uint16_t)(k->reg[v - 0x10][l] + next);
+    else
+        switch (v) {
+            case 0x18: return --k->reg[SP][l];
+            case 0x19: return k->reg[SP][l];
+            case 0x1A: return (uint16_t)(k->reg[SP][l] + next);
+            case 0x1B: return REGISTER + SP;
+            case 0x1C: return REGISTER + PC;
+            case 0x1D: return REGISTER + EX;
+            case 0x1E: return next;
+            case 0x1F: return at;
+            default:   return -1;
+        }
+}
+
+static uint16_t rvalue(struct block_t *k, int l, uint16_t v, uint16_t next, uint16_t at) {
+    switch (v) {
+        case 0x18: return pop(k, l);
+        case 0x1C: return at;
+        case 0x1F: return next;
+        case 0x20 ... 0x3F: return v - 0x21;
+        default: return get(k, l, locate(k, l, v, next, at));
+    }
+}
+
+static void trigger(struct block_t *k, int l, uint16_t message) {
+    k->iaq_enabled[l] = 1;
+    push(k, l, k->reg[PC][l]);
+    push(k, l, k->reg[A][l]);
+    k->reg[PC][l] = k->reg[IA][l];
+    k->reg[A][l] = message;
+}
+
+static void interrupt(struct block_t *k, int l, uint16_t message) {
+    if (!k->reg[IA][l])
+        return;
+    if (!k->iaq_enabled[l] && !k->iaq_count[l])
+        trigger(k, l, message);
+    else if (k->iaq_count[l] >= 256)
+        k->state[l] = CPU_ON_FIRE;
+    else {
+        if (!k->iaq_count[l])
+            k->queued++;
+        k->iaq[l][(uint8_t)(k->iaq_head[l] + k->iaq_count[l]++)] = message;
+    }
+}
+
+static void skip(struct block_t *k, int l) {
+    struct instruction_t ins;
+    do {
+        fetch(k, l, k->reg[PC][l], &ins);
+        k->cycles[l] += 2;
+        k->reg[PC][l] += ins.length;
+    } while (ins.op >= IFB && ins.op <= IFU);
+}
+
+static void special(struct block_t *k, int l, const struct instruction_t *ins) {
+    uint16_t pc = ins->pc, a;
+    int32_t at = -1;
+    if (ins->op == (0x20 | RES)) {
+        k->reg[PC][l] = pc + 1;
+        k->state[l] = CPU_HALT;
+        return;
+    }
+    if (ins->a < 0x20) {
+        at = locate(k, l, ins->a, ins->a_word, pc + 1);
+        a = get(k, l, at);
+    } else
+        a = rvalue(k, l, ins->a, ins->a_word, pc + 1);
+    switch (ins->op & 0x1F) {
+        case JSR:
+            push(k, l, k->reg[PC][l]);
+            k->reg[PC][l] = a;
+            break;
+        case INT:
+            interrupt(k, l, a);
+            break;
+        case IAG:
+            if (at >= 0)
+                put(k, l, at, k->reg[IA][l]);
+            break;
+        case IAS:
+            k->reg[IA][l] = a;
+            break;
+        case RFI:
+            k->iaq_enabled[l] = 0;
+            k->reg[A][l] = pop(k, l);
+            k->reg[PC][l] = pop(k, l);
+            break;
+        case IAQ:
+            k->iaq_enabled[l] = a != 0;
+            break;
+        case HWN:
+            if (at >= 0)
+                put(k, l, at, 0);
+            break;
+        case HWQ:
+            for (int r = A; r <= Y; r++)
+                k->reg[r][l] = 0;
+            break;
+        case HWI:
+            break;
+        default:
+            k->state[l] = CPU_HALT;
+            break;
+    }
+}
+
+// Division has no vector instructions, these are the expressions from cpu.c without the overflow
+static void divide(struct block_t *k, int op, int b_is_ex) {
+    for (int l = 0; l < BLOCK; l++) {
+        if (!k->group[l])
+            continue;
+        uint16_t a = k->a[l], b = k->b[l], ex = 0, result = 0;
+        if (a) {
+            switch (op) {
+                case DIV:
+                    ex = ((uint32_t)b << 16) / a;
+                    result = (b_is_ex ? ex : b) / a;
+                    break;
+                case DVI:
+                    ex = (int32_t)((uint32_t)b << 16) / (int32_t)a;
+                    result = (int16_t)(b_is_ex ? ex : b) / (int16_t)a;
+                    break;
+                case MOD:
+                    result = b % a;
+                    break;
+                case MDI:
+                    result = (int16_t)b % (int16_t)a;
+                    break;
+            }
+        }
+        k->ex[l] = ex;
+        k->result[l] = result;
+    }
+}
+
+// Results and EX of a basic op, a row at a time. When b is EX, cpu.c reads it back after setting EX
+#define EACH(BODY)                                                                  \
+    for (int c = 0; c < BLOCK; c += WIDTH) {                                        \
+        vec_t a = ROW(k->a, c), b = ROW(k->b, c), e = ROW(k->reg[EX], c), ex = {0}; \
+        (void)b, (void)e;                                                           \
+        BODY;                                                                       \
+        ROW(k->ex, c) = ex;                                                         \
+    }
+#define RESULT(V) ROW(k->result, c) = (V)
+#define READ_BACK() if (b_is_ex) b = ex
+
+static void kernel(struct block_t *k, int op, int b_is_ex) {
+    switch (op) {
+        case SET: EACH(RESULT(a)); break;
+        case ADD: EACH(ex = NARROW((WIDEN(b) + WIDEN(a)) >> 16); READ_BACK(); RESULT(b + a)); break;
+        case SUB: EACH(ex = NARROW((swide_t)((swide_t)WIDEN(b) - (swide_t)WIDEN(a)) >> 16); READ_BACK(); RESULT(b - a)); break;
+        case MUL:
+        case MLI: EACH(ex = NARROW((WIDEN(b) * WIDEN(a)) >> 16); READ_BACK(); RESULT(b * a)); break;
+        case AND: EACH(RESULT(b & a)); break;
+        case BOR: EACH(RESULT(b | a)); break;
+        case XOR: EACH(RESULT(b ^ a)); break;
+        // Shift counts wrap at 32 as the host's do in cpu.c
+        case SHR:
+            EACH(wide_t shift = WIDEN(a) & 31;
+                 ex = NARROW((WIDEN(b) << 16) >> shift); READ_BACK();
+                 RESULT(NARROW(WIDEN(b) >> shift)));
+            break;
+        case ASR:
+            EACH(wide_t shift = WIDEN(a) & 31;
+                 ex = NARROW((WIDEN(b) << 16) >> shift); READ_BACK();
+                 swide_t wide = __builtin_convertvector((svec_t)b, swide_t) >> (swide_t)shift;
+                 RESULT(NARROW(wide)));
+            break;
+        case SHL:
+            EACH(wide_t shift = WIDEN(a) & 31;
+                 ex = NARROW((WIDEN(b) << shift) >> 16); READ_BACK();
+                 RESULT(NARROW(WIDEN(b) << shift)));
+            break;
+        case ADX: EACH(ex = NARROW((WIDEN(b) + WIDEN(a) + WIDEN(e)) >> 16); RESULT(b + a + e)); break;
+        case SBX:
+            EACH(ex = NARROW(((swide_t)WIDEN(b) - ((swide_t)WIDEN(a) + (swide_t)WIDEN(e))) >> 16);
+                 RESULT(b - (a + e)));
+            break;
+    }
+}
+
+// Lanes that fail the test are flagged in result to skip
+static void condition(struct block_t *k, int op) {
+    switch (op) {
+        case IFB: EACH(RESULT(ROW(k->group, c) & (vec_t)((b & a) == 0))); break;
+        case IFC: EACH(RESULT(ROW(k->group, c) & (vec_t)((b & a) != 0))); break;
+        case IFE: EACH(RESULT(ROW(k->group, c) & (vec_t)(b != a))); break;
+        case IFN: EACH(RESULT(ROW(k->group, c) & (vec_t)(b == a))); break;
+        case IFG: EACH(RESULT(ROW(k->group, c) & (vec_t)(b <= a))); break;
+        case IFA: EACH(RESULT(ROW(k->group, c) & (vec_t)((svec_t)b <= (svec_t)a))); break;
+        case IFL: EACH(RESULT(ROW(k->group, c) & (vec_t)(b >= a))); break;
+        case IFU: EACH(RESULT(ROW(k->group, c) & (vec_t)((svec_t)b >= (svec_t)a))); break;
+    }
+}
+
+#undef EACH
+#undef RESULT
+#undef READ_BACK
+
+static void store(struct block_t *k, int reg, const uint16_t *value) {
+    if (reg >= 0)
+        for (int c = 0; c < BLOCK; c += WIDTH)
+            ROW(k->reg[reg], c) = BLEND(ROW(k->reg[reg], c), ROW(value, c), ROW(k->group, c));
+    else
+        for (int l = 0; l < BLOCK; l++)
+            if (k->group[l])
+                k->memory[k->address[l]][l] = value[l];
+}
+
+static void add_rows(struct block_t *k, int reg, int16_t delta) {
+    for (int c = 0; c < BLOCK; c += WIDTH)
+        ROW(k->reg[reg], c) += SPLAT(delta) & ROW(k->group, c);
+}
+
+static void execute(struct block_t *k, const struct instruction_t *ins) {
+    uint16_t pc = ins->pc;
+    for (int c = 0; c < BLOCK; c += WIDTH)
+        ROW(k->reg[PC], c) = BLEND(ROW(k->reg[PC], c), SPLAT(pc + ins->length), ROW(k->group, c));
+    for (int l = 0; l < BLOCK; l++)
+        k->cycles[l] += k->group[l] & ins->cycles;
+
+    if (ins->op & 0x20) {
+        for (int l = 0; l < BLOCK; l++)
+            if (k->group[l])
+                special(k, l, ins);
+        return;
+    }
+
+    // a before b, both can move SP
+    if (ins->a >= 0x20 || ins->a == 0x1F) {
+        vec_t a = SPLAT(ins->a == 0x1F ? ins->a_word : ins->a - 0x21);
+        for (int c = 0; c < BLOCK; c += WIDTH)
+            ROW(k->a, c) = a;
+    } else if (ins->a < 0x08)
+        memcpy(k->a, k->reg[ins->a], sizeof(k->a));
+    else
+        for (int l = 0; l < BLOCK; l++)
+            if (k->group[l])
+                k->a[l] = rvalue(k, l, ins->a, ins->a_word, pc + 1);
+    int reg = -1;
+    if (ins->b < 0x08)
+        reg = ins->b;
+    else if (ins->b >= 0x1B && ins->b <= 0x1D)
+        reg = ins->b == 0x1B ? SP : ins->b == 0x1C ? PC : EX;
+    if (reg >= 0)
+        memcpy(k->b, k->reg[reg], sizeof(k->b));
+    else
+        for (int l = 0; l < BLOCK; l++)
+            if (k->group[l]) {
+                k->address[l] = locate(k, l, ins->b, ins->b_word, pc + ins->length - 1);
+                k->b[l] = k->memory[k->address[l]][l];
+            }
+
+    switch (ins->op) {
+        case IFB ... IFU:
+            condition(k, ins->op);
+            for (int l = 0; l < BLOCK; l++)
+                if (k->result[l])
+                    skip(k, l);
+            return;
+        case STI:
+        case STD:
+            store(k, reg, k->a);
+            add_rows(k, I, ins->op == STI ? 1 : -1);
+            add_rows(k, J, ins->op == STI ? 1 : -1);
+            return;
+        case DIV:
+        case DVI:
+        case MOD:
+        case MDI:
+            divide(k, ins->op, reg == EX);
+            break;
+        case SET:
+        case ADD ... MLI:
+        case AND ... SHL:
+        case ADX:
+        case SBX:
+            kernel(k, ins->op, reg == EX);
+            break;
+        default:
+            for (int l = 0; l < BLOCK; l++)
+                if (k->group[l])
+                    k->state[l] = CPU_HALT;
+            return;
+    }
+    switch (ins->op) {
+        case SET:
+        case MOD:
+        case MDI:
+        case AND ... XOR:
+            store(k, reg, k->result);
+            break;
+        case ADX:
+        case SBX:
+            store(k, reg, k->result);
+            store(k, EX, k->ex);
+            break;
+        default:
+            store(k, EX, k->ex);
+            store(k, reg, k->result);
+            break;
+    }
+}
+
+// Returns 0 once no lane in the block can run
+static int step(struct batch_t *batch, struct block_t *k) {
+    // Lanes wait at higher PCs for the rest to catch up
+    vec_t low = SPLAT(0xFFFF), any = {0};
+    for (int c = 0; c < BLOCK; c += WIDTH) {
+        vec_t running = ROW(k->running, c), pc = ROW(k->reg[PC], c) | ~running;
+        low = BLEND(low, pc, (vec_t)(pc < low));
+        any |= running;
+    }
+    uint16_t pc = 0xFFFF, found = 0;
+    for (int i = 0; i < WIDTH; i++) {
+        if (low[i] < pc)
+            pc = low[i];
+        found |= any[i];
+    }
+    if (!found)
+        return 0;
+    for (int c = 0; c < BLOCK; c += WIDTH)
+        ROW(k->group, c) = ROW(k->running, c) & (vec_t)(ROW(k->reg[PC], c) == SPLAT(pc));
+
+    // Queued interrupts are delivered at the boundary before the lane's next instruction, as in cpu_run
+    if (k->queued)
+        for (int l = 0; l < BLOCK; l++)
+            if (k->group[l] && !k->iaq_enabled[l] && k->iaq_count[l]) {
+                uint16_t message = k->iaq[l][k->iaq_head[l]++];
+                if (!--k->iaq_count[l])
+                    k->queued--;
+                if (k->reg[IA][l]) {
+                    trigger(k, l, message);
+                    k->group[l] = 0;
+                }
+            }
+
+    int leader = 0;
+    while (leader < BLOCK && !k->group[leader])
+        leader++;
+    if (leader == BLOCK)
+        return 1;
+    struct instruction_t ins;
+    fetch(k, leader, pc, &ins);
+    // Lanes that have rewritten the instruction wait for a step of their own
+    for (int i = 1; i <= ins.length; i++) {
+        vec_t word = SPLAT(k->memory[(uint16_t)(pc + i - 1)][leader]);
+        for (int c = 0; c < BLOCK; c += WIDTH)
+            ROW(k->group, c) &= (vec_t)(ROW(k->memory[(uint16_t)(pc + i - 1)], c) == word);
+    }
+
+    execute(k, &ins);
+
+    int count = 0;
+    for (int l = 0; l < BLOCK; l++) {
+        if (!k->group[l])
+            continue;
+        count++;
+        if (k->cycles[l] >= k->end[l] || k->state[l] > CPU_OK)
+            k->running[l] = 0;
+    }
+    batch->steps++;
+    batch->instructions += count;
+    return 1;
+}
+
+struct batch_t* batch_create(const struct cpu_t *cpu, int lanes) {
+    if (lanes <= 0)
+        return NULL;
+    struct batch_t *batch = calloc(1, sizeof(struct batch_t));
+    if (!batch)
+        return NULL;
+    batch->lanes = lanes;
+    if (!(batch->block = calloc((lanes + BLOCK - 1) / BLOCK, sizeof(struct block_t*))))
+        goto FAIL;
+    for (; batch->blocks * BLOCK < lanes; batch->blocks++) {
+        struct block_t *k;
+        if (posix_memalign((void**)&k, 64, sizeof(struct block_t)))
+            goto FAIL;
+        memset(k, 0, sizeof(struct block_t));
+        batch->block[batch->blocks] = k;
+        k->memory = mmap(NULL, 0x10000 * sizeof(*k->memory), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (k->memory == MAP_FAILED) {
+            k->memory = NULL;
+            goto FAIL;
+        }
+        k->lanes = lanes - batch->blocks * BLOCK < BLOCK ? lanes - batch->blocks * BLOCK : BLOCK;
+        for (int l = 0; l < k->lanes; l++) {
+            for (int r = 0; r < 12; r++)
+                k->reg[r][l] = cpu->reg[r];
+            k->cycles[l] = cpu->cycles;
+            k->state[l] = cpu->state;
+            k->iaq_enabled[l] = cpu->iaq_enabled;
+            k->iaq_count[l] = cpu->iaq_count;
+            k->iaq_head[l] = cpu->iaq_head;
+            memcpy(k->iaq[l], cpu->iaq, sizeof(cpu->iaq));
+            if (cpu->iaq_count)
+                k->queued++;
+        }
+        // Untouched rows of the mapping are already zero
+        for (int i = 0; i < 0x10000; i++)
+            if (cpu->memory[i])
+                for (int l = 0; l < k->lanes; l++)
+                    k->memory[i][l] = cpu->memory[i];
+    }
+    return batch;
+
+FAIL:
+    batch_destroy(batch);
+    return NULL;
+}
+
+void batch_destroy(struct batch_t *batch) {
+    if (!batch)
+        return;
+    for (int i = 0; i < batch->blocks; i++) {
+        if (batch->block[i]->memory)
+            munmap(batch->block[i]->memory, 0x10000 * sizeof(*batch->block[i]->memory));
+        free(batch->block[i]);
+    }
+    free(batch->block);
+    free(batch);
+}
+
+#define LANE(BATCH, LANE) ((BATCH)->block[(LANE) / BLOCK])
+#define INDEX(LANE) ((LANE) % BLOCK)
+
+uint16_t batch_register(struct batch_t *batch, int lane, int reg) {
+    return LANE(batch, lane)->reg[reg][INDEX(lane)];
+}
+
+void batch_set_register(struct batch_t *batch, int lane, int reg, uint16_t value) {
+    LANE(batch, lane)->reg[reg][INDEX(lane)] = value;
+}
+
+uint16_t batch_read(struct batch_t *batch, int lane, uint16_t address) {
+    return LANE(batch, lane)->memory[address][INDEX(lane)];
+}
+
+void batch_write(struct batch_t *batch, int lane, uint16_t address, uint16_t value) {
+    LANE(batch, lane)->memory[address][INDEX(lane)] = value;
+}
+
+int batch_run(struct batch_t *batch, uint64_t budget) {
+    int runnable = 0;
+    for (int i = 0; i < batch->blocks; i++) {
+        struct block_t *k = batch->block[i];
+        for (int l = 0; l < k->lanes; l++) {
+            k->end[l] = budget > UINT64_MAX - k->cycles[l] ? UINT64_MAX : k->cycles[l] + budget;
+            k->running[l] = k->cycles[l] < k->end[l] && (k->state[l] == CPU_IDLE || k->state[l] == CPU_OK) ? 0xFFFF : 0;
+        }
+        while (step(batch, k))
+            ;
+        for (int l = 0; l < k->lanes; l++)
+            runnable += k->state[l] == CPU_IDLE || k->state[l] == CPU_OK;
+    }
+    return runnable;
+}
+
+void batch_export(struct batch_t *batch, int lane, struct cpu_t *cpu) {
+    struct block_t *k = LANE(batch, lane);
+    int l = INDEX(lane);
+    for (int r = 0; r < 12; r++)
+        cpu->reg[r] = k->reg[r][l];
+    cpu->cycles = k->cycles[l];
+    cpu->state = k->state[l];
+    cpu->iaq_enabled = k->iaq_enabled[l];
+    cpu->iaq_count = k->iaq_count[l];
+    cpu->iaq_head = k->iaq_head[l];
+    memcpy(cpu->iaq, k->iaq[l], sizeof(cpu->iaq));
+    for (int i = 0; i < 0x10000; i++)
+        cpu->memory[i] = k->memory[i][l];
+    cpu_invalidate(cpu, 0, 0x10000);
+}
+
+void batch_stats(struct batch_t *batch, struct batch_stats_t *out) {
+    out->steps = batch->steps;
+    out->instructions = batch->instructions;
+}
@@ -26,8 +26,20 @@
 #ifndef CCPU_H
 #define CCPU_H
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 struct cpu_t;
+struct jit_t;
+struct aot_t;
+struct image_t;
+struct snapshot_t;
+struct journal_t;
+struct trace_t;
+struct profile_t;
+struct watch_t;
+struct symbol_t;
+struct disk_t;
 
 struct hardware_t {
     uint32_t id;
@@ -39,9 +51,32 @@ struct hardware_t {
     void *data;
     
     void(*init)(struct hardware_t*);
-    void(*tick)(struct hardware_t*);
+    void(*tick)(struct hardware_t*); // Legacy, called before every instruction while set
     void(*interrupt)(struct hardware_t*);
     void(*deinit)(struct hardware_t*);
+    void(*wake)(struct hardware_t*); // Called once the deadline set by cpu_schedule has passed
+    // Called by cpu_fork on a copy of the device, should give dst its own data, returns 0 on failure
+    int(*clone)(struct hardware_t *dst, struct hardware_t *src);
+
+    uint64_t deadline;
+    uint16_t timer; // Position in the CPU's timer heap plus one, 0 when nothing is scheduled
+};
+
+// Decoded instructions are cached by PC in a direct-mapped table, must be a power of two
+#define CPU_ICACHE_SIZE 4096
+// Memory is tracked in pages of 1 << CPU_PAGE_SHIFT words (see page_flags)
+#define CPU_PAGE_SHIFT 8
+#define CPU_PAGE_COUNT (0x10000 >> CPU_PAGE_SHIFT)
+
+struct instruction_t {
+    uint16_t pc;
+    uint8_t  valid;
+    uint8_t  op;      // Basic opcode, or 0x20 | special opcode
+    uint8_t  a, b;    // Operand modes
+    uint8_t  length;  // Encoded length in words (also the length skipped by IFx)
+    uint8_t  cycles;  // Cost including the operand words
+    uint8_t  fuse;    // Might start a loop the interpreter runs as one superinstruction
+    uint16_t a_word, b_word;
 };
 
 enum cpu_state {
@@ -51,23 +86,312 @@ enum cpu_state {
     CPU_ON_FIRE
 };
 
+enum cpu_stop {
+    CPU_STOP_BUDGET = 0,
+    CPU_STOP_HALT,
+    CPU_STOP_ON_FIRE,
+    CPU_STOP_WATCH // A breakpoint or watched write, see cpu_watch_start
+};
+
 struct cpu_t {
+    // Hot state first, the allocation is page aligned so this shares a cache line
     uint16_t reg[12];
     enum cpu_state state;
     uint16_t iaq_enabled;
-    uint16_t iaq_index;
+    uint16_t iaq_count;
+    uint8_t  iaq_head; // Interrupts are queued in a ring and delivered oldest first
+    uint64_t cycles;
+    uint16_t *memory; // 0x10000 words, page aligned, directly after this struct
     uint16_t iaq[256];
-    uint16_t memory[0x10000];
-    struct hardware_t hardware[0xFFFF];
+    uint8_t page_flags[CPU_PAGE_COUNT];
+    struct instruction_t icache[CPU_ICACHE_SIZE];
+    // Devices are allocated individually on attach so pointers to them stay valid
+    struct hardware_t **hardware;
     uint16_t hardware_count;
-    uint64_t cycles;
+    uint16_t hardware_capacity;
+    // Min-heap of scheduled devices ordered by deadline, sized with the hardware table
+    struct hardware_t **timers;
+    uint16_t timer_count;
+    // Frozen memory image shared copy-on-write with forks, and how many pages haven't been written since
+    struct image_t *image;
+    uint16_t shared_pages;
+    struct snapshot_t *snapshots; // Newest first, each holds the pages written since the one before
+    struct journal_t *journal;
+    struct jit_t *jit;
+    struct aot_t *aot;
+    struct trace_t *trace;
+    struct profile_t *profile;
+    struct watch_t *watch;
+    uint8_t *coverage; // Edge counters, see cpu_coverage_start
+    uint16_t coverage_mask;
+    uint16_t coverage_prev;
+    // Filled by cpu_post_interrupt from any thread and drained into iaq between instructions by the thread
+    // running the CPU. Kept on their own cache lines so producers don't contend with the state above
+    struct {
+        uint32_t sequence;
+        uint16_t message;
+    } posted[256] __attribute__((aligned(64)));
+    uint32_t posted_tail __attribute__((aligned(64)));
+    uint32_t posted_pending; // Published but not yet drained, plus overflows
+    uint32_t posted_overflow;
+    uint32_t posted_head;
 };
 
+struct cpu_t* cpu_create(void);
+// Copies the CPU and its devices, memory is shared with the parent until either side writes to it
+struct cpu_t* cpu_fork(struct cpu_t *parent);
+void cpu_destroy(struct cpu_t *cpu);
 void cpu_step(struct cpu_t *cpu);
+// Execute until at least `budget` cycles have elapsed or the CPU stops
+enum cpu_stop cpu_run(struct cpu_t *cpu, uint64_t budget);
+// Only from the thread running the CPU (device callbacks included) or while it isn't running
 void cpu_interrupt(struct cpu_t *cpu, uint16_t message);
+// Lock-free, callable from any thread. Delivered in order before the next instruction (or translated block)
+// Returns 0 if 256 interrupts are already waiting, the CPU catches fire as if it had queued them all
+int cpu_post_interrupt(struct cpu_t *cpu, uint16_t message);
 int cpu_attach_hardware(struct cpu_t *cpu, int(*init_cb)(struct hardware_t*));
+// Wake the device `delay` cycles from now, replacing any earlier request
+void cpu_schedule(struct hardware_t *hw, uint64_t delay);
+// Same, at an absolute cycle count (periodic devices can add to hw->deadline without drifting)
+void cpu_schedule_at(struct hardware_t *hw, uint64_t cycle);
+void cpu_cancel(struct hardware_t *hw);
+// Decodes (through the instruction cache) the instruction at pc
+const struct instruction_t* cpu_decode(struct cpu_t *cpu, uint16_t pc);
+// Translate hot blocks to native code (x86-64 only), returns 0 if unavailable
+int cpu_jit_enable(struct cpu_t *cpu);
+void cpu_jit_disable(struct cpu_t *cpu);
+
+// Ahead-of-time translation, aot_translate writes C for every block reachable from the entry points (0 if
+// count is 0) of image, defining `const struct cpu_aot_t name`. Every other symbol it emits is static and
+// prefixed with name, so translations of several images can share a file. Returns the number of blocks or -1
+int aot_translate(const uint16_t image[0x10000], const uint16_t *entries, int count, const char *name, FILE *out);
+// What translated blocks return besides the index of the block to run next
+enum {
+    CPU_AOT_LOOKUP = -1, // Find the block at PC
+    CPU_AOT_EXIT   = -2  // Nothing translated at PC, interpret
+};
+struct cpu_aot_block_t {
+    uint16_t pc;
+    uint32_t end;        // Words pc..end-1 must still hold words for the block to run
+    uint32_t max_cycles; // Longest path through the block
+    const uint16_t *words;
+    int(*fn)(struct cpu_t *cpu, uint64_t end);
+};
+struct cpu_aot_t {
+    const struct cpu_aot_block_t *blocks; // Sorted by pc
+    int count;
+    const uint64_t *covered; // Bitmap of every word some block was translated from
+};
+// Run the translated blocks of aot wherever memory still matches, returns 0 if out of memory. aot must outlive
+// the CPU (and its forks, which inherit it)
+int cpu_aot_enable(struct cpu_t *cpu, const struct cpu_aot_t *aot);
+void cpu_aot_disable(struct cpu_t *cpu);
+// Translated code's write barrier for pages with flags set, returns 1 if address holds translated code
+int cpu_aot_written(struct cpu_t *cpu, uint16_t address);
+// Must be called after anything outside of the CPU (loaders, devices) writes to cpu->memory
+void cpu_invalidate(struct cpu_t *cpu, uint16_t address, uint32_t count);
+// Count edges between consecutive PCs into map as saturating 8-bit counters (what AFL and libFuzzer's extra
+// counters expect), size a power of two no larger than 0x10000. Starting again forgets the last PC, translated
+// and fused code is bypassed while counting. The map isn't cleared and stays the caller's
+int cpu_coverage_start(struct cpu_t *cpu, uint8_t *map, size_t size);
+void cpu_coverage_stop(struct cpu_t *cpu);
+enum cpu_image_order {
+    CPU_IMAGE_BIG_ENDIAN = 0, // How DCPU-16 binaries are usually distributed
+    CPU_IMAGE_LITTLE_ENDIAN
+};
+
+// Replaces all of memory with the binary at path (at most 0x10000 words, the rest is zeroed, a trailing odd
+// byte is ignored), returns the words loaded or -1. Decoded images are cached for the whole process and
+// shared copy-on-write by every CPU that loads them, see image.c
+int cpu_load_image(struct cpu_t *cpu, const char *path, enum cpu_image_order order);
+// Forget every cached image, CPUs keep what they've loaded
+void image_cache_flush(void);
+// Checkpoint registers, interrupt queue and memory (devices aren't captured), owned by the CPU
+struct snapshot_t* cpu_snapshot(struct cpu_t *cpu);
+// Return to an earlier snapshot, dropping every snapshot taken after it, returns 0 if it isn't this CPU's
+int cpu_rewind(struct cpu_t *cpu, struct snapshot_t *snapshot);
+// Drop every snapshot taken before this one to bound memory use
+void cpu_forget(struct cpu_t *cpu, struct snapshot_t *snapshot);
+// Log external input (cpu_interrupt, cpu_invalidate, device callbacks, registers set between runs) to path
+int cpu_journal_record(struct cpu_t *cpu, const char *path);
+// Feed a log back in from the state recording started in, devices attached but never called
+int cpu_journal_replay(struct cpu_t *cpu, const char *path);
+// Stops recording or replaying, returns 0 if the log couldn't be written out
+int cpu_journal_close(struct cpu_t *cpu);
+// Record every instruction run (pc, code, cycles, registers changed) to path, translated code is bypassed
+// while tracing. Records are dropped rather than stall the CPU if the writer falls behind
+int cpu_trace_start(struct cpu_t *cpu, const char *path);
+// Returns 0 if the trace couldn't be written out
+int cpu_trace_stop(struct cpu_t *cpu);
+// Prints a trace one disassembled instruction per line, returns how many or -1 if it isn't a trace
+long trace_decode(const char *path, FILE *out);
+
+enum cpu_watch_kind {
+    CPU_WATCH_BREAK = 0,
+    CPU_WATCH_WRITE
+};
+
+struct cpu_watch_hit_t {
+    enum cpu_watch_kind kind;
+    uint16_t address;   // The breakpoint, or the word written
+    uint16_t old_value; // For breakpoints both are the instruction word
+    uint16_t new_value;
+    uint16_t pc;        // Breakpoints stop before running pc, writes are reported with PC past the instruction
+    uint64_t cycles;
+};
+
+// Stop on breakpoints and on writes that change watched words. cpu_run returns CPU_STOP_WATCH at the next
+// instruction boundary and calls back with each hit first (at most 16 a stop). Running again carries on
+// past the breakpoint. Pages without a watch cost nothing, translated and fused code is bypassed while
+// watching. Writes from devices or the host are caught through cpu_invalidate
+int cpu_watch_start(struct cpu_t *cpu, void(*callback)(struct cpu_t *cpu, const struct cpu_watch_hit_t *hit,
+                                                      void *userdata), void *userdata);
+// Disarms everything
+void cpu_watch_stop(struct cpu_t *cpu);
+// These return 0 unless watching
+int cpu_break(struct cpu_t *cpu, uint16_t pc);
+void cpu_unbreak(struct cpu_t *cpu, uint16_t pc);
+int cpu_watch(struct cpu_t *cpu, uint16_t address, uint32_t count);
+void cpu_unwatch(struct cpu_t *cpu, uint16_t address, uint32_t count);
 
-// int assemble(const char *src, uint16_t dst[0x10000]);
+enum cpu_profile_format {
+    CPU_PROFILE_FOLDED = 0, // One "caller;callee cycles" line per stack, for flamegraph.pl
+    CPU_PROFILE_PPROF       // Uncompressed pprof protobuf
+};
+
+// Charge cycles to PCs and to call stacks followed through JSR and SET PC, POP. A period of 0 charges every
+// instruction, otherwise a sample every period cycles. Translated code is bypassed while profiling
+int cpu_profile_start(struct cpu_t *cpu, uint64_t period);
+// Name functions by the labels at their entry (see object_symbols), symbols are copied
+int cpu_profile_symbols(struct cpu_t *cpu, const struct symbol_t *symbols, int count);
+// Can be called while still profiling
+int cpu_profile_write(struct cpu_t *cpu, const char *path, enum cpu_profile_format format);
+void cpu_profile_stop(struct cpu_t *cpu);
+
+// Raw images of up to 1440 sectors of 512 words in host word order, opened read-only and shared by every
+// drive they're inserted in. Closing only drops the caller's reference
+struct disk_t* disk_open(const char *path);
+void disk_close(struct disk_t *disk);
+// Attaches an M35FD floppy drive with disk inserted (NULL for an empty drive). Writes go to a copy-on-write
+// overlay private to the drive, lost on eject unless saved. Returns NULL on failure (the drive may be left
+// attached but empty)
+struct hardware_t* m35fd_attach(struct cpu_t *cpu, struct disk_t *disk, int protect);
+// Ejects whatever was in the drive first
+int m35fd_insert(struct hardware_t *hw, struct disk_t *disk, int protect);
+void m35fd_eject(struct hardware_t *hw);
+// Writes the disk out as the drive sees it, overlay included
+int m35fd_save(struct hardware_t *hw, const char *path);
+
+// Attaches a LEM1802 display, see lem1802.c
+struct hardware_t* lem1802_attach(struct cpu_t *cpu);
+#define LEM1802_WIDTH 128
+#define LEM1802_HEIGHT 96
+// Brings the frame up to date with the guest's screen and returns it, LEM1802_WIDTH * LEM1802_HEIGHT pixels
+// of bytes R, G, B, A (little endian hosts) that stay valid until the next call. blink is the phase blinking
+// characters show in, cells (can be NULL) is set to how many were redrawn. Blank while no screen is mapped
+const uint32_t* lem1802_render(struct hardware_t *hw, int blink, int *cells);
+// The border colour, same format
+uint32_t lem1802_border(struct hardware_t *hw);
+
+// Lockstep batches of VMs running one program over many inputs, see batch.c
+struct batch_t;
+
+struct batch_stats_t {
+    uint64_t steps;        // Instructions issued, each to a group of lanes
+    uint64_t instructions; // Summed over lanes, instructions / steps is the average group size
+};
+
+// lanes copies of cpu's registers, memory, cycles and interrupt queue. Devices aren't copied, HWN reads 0
+struct batch_t* batch_create(const struct cpu_t *cpu, int lanes);
+void batch_destroy(struct batch_t *batch);
+// reg indexes cpu_t.reg
+uint16_t batch_register(struct batch_t *batch, int lane, int reg);
+void batch_set_register(struct batch_t *batch, int lane, int reg, uint16_t value);
+uint16_t batch_read(struct batch_t *batch, int lane, uint16_t address);
+void batch_write(struct batch_t *batch, int lane, uint16_t address, uint16_t value);
+// Runs every lane as cpu_run would with the same budget, returns how many haven't halted or caught fire
+int batch_run(struct batch_t *batch, uint64_t budget);
+// Copies a lane's registers, memory, cycles, state and interrupt queue into cpu
+void batch_export(struct batch_t *batch, int lane, struct cpu_t *cpu);
+void batch_stats(struct batch_t *batch, struct batch_stats_t *out);
+
+// Real-time pacing, see pace.c
+struct pace_t;
+
+struct pace_stats_t {
+    uint64_t cycles;
+    uint64_t dropped;  // Given up after falling a quarter of a second behind
+    uint64_t batches;  // cpu_run calls, or wakeups for the whole pacer
+    uint64_t overruns; // Pacer only, passes that ran into the next wakeup
+    double lag;        // Seconds behind the wall clock after the last batch (negative when ahead), the most of any VM
+    double max_lag;
+    double late;       // Pacer only, the latest a wakeup has come in seconds
+    double seconds;    // Pacer only, spent running VMs rather than asleep
+    enum cpu_stop stop;
+};
+
+// frequency in Hz (0 for the DCPU's 100kHz), period the nanoseconds between wakeups (0 for 10ms)
+struct pace_t* pace_create(uint64_t frequency, uint64_t period);
+// Also destroys every CPU added
+void pace_destroy(struct pace_t *pace);
+// Hands ownership of cpu to the pacer, returns the VM's index or -1. frequency 0 uses the pacer's
+int pace_add(struct pace_t *pace, struct cpu_t *cpu, uint64_t frequency);
+// Runs every VM in real time on the calling thread for seconds (0 until they all stop or pace_stop is
+// called, or a VM stops on a watch), returns how many are still running
+int pace_run(struct pace_t *pace, double seconds);
+// Callable from any thread, pace_run returns after the pass in progress
+void pace_stop(struct pace_t *pace);
+int pace_vm_stats(struct pace_t *pace, int vm, struct pace_stats_t *out);
+void pace_stats(struct pace_t *pace, struct pace_stats_t *out);
+
+struct host_t;
+
+struct host_stats_t {
+    uint64_t cycles;
+    uint64_t quanta;
+    double seconds;
+    double cycles_per_second;
+    enum cpu_stop stop; // Why the VM last stopped, CPU_STOP_BUDGET while still runnable
+};
+
+// workers <= 0 uses one per core, quantum is the default cycle budget per scheduling slice
+struct host_t* host_create(int workers, uint64_t quantum);
+// Also destroys every CPU added to the host
+void host_destroy(struct host_t *host);
+// Hands ownership of cpu to the host, returns the VM's index or -1. quantum 0 uses the host default
+int host_add(struct host_t *host, struct cpu_t *cpu, uint64_t quantum);
+// Runs every VM until it halts or catches fire. A VM stopped by a watch sits out the rest of the run
+int host_run(struct host_t *host);
+int host_vm_stats(struct host_t *host, int vm, struct host_stats_t *out);
+void host_stats(struct host_t *host, struct host_stats_t *out);
+
+// Assembles NUL terminated source into dst, literals that fit in -1..30 (labels included) use the short form
+// Returns the number of words written, or -1 on error
+int assemble(const char *src, uint16_t dst[0x10000]);
+// A translation unit assembled on its own, labels it uses but doesn't define are resolved when linking
+struct object_t;
+struct object_t* assemble_object(const char *src, size_t length);
+void object_destroy(struct object_t *obj);
+// Lays objects out in order into one image, labels are global across objects
+// Returns the number of words written, or -1 on undefined or duplicate labels
+int link_objects(struct object_t **objects, int count, uint16_t dst[0x10000]);
+struct symbol_t {
+    uint16_t address;
+    const char *name;
+};
+// Labels an object defines with their linked addresses, sorted by address. The array is the caller's to free,
+// names stay owned by the object. Returns the count or -1
+int object_symbols(struct object_t *obj, struct symbol_t **symbols);
+// Assembles each source on up to threads workers (0 for one per core) and links the result
+// lengths may be NULL for NUL terminated sources
+int assemble_units(const char **srcs, const size_t *lengths, int count, int threads, uint16_t dst[0x10000]);
+// Reentrant, writes one instruction into dst and returns its length in words
 int disassemble(uint16_t *cursor, char dst[32]);
+// Disassembles count words from start (wrapping at 0x10000) into dst, one instruction per line with
+// labels for SET PC and JSR targets that start an instruction inside the range. Encodings assemble() wouldn't
+// reproduce (long form literals that fit the short form, instructions cut off by the end of the range) are
+// printed as DAT, so a range starting at 0 reassembles with assemble() to the same words
+// Returns the length of the text, or -1 if it doesn't fit in size (40 * count + 1 always fits)
+long disassemble_image(const uint16_t memory[0x10000], uint16_t start, uint32_t count, char *dst, size_t size);
 
 #endif // CCPU_H
@@ -24,7 +24,15 @@
  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MEMORY_SIZE (0x10000 * sizeof(uint16_t))
 
 enum {
     A = 0x00, B, C,
@@ -60,229 +68,1259 @@ static const uint16_t spc_clocks[0x20] = {
     2, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-static void tick(struct cpu_t *cpu, int ticks) {
-    cpu->cycles += ticks;
+enum {
+    PAGE_CODE   = 1 << 0, // Decoded instructions start or end here
+    PAGE_SHARED = 1 << 1, // Still identical to the frozen image
+    PAGE_CLEAN  = 1 << 2, // Unchanged since the last snapshot
+    PAGE_BREAK  = 1 << 3, // Has a breakpoint
+    PAGE_WATCH  = 1 << 4  // Has watched words
+};
+
+#define PAGE_WORDS (1 << CPU_PAGE_SHIFT)
+
+struct snapshot_t {
+    struct snapshot_t *prev;
+    uint16_t reg[12];
+    enum cpu_state state;
+    uint16_t iaq_enabled;
+    uint16_t iaq_count;
+    uint8_t iaq_head;
+    uint16_t iaq[256];
+    uint64_t cycles;
+    int16_t slot[CPU_PAGE_COUNT]; // Where each page is saved in pages, -1 if it didn't change
+    uint16_t (*pages)[PAGE_WORDS];
+};
+
+struct image_t {
+    int fd;
+    int refs;
+};
+
+// jit.c
+int jit_enter(struct cpu_t *cpu, uint64_t end);
+void jit_invalidate(struct cpu_t *cpu, uint16_t address);
+
+// aot.c
+int aot_enter(struct cpu_t *cpu, uint64_t end);
+void aot_written(struct cpu_t *cpu, uint16_t address, uint32_t count);
+const struct cpu_aot_t* aot_program(struct cpu_t *cpu);
+
+// watch.c
+// A breakpoint decodes with this in fuse, the real instruction is kept
+#define FUSE_BREAK 2
+void watch_written(struct cpu_t *cpu, uint16_t address, uint32_t count);
+int watch_breakpoint(struct cpu_t *cpu, uint16_t pc);
+int watch_break(struct cpu_t *cpu, uint16_t pc);
+int watch_pending(struct cpu_t *cpu);
+void watch_report(struct cpu_t *cpu);
+
+// journal.c
+enum {
+    SITE_HOST = 0,
+    SITE_TICK,
+    SITE_WAKE,
+    SITE_INTERRUPT
+};
+void journal_call(struct cpu_t *cpu, struct hardware_t *hw, int site);
+int journal_interrupt(struct cpu_t *cpu, uint16_t message);
+void journal_interrupted(struct cpu_t *cpu);
+void journal_written(struct cpu_t *cpu, uint16_t address, uint32_t count);
+void journal_schedule(struct hardware_t *hw);
+void journal_host(struct cpu_t *cpu);
+void journal_enter(struct cpu_t *cpu);
+void journal_leave(struct cpu_t *cpu);
+uint64_t journal_deadline(struct cpu_t *cpu);
+
+// trace.c
+void trace_record(struct cpu_t *cpu, const struct instruction_t *ins);
+
+// profile.c
+void profile_record(struct cpu_t *cpu, const struct instruction_t *ins);
+
+static int has_word(uint16_t v) {
+    switch (v) {
+        case 0x10 ... 0x17:
+        case 0x1A:
+        case 0x1E:
+        case 0x1F:
+            return 1;
+        default:
+            return 0;
+    }
 }
 
-static uint16_t* next_word(struct cpu_t *cpu) {
-    tick(cpu, 1);
-    return &cpu->memory[cpu->reg[PC]++];
+// Also used by batch.c, words holds the three at pc and only as many as the instruction has are read
+void decode_words(struct instruction_t *ins, uint16_t pc, const uint16_t words[3]) {
+    uint16_t word = words[0];
+    uint16_t o = word & 0x1F;
+    uint16_t n = 1;
+    ins->pc = pc;
+    ins->a = (word >> 10) & 0x3F;
+    ins->a_word = has_word(ins->a) ? words[n++] : 0;
+    if (o == SPC) {
+        o = (word >> 5) & 0x1F;
+        ins->op = 0x20 | o;
+        ins->b = 0;
+        ins->b_word = 0;
+        ins->cycles = o == RES ? 1 : 1 + spc_clocks[o] + (n - 1);
+    } else {
+        ins->op = o;
+        ins->b = (word >> 5) & 0x1F;
+        ins->b_word = has_word(ins->b) ? words[n++] : 0;
+        ins->cycles = basic_clocks[o] + (n - 1);
+    }
+    ins->length = n;
+    ins->fuse = ins->op == STI || ins->op == STD || (ins->op == SET && ins->b >= 0x08 && ins->b < 0x18);
+    ins->valid = 1;
 }
 
-static void inc(struct cpu_t *cpu, uint16_t v) {
-    switch (v) {
-        case IFB ... IFU:
-        case ADX:
-        case STI:
-        case STD:
-            cpu->reg[PC]++;
-            break;
+static const struct instruction_t* decode_miss(struct cpu_t *cpu, struct instruction_t *ins, uint16_t pc) {
+    uint16_t words[3] = { cpu->memory[pc], cpu->memory[(uint16_t)(pc + 1)], cpu->memory[(uint16_t)(pc + 2)] };
+    decode_words(ins, pc, words);
+    if ((cpu->page_flags[pc >> CPU_PAGE_SHIFT] & PAGE_BREAK) && watch_breakpoint(cpu, pc))
+        ins->fuse = FUSE_BREAK;
+    cpu->page_flags[pc >> CPU_PAGE_SHIFT] |= PAGE_CODE;
+    cpu->page_flags[(uint16_t)(pc + ins->length - 1) >> CPU_PAGE_SHIFT] |= PAGE_CODE;
+    return ins;
+}
+
+static inline const struct instruction_t* decode(struct cpu_t *cpu, uint16_t pc) {
+    struct instruction_t *ins = &cpu->icache[pc & (CPU_ICACHE_SIZE - 1)];
+    if (ins->valid && ins->pc == pc)
+        return ins;
+    return decode_miss(cpu, ins, pc);
+}
+
+const struct instruction_t* cpu_decode(struct cpu_t *cpu, uint16_t pc) {
+    return decode(cpu, pc);
+}
+
+static void invalidate(struct cpu_t *cpu, uint16_t address) {
+    // An instruction is at most 3 words, so only entries starting up to 2 words back can cover address
+    for (int i = 0; i < 3; i++) {
+        uint16_t pc = address - i;
+        struct instruction_t *ins = &cpu->icache[pc & (CPU_ICACHE_SIZE - 1)];
+        if (ins->pc == pc)
+            ins->valid = 0;
+    }
+}
+
+// First write to a page since it was forked or snapshotted
+static void touch(struct cpu_t *cpu, uint8_t *flags) {
+    if (*flags & PAGE_SHARED)
+        cpu->shared_pages--;
+    *flags &= ~(PAGE_SHARED | PAGE_CLEAN);
+}
+
+static void trap(struct cpu_t *cpu, uint16_t address) {
+    uint8_t *flags = &cpu->page_flags[address >> CPU_PAGE_SHIFT];
+    if (*flags & (PAGE_SHARED | PAGE_CLEAN))
+        touch(cpu, flags);
+    if (*flags & PAGE_CODE) {
+        invalidate(cpu, address);
+        if (cpu->jit)
+            jit_invalidate(cpu, address);
+        if (cpu->aot)
+            aot_written(cpu, address, 1);
     }
+    if (*flags & PAGE_WATCH)
+        watch_written(cpu, address, 1);
+}
+
+static inline void written(struct cpu_t *cpu, uint16_t *ptr) {
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)cpu->memory;
+    if (offset < MEMORY_SIZE) {
+        uint16_t address = offset / sizeof(uint16_t);
+        if (cpu->page_flags[address >> CPU_PAGE_SHIFT])
+            trap(cpu, address);
+    }
+}
+
+static void push(struct cpu_t *cpu, uint16_t value) {
+    uint16_t *dst = &cpu->memory[--cpu->reg[SP]];
+    *dst = value;
+    written(cpu, dst);
 }
 
 static void skip(struct cpu_t *cpu) {
-    tick(cpu, 1);
-    uint16_t word = *next_word(cpu);
-    uint16_t o = word & 0x1F;
-    uint16_t a = (word >> 5) & 0x1F;
-    uint16_t b = (word >> 10) & 0x3F;
-    inc(cpu, a);
-    inc(cpu, b);
-    if (o >= IFB && o <= IFU)
-        skip(cpu);
+    const struct instruction_t *ins;
+    do {
+        ins = decode(cpu, cpu->reg[PC]);
+        cpu->cycles += 2;
+        cpu->reg[PC] += ins->length;
+    } while (ins->op >= IFB && ins->op <= IFU);
 }
 
-static uint16_t* lvalue(struct cpu_t *cpu, uint16_t v) {
+static uint16_t* lvalue(struct cpu_t *cpu, uint16_t v, uint16_t next, uint16_t at) {
     if (v < 0x08)
         return &cpu->reg[v];
     else if (v < 0x10)
         return &cpu->memory[cpu->reg[v - 0x08]];
     else if (v < 0x18)
-        return &cpu->memory[cpu->reg[v - 0x10] + *next_word(cpu)];
+        return &cpu->memory[(uint16_t)(cpu->reg[v - 0x10] + next)];
     else
         switch (v) {
             case 0x18: return &cpu->memory[--cpu->reg[SP]];
             case 0x19: return &cpu->memory[cpu->reg[SP]];
-            case 0x1A: return &cpu->memory[cpu->reg[SP] + *next_word(cpu)];
+            case 0x1A: return &cpu->memory[(uint16_t)(cpu->reg[SP] + next)];
             case 0x1B: return &cpu->reg[SP];
             case 0x1C: return &cpu->reg[PC];
             case 0x1D: return &cpu->reg[EX];
-            case 0x1E: return &cpu->memory[*next_word(cpu)];
-            case 0x1F: return next_word(cpu);
+            case 0x1E: return &cpu->memory[next];
+            case 0x1F: return &cpu->memory[at];
             default:   return NULL;
         }
 }
 
-static uint16_t rvalue(struct cpu_t *cpu, uint16_t v) {
-    if (v == 0x18)
-        return cpu->memory[cpu->reg[SP]++];
-    else if (v < 0x20)
-        return *lvalue(cpu, v);
-    else
-        return v - 0x21;
-}
-
-static void basic(struct cpu_t *cpu, uint16_t word) {
-    uint16_t  a = rvalue(cpu, (word >> 10) & 0x3F);
-    uint16_t *b = lvalue(cpu, (word >> 5)  & 0x1F);
-    uint16_t  o = word & 0x1F;
-    tick(cpu, basic_clocks[o] - 1);
-    uint16_t ex = 0;
-    switch (o) {
-        case SET: *b = a; break;
-        case ADD: cpu->reg[EX] = (((uint32_t)*b + (uint32_t)a) >> 16) & 0xFFFF; *b += a; break;
-        case SUB: cpu->reg[EX] =  (((int32_t)*b -  (int32_t)a) >> 16) & 0xFFFF; *b -= a; break;
-        case MUL: cpu->reg[EX] = (((uint32_t)*b * (uint32_t)a) >> 16) & 0xFFFF; *b *= a; break;
-        case MLI: cpu->reg[EX] =  (((int32_t)*b *  (int32_t)a) >> 16) & 0xFFFF; *(int16_t*)b *= (int16_t)a; break;
-        case DIV:
-            if (a == 0) {
-                cpu->reg[EX] = 0;
-                *b = 0;
-            } else {
-                cpu->reg[EX] = (((uint32_t)*b << 16) / (uint32_t)a) & 0xFFFF;
-                *b /= a;
-            }
-            break;
-        case DVI:
-            if (a == 0) {
-                cpu->reg[EX] = 0;
-                *b = 0;
-            } else {
-                cpu->reg[EX] = (((int32_t)*b << 16) / (int32_t)a) & 0xFFFF;
-                *(int16_t*)b /= (int16_t)a;
-            }
-            break;
-        case MOD: if (a == 0) *b = 0; else *b %= a; break;
-        case MDI: if (a == 0) *b = 0; else *(int16_t *)b %= (int16_t)a; break;
-        case AND: *b &= a; break;
-        case BOR: *b |= a; break;
-        case XOR: *b ^= a; break;
-        case SHR: cpu->reg[EX] = (((uint32_t)*b << 16) >> a)  & 0xFFFF; *b >>= a; break;
-        case ASR: cpu->reg[EX] = (((uint32_t)*b << 16) >> a)  & 0xFFFF; *(int16_t*)b >>= a; break;
-        case SHL: cpu->reg[EX] = (((uint32_t)*b << a)  >> 16) & 0xFFFF; *b <<= a; break;
-        case IFB: if ((*b & a) == 0) skip(cpu); break;
-        case IFC: if ((*b & a) != 0) skip(cpu); break;
-        case IFE: if  (*b != a) skip(cpu); break;
-        case IFN: if  (*b == a) skip(cpu); break;
-        case IFG: if  (*b <= a) skip(cpu); break;
-        case IFL: if  (*b >= a) skip(cpu); break;
-        case IFA: if (*(int16_t*)b <= (int16_t)a) skip(cpu); break;
-        case IFU: if (*(int16_t*)b >= (int16_t)a) skip(cpu); break;
-        case ADX:
-            ex = (((uint32_t)*b + (uint32_t)a + (uint32_t)cpu->reg[EX]) >> 16) & 0xFFFF;
-            *b += (a + cpu->reg[EX]);
-            cpu->reg[EX] = ex;
+static uint16_t rvalue(struct cpu_t *cpu, uint16_t v, uint16_t next, uint16_t at) {
+    switch (v) {
+        case 0x18: return cpu->memory[cpu->reg[SP]++];
+        // a is read while PC points just past its own (absent) operand word
+        case 0x1C: return at;
+        case 0x1F: return next;
+        case 0x20 ... 0x3F: return v - 0x21;
+        default: return *lvalue(cpu, v, next, at);
+    }
+}
+
+static void interrupt(struct cpu_t *cpu, uint16_t message);
+static void trigger(struct cpu_t *cpu, uint16_t message);
+static void drain_posted(struct cpu_t *cpu);
+
+static int tick_hardware(struct cpu_t *cpu) {
+    int ticking = 0;
+    for (int i = 0; i < cpu->hardware_count; i++) {
+        struct hardware_t *hw = cpu->hardware[i];
+        if (hw->enabled && hw->tick) {
+            if (cpu->journal)
+                journal_call(cpu, hw, SITE_TICK);
+            else
+                hw->tick(hw);
+            ticking = 1;
+        }
+    }
+    return ticking;
+}
+
+static int earlier(struct hardware_t *x, struct hardware_t *y) {
+    return x->deadline < y->deadline;
+}
+
+static void place(struct cpu_t *cpu, struct hardware_t *hw, int i) {
+    cpu->timers[i] = hw;
+    hw->timer = i + 1;
+}
+
+static void sift_up(struct cpu_t *cpu, int i) {
+    struct hardware_t *hw = cpu->timers[i];
+    while (i > 0 && earlier(hw, cpu->timers[(i - 1) / 2])) {
+        place(cpu, cpu->timers[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+    place(cpu, hw, i);
+}
+
+static void sift_down(struct cpu_t *cpu, int i) {
+    struct hardware_t *hw = cpu->timers[i];
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= cpu->timer_count)
             break;
-        case SBX:
-            ex = (((int32_t)*b - ((int32_t)a + (int32_t)cpu->reg[EX])) >> 16) & 0xFFFF;
-            *b -= (a + cpu->reg[EX]);
-            cpu->reg[EX] = ex;
+        if (child + 1 < cpu->timer_count && earlier(cpu->timers[child + 1], cpu->timers[child]))
+            child++;
+        if (!earlier(cpu->timers[child], hw))
             break;
-        case STI: *b = a; cpu->reg[I] += 1; cpu->reg[J] += 1; break;
-        case STD: *b = a; cpu->reg[I] -= 1; cpu->reg[J] -= 1; break;
-        default:
-            cpu->state = CPU_HALT;
+        place(cpu, cpu->timers[child], i);
+        i = child;
     }
+    place(cpu, hw, i);
 }
 
-static void special(struct cpu_t *cpu, uint16_t word) {
-    uint16_t o = (word >> 5) & 0x1F;
-    if (o == RES) {
-        cpu->state = CPU_HALT;
+static void unschedule(struct cpu_t *cpu, struct hardware_t *hw) {
+    if (!hw->timer)
         return;
+    int i = hw->timer - 1;
+    hw->timer = 0;
+    if (i == --cpu->timer_count)
+        return;
+    struct hardware_t *last = cpu->timers[cpu->timer_count];
+    place(cpu, last, i);
+    sift_up(cpu, i);
+    sift_down(cpu, last->timer - 1);
+}
+
+void cpu_cancel(struct hardware_t *hw) {
+    unschedule(hw->cpu, hw);
+    if (hw->cpu->journal)
+        journal_schedule(hw);
+}
+
+void cpu_schedule_at(struct hardware_t *hw, uint64_t cycle) {
+    struct cpu_t *cpu = hw->cpu;
+    unschedule(cpu, hw);
+    hw->deadline = cycle;
+    cpu->timers[cpu->timer_count] = hw;
+    sift_up(cpu, cpu->timer_count++);
+    if (cpu->journal)
+        journal_schedule(hw);
+}
+
+void cpu_schedule(struct hardware_t *hw, uint64_t delay) {
+    uint64_t now = hw->cpu->cycles;
+    cpu_schedule_at(hw, delay > UINT64_MAX - now ? UINT64_MAX : now + delay);
+}
+
+static void wake_hardware(struct cpu_t *cpu) {
+    // Bounded so a device that keeps rescheduling itself as already due can't stall the CPU
+    uint64_t now = cpu->cycles;
+    for (int n = cpu->timer_count; n > 0 && cpu->timer_count && cpu->timers[0]->deadline <= now; n--) {
+        struct hardware_t *hw = cpu->timers[0];
+        unschedule(cpu, hw);
+        if (hw->enabled && hw->wake) {
+            if (cpu->journal)
+                journal_call(cpu, hw, SITE_WAKE);
+            else
+                hw->wake(hw);
+        }
+        if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+            return;
+    }
+}
+
+static uint64_t next_deadline(struct cpu_t *cpu, uint64_t end) {
+    if (cpu->timer_count && cpu->timers[0]->deadline < end)
+        end = cpu->timers[0]->deadline;
+    if (cpu->journal) {
+        // Replayed host input has to land on the instruction it was recorded before
+        uint64_t input = journal_deadline(cpu);
+        if (input < end)
+            end = input;
     }
-    tick(cpu, spc_clocks[o]);
+    return end;
+}
 
-    uint16_t a, *b;
-    if (((word >> 10) & 0x3F) < 0x20) {
-        b = lvalue(cpu, (word >> 10) & 0x1F);
-        a = *b;
-    } else {
-        b = NULL;
-        a = rvalue(cpu, (word >> 10) & 0x3F);
-    }
-
-    switch (o) {
-        case JSR: cpu->memory[--cpu->reg[SP]] = cpu->reg[PC]; cpu->reg[PC] = a; break;
-        case INT: cpu_interrupt(cpu, a); break;
-        case IAG: if (b) *b = cpu->reg[IA]; break;
-        case IAS: cpu->reg[IA] = a; break;
-        case RFI:
-            cpu->iaq_enabled = 1;
-            cpu->reg[A]  = cpu->memory[cpu->reg[SP]++];
-            cpu->reg[PC] = cpu->memory[cpu->reg[SP]++];
-            break;
-        case IAQ: cpu->iaq_enabled = !a; break;
-        case HWN: if (b) *b = cpu->hardware_count; break;
-        case HWQ:
-            if (a < cpu->hardware_count && cpu->hardware[a].enabled) {
-                cpu->reg[A] = cpu->hardware[a].id & 0xFFFF;
-                cpu->reg[B] = (cpu->hardware[a].id >> 16) & 0xFFFF;
-                cpu->reg[C] = cpu->hardware[a].version & 0xFFFF;
-                cpu->reg[X] = cpu->hardware[a].manufacturer & 0xFFFF;
-                cpu->reg[Y] = (cpu->hardware[a].manufacturer >> 16) & 0xFFFF;
-            } else {
-                cpu->reg[A] = 0;
-                cpu->reg[B] = 0;
-                cpu->reg[C] = 0;
-                cpu->reg[X] = 0;
-                cpu->reg[Y] = 0;
-            }
-            break;
-        case HWI:
-            if (a < cpu->hardware_count &&
-                cpu->hardware[a].enabled &&
-                cpu->hardware[a].interrupt)
-                cpu->hardware[a].interrupt(&cpu->hardware[a]);
-            break;
+// Superinstructions. A store followed by an optional counter step, a test and a branch back to the store,
+//
+//   SET [base+R], src / SUB R, 1 / IFN R, end / SET PC, loop     (or ADD R, 1, or [R] without the base)
+//   STI [I], [J] / IFN I, end / SET PC, loop                     (or STD, any of I and J on either side)
+//
+// runs as many whole iterations as the cycles left allow in one go, ending on the store of the last
+// iteration so the exit path is still interpreted. Sources can be literals, registers or memory, addressed
+// through registers or not. Loops that would store into decoded code aren't fused, which leaves nothing
+// else to trap and means the instructions can't change underneath. The result, cycles and EX included,
+// is what stepping gives.
+
+static int literal(const struct instruction_t *ins, uint16_t *value) {
+    if (ins->a >= 0x20)
+        *value = ins->a - 0x21;
+    else if (ins->a == 0x1F)
+        *value = ins->a_word;
+    else
+        return 0;
+    return 1;
+}
+
+// How an operand moves through the loop, address (or value) start + step * iteration
+typedef struct {
+    int memory;
+    uint16_t start;
+    int16_t step;
+} stream_t;
+
+static int stream(struct cpu_t *cpu, uint16_t v, uint16_t next, const int16_t *delta, stream_t *out) {
+    out->memory = 1;
+    switch (v) {
+        case 0x00 ... 0x07:
+            out->memory = 0;
+            out->start = cpu->reg[v];
+            out->step = delta[v];
+            return 1;
+        case 0x08 ... 0x0F:
+            out->start = cpu->reg[v - 0x08];
+            out->step = delta[v - 0x08];
+            return 1;
+        case 0x10 ... 0x17:
+            out->start = cpu->reg[v - 0x10] + next;
+            out->step = delta[v - 0x10];
+            return 1;
+        case 0x1E:
+            out->start = next;
+            out->step = 0;
+            return 1;
+        case 0x1F:
+        case 0x20 ... 0x3F:
+            out->memory = 0;
+            out->start = v == 0x1F ? next : v - 0x21;
+            out->step = 0;
+            return 1;
         default:
-            cpu->state = CPU_HALT;
+            return 0;
     }
 }
 
-void cpu_step(struct cpu_t *cpu) {
-    if (cpu->state == CPU_HALT ||
-        cpu->state == CPU_ON_FIRE)
-        return;
-    
-    if (!cpu->iaq_enabled && cpu->iaq_index)
-        cpu_interrupt(cpu, cpu->iaq[--cpu->iaq_index]);
-    
-    for (int i = 0; i < cpu->hardware_count; i++) {
-        struct hardware_t *hw = &cpu->hardware[i];
-        if (hw->enabled && hw->tick)
-            hw->tick(hw);
-    }
-    
-    uint16_t word = *next_word(cpu);
-    if ((word & 0x1F) == SPC)
-        special(cpu, word);
+// Start of the count words a stream covers, in address order
+static uint16_t lowest(const stream_t *s, uint32_t count) {
+    return s->step < 0 ? s->start - (count - 1) : s->start;
+}
+
+// Returns the cycles run, 0 if ins doesn't start a loop or not even one iteration fits before limit
+static uint64_t fused_loop(struct cpu_t *cpu, const struct instruction_t *ins, uint64_t limit) {
+    uint16_t pc = ins->pc, at = pc + ins->length, end, target;
+    const struct instruction_t *step = decode(cpu, at), *test, *jump;
+    int16_t delta[8] = {0};
+    if (ins->op == STI || ins->op == STD)
+        delta[I] = delta[J] = ins->op == STI ? 1 : -1;
+    uint16_t one;
+    if ((step->op == ADD || step->op == SUB) && step->b < 0x08 && !delta[step->b] &&
+        literal(step, &one) && one == 1) {
+        delta[step->b] = step->op == ADD ? 1 : -1;
+        at += step->length;
+    } else
+        step = NULL;
+    test = decode(cpu, at);
+    jump = decode(cpu, (uint16_t)(at + test->length));
+    if (test->op != IFN || test->b >= 0x08 || !delta[test->b] || !literal(test, &end) ||
+        jump->op != SET || jump->b != 0x1C || !literal(jump, &target) || target != pc)
+        goto NONE;
+
+    stream_t dst, src;
+    if (!stream(cpu, ins->b, ins->b_word, delta, &dst) || !dst.memory || !dst.step ||
+        !stream(cpu, ins->a, ins->a_word, delta, &src))
+        goto NONE;
+
+    // The test fails after n iterations, the last of which is left to the interpreter
+    uint16_t counter = cpu->reg[test->b];
+    uint32_t n = (uint16_t)((end - counter) * delta[test->b]);
+    uint64_t cost = ins->cycles + (step ? step->cycles : 0) + test->cycles + jump->cycles;
+    uint64_t count = n ? n - 1 : 0xFFFF;
+    if ((limit - cpu->cycles) / cost < count)
+        count = (limit - cpu->cycles) / cost;
+    if (!count)
+        return 0;
+
+    // Pages past the last wrap back round to the start
+    uint16_t low = lowest(&dst, count);
+    uint32_t first = low >> CPU_PAGE_SHIFT, last = (low + count - 1) >> CPU_PAGE_SHIFT;
+    for (uint32_t i = first; i <= last; i++)
+        if (cpu->page_flags[i % CPU_PAGE_COUNT] & PAGE_CODE)
+            return 0;
+    for (uint32_t i = first; i <= last; i++) {
+        uint8_t *flags = &cpu->page_flags[i % CPU_PAGE_COUNT];
+        if (*flags & (PAGE_SHARED | PAGE_CLEAN))
+            touch(cpu, flags);
+    }
+
+    uint16_t *memory = cpu->memory;
+    int wraps = (uint32_t)low + count > 0x10000;
+    if (src.memory && !src.step && (uint16_t)(src.start - low) >= count) {
+        src.memory = 0;
+        src.start = memory[src.start];
+    }
+    if (!src.memory && !src.step && !wraps) {
+        // A fill
+        for (uint32_t i = 0; i < count; i++)
+            memory[low + i] = src.start;
+    } else if (src.memory && src.step == dst.step && !wraps && (uint32_t)lowest(&src, count) + count <= 0x10000 &&
+               (src.start == dst.start || (dst.step > 0 ? (uint16_t)(dst.start - src.start) >= count
+                                                         : (uint16_t)(src.start - dst.start) >= count))) {
+        // A copy that never reads what it has written, unless it's in place
+        memmove(&memory[low], &memory[lowest(&src, count)], count * sizeof(uint16_t));
+    } else {
+        uint16_t d = dst.start, s = src.start;
+        for (uint32_t i = 0; i < count; i++) {
+            memory[d] = src.memory ? memory[s] : s;
+            d += dst.step;
+            s += src.step;
+        }
+    }
+
+    for (int r = 0; r < 8; r++)
+        cpu->reg[r] += delta[r] * (uint16_t)count;
+    if (step) {
+        // From the last step run, what the register was before it
+        uint16_t before = cpu->reg[step->b] - delta[step->b];
+        cpu->reg[EX] = step->op == ADD ? before == 0xFFFF : before == 0 ? 0xFFFF : 0;
+    }
+    cpu->reg[PC] = pc;
+    cpu->cycles += count * cost;
+    return count * cost;
+
+NONE:
+    cpu->icache[pc & (CPU_ICACHE_SIZE - 1)].fuse = 0;
+    return 0;
+}
+
+// AFL-style hit counts per edge, PCs are scattered first so nearby edges don't collide in small maps
+static inline void coverage_record(struct cpu_t *cpu, uint16_t pc) {
+    uint16_t here = pc * 40503u;
+    uint8_t *count = &cpu->coverage[(here ^ cpu->coverage_prev) & cpu->coverage_mask];
+    *count += *count != 0xFF;
+    cpu->coverage_prev = here >> 1;
+}
+
+enum cpu_stop cpu_run(struct cpu_t *cpu, uint64_t budget) {
+    static void *const basic_ops[0x20] = {
+        [0 ... 0x1F] = &&invalid,
+        [SET] = &&set, [ADD] = &&add, [SUB] = &&sub, [MUL] = &&mul, [MLI] = &&mli,
+        [DIV] = &&div, [DVI] = &&dvi, [MOD] = &&mod, [MDI] = &&mdi,
+        [AND] = &&and, [BOR] = &&bor, [XOR] = &&xor, [SHR] = &&shr, [ASR] = &&asr, [SHL] = &&shl,
+        [IFB] = &&ifb, [IFC] = &&ifc, [IFE] = &&ife, [IFN] = &&ifn,
+        [IFG] = &&ifg, [IFA] = &&ifa, [IFL] = &&ifl, [IFU] = &&ifu,
+        [ADX] = &&adx, [SBX] = &&sbx, [STI] = &&sti, [STD] = &&std
+    };
+    static void *const special_ops[0x20] = {
+        [0 ... 0x1F] = &&invalid,
+        [JSR] = &&jsr, [INT] = &&int_, [IAG] = &&iag, [IAS] = &&ias, [RFI] = &&rfi, [IAQ] = &&iaq,
+        [HWN] = &&hwn, [HWQ] = &&hwq, [HWI] = &&hwi
+    };
+
+    if (cpu->journal)
+        journal_enter(cpu);
+    if (cpu->state == CPU_HALT)
+        return CPU_STOP_HALT;
+    if (cpu->state == CPU_ON_FIRE)
+        return CPU_STOP_ON_FIRE;
+
+    // Devices without a tick callback are skipped entirely until HWI gives them a chance to install one
+    uint64_t end = budget > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + budget;
+    // The earlier of the budget and the next device deadline, so the loop only has one bound to check
+    uint64_t limit = next_deadline(cpu, end);
+    int ticking = 1;
+    const struct instruction_t *ins;
+    uint16_t pc, a = 0, *b = NULL, ex;
+
+next:
+    if (cpu->cycles >= limit) {
+        // A hit from the budget's last instruction is reported by this run, not the next
+        if (__atomic_load_n(&cpu->posted_pending, __ATOMIC_RELAXED) && watch_pending(cpu))
+            goto watched;
+        if (cpu->cycles >= end) {
+            if (cpu->journal)
+                journal_leave(cpu);
+            return CPU_STOP_BUDGET;
+        }
+        if (cpu->journal) {
+            journal_host(cpu);
+            if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+                goto stopped;
+        }
+        wake_hardware(cpu);
+        if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+            goto stopped;
+        limit = next_deadline(cpu, end);
+    }
+    // Interrupts from other threads wait here for at most one instruction or translated block
+    if (__atomic_load_n(&cpu->posted_pending, __ATOMIC_RELAXED)) {
+        // Watch hits are counted as pending too, they stop here at the boundary after the instruction
+        if (watch_pending(cpu))
+            goto watched;
+        drain_posted(cpu);
+        if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+            goto stopped;
+    }
+    if (!cpu->iaq_enabled && cpu->iaq_count) {
+        uint16_t message = cpu->iaq[cpu->iaq_head++];
+        cpu->iaq_count--;
+        if (cpu->reg[IA])
+            trigger(cpu, message);
+    }
+    if (ticking) {
+        ticking = tick_hardware(cpu);
+        if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+            goto stopped;
+        limit = next_deadline(cpu, end);
+    }
+
+    // Translated blocks never run across a device tick or deadline, and only when they fit in what's left
+    if (cpu->aot && !ticking && !cpu->trace && !cpu->profile && !cpu->coverage && !cpu->watch &&
+        aot_enter(cpu, limit))
+        goto next;
+    if (cpu->jit && !ticking && !cpu->trace && !cpu->profile && !cpu->coverage && !cpu->watch &&
+        jit_enter(cpu, limit))
+        goto next;
+
+    pc = cpu->reg[PC];
+    ins = decode(cpu, pc);
+    // Fused code has no instruction boundaries for devices, interrupts, recording or watches to act on.
+    // Breakpoints are flagged the same way so other instructions don't pay for them
+    if (ins->fuse) {
+        if (ins->fuse == FUSE_BREAK) {
+            if (watch_break(cpu, pc))
+                goto watched;
+        } else if (!ticking && (cpu->iaq_enabled || !cpu->iaq_count) && !cpu->trace && !cpu->profile &&
+                   !cpu->coverage && !cpu->watch && fused_loop(cpu, ins, limit))
+            goto next;
+    }
+    if (cpu->coverage)
+        coverage_record(cpu, pc);
+    if (cpu->trace)
+        trace_record(cpu, ins);
+    if (cpu->profile)
+        profile_record(cpu, ins);
+    cpu->reg[PC] = pc + ins->length;
+    cpu->cycles += ins->cycles;
+    if (ins->op & 0x20)
+        goto *special_ops[ins->op & 0x1F];
+    if (ins->a >= 0x20)
+        a = ins->a - 0x21;
+    else if (ins->a < 0x08)
+        a = cpu->reg[ins->a];
     else
-        basic(cpu, word);
+        a = rvalue(cpu, ins->a, ins->a_word, pc + 1);
+    if (ins->b < 0x08)
+        b = &cpu->reg[ins->b];
+    else
+        b = lvalue(cpu, ins->b, ins->b_word, pc + ins->length - 1);
+    goto *basic_ops[ins->op];
+
+#define STORE(V)        \
+    do {                \
+        *b = (V);       \
+        written(cpu, b); \
+        goto next;      \
+    } while (0)
+// A taken IFx straight into SET PC, literal branches without a trip round the loop, when nothing would
+// have happened at the boundary in between
+#define SKIP_UNLESS(C)                                                                          \
+    do {                                                                                        \
+        if (!(C))                                                                               \
+            skip(cpu);                                                                          \
+        else if (cpu->cycles < limit && !ticking && (cpu->iaq_enabled || !cpu->iaq_count) &&    \
+                 !cpu->trace && !cpu->profile && !cpu->coverage && !cpu->watch &&                   \
+                 !__atomic_load_n(&cpu->posted_pending, __ATOMIC_RELAXED)) {                        \
+            const struct instruction_t *jump = decode(cpu, cpu->reg[PC]);                       \
+            if (jump->op == SET && jump->b == 0x1C && literal(jump, &cpu->reg[PC]))             \
+                cpu->cycles += jump->cycles;                                                    \
+        }                                                                                       \
+        goto next;                                                                              \
+    } while (0)
+
+set: STORE(a);
+add: cpu->reg[EX] = (((uint32_t)*b + (uint32_t)a) >> 16) & 0xFFFF; STORE(*b + a);
+sub: cpu->reg[EX] =  (((int32_t)*b -  (int32_t)a) >> 16) & 0xFFFF; STORE(*b - a);
+mul: cpu->reg[EX] = (((uint32_t)*b * (uint32_t)a) >> 16) & 0xFFFF; STORE(*b * a);
+mli: cpu->reg[EX] = ((int32_t)((uint32_t)*b * (uint32_t)a) >> 16) & 0xFFFF; STORE((int16_t)*b * (int16_t)a);
+div:
+    if (a == 0) {
+        cpu->reg[EX] = 0;
+        STORE(0);
+    }
+    cpu->reg[EX] = (((uint32_t)*b << 16) / (uint32_t)a) & 0xFFFF;
+    STORE(*b / a);
+dvi:
+    if (a == 0) {
+        cpu->reg[EX] = 0;
+        STORE(0);
+    }
+    cpu->reg[EX] = ((int32_t)((uint32_t)*b << 16) / (int32_t)a) & 0xFFFF;
+    STORE((int16_t)*b / (int16_t)a);
+mod: STORE(a == 0 ? 0 : *b % a);
+mdi: STORE(a == 0 ? 0 : (int16_t)*b % (int16_t)a);
+and: STORE(*b & a);
+bor: STORE(*b | a);
+xor: STORE(*b ^ a);
+// Shift counts wrap at 32 the way x86 takes them, which the translators and batches match
+shr: cpu->reg[EX] = (((uint32_t)*b << 16) >> (a & 31)) & 0xFFFF; STORE(*b >> (a & 31));
+asr: cpu->reg[EX] = (((uint32_t)*b << 16) >> (a & 31)) & 0xFFFF; STORE((int16_t)*b >> (a & 31));
+shl: cpu->reg[EX] = (((uint32_t)*b << (a & 31)) >> 16) & 0xFFFF; STORE((uint32_t)*b << (a & 31));
+ifb: SKIP_UNLESS((*b & a) != 0);
+ifc: SKIP_UNLESS((*b & a) == 0);
+ife: SKIP_UNLESS(*b == a);
+ifn: SKIP_UNLESS(*b != a);
+ifg: SKIP_UNLESS(*b > a);
+ifl: SKIP_UNLESS(*b < a);
+ifa: SKIP_UNLESS((int16_t)*b > (int16_t)a);
+ifu: SKIP_UNLESS((int16_t)*b < (int16_t)a);
+adx:
+    ex = (((uint32_t)*b + (uint32_t)a + (uint32_t)cpu->reg[EX]) >> 16) & 0xFFFF;
+    *b += (a + cpu->reg[EX]);
+    cpu->reg[EX] = ex;
+    written(cpu, b);
+    goto next;
+sbx:
+    ex = (((int32_t)*b - ((int32_t)a + (int32_t)cpu->reg[EX])) >> 16) & 0xFFFF;
+    *b -= (a + cpu->reg[EX]);
+    cpu->reg[EX] = ex;
+    written(cpu, b);
+    goto next;
+sti:
+    *b = a;
+    written(cpu, b);
+    cpu->reg[I] += 1;
+    cpu->reg[J] += 1;
+    goto next;
+std:
+    *b = a;
+    written(cpu, b);
+    cpu->reg[I] -= 1;
+    cpu->reg[J] -= 1;
+    goto next;
+
+#undef STORE
+#undef SKIP_UNLESS
+#define OPERAND()                                       \
+    do {                                                \
+        if (ins->a < 0x20) {                             \
+            b = lvalue(cpu, ins->a, ins->a_word, pc + 1); \
+            a = *b;                                     \
+        } else {                                        \
+            b = NULL;                                   \
+            a = rvalue(cpu, ins->a, ins->a_word, pc + 1); \
+        }                                               \
+    } while (0)
+
+jsr:
+    OPERAND();
+    push(cpu, cpu->reg[PC]);
+    cpu->reg[PC] = a;
+    goto next;
+int_:
+    OPERAND();
+    interrupt(cpu, a);
+    if (cpu->state == CPU_ON_FIRE)
+        goto stopped;
+    goto next;
+iag:
+    OPERAND();
+    if (b) {
+        *b = cpu->reg[IA];
+        written(cpu, b);
+    }
+    goto next;
+ias:
+    OPERAND();
+    cpu->reg[IA] = a;
+    goto next;
+rfi:
+    OPERAND();
+    cpu->iaq_enabled = 0;
+    cpu->reg[A]  = cpu->memory[cpu->reg[SP]++];
+    cpu->reg[PC] = cpu->memory[cpu->reg[SP]++];
+    goto next;
+iaq:
+    OPERAND();
+    cpu->iaq_enabled = a != 0;
+    goto next;
+hwn:
+    OPERAND();
+    if (b) {
+        *b = cpu->hardware_count;
+        written(cpu, b);
+    }
+    goto next;
+hwq:
+    OPERAND();
+    if (a < cpu->hardware_count && cpu->hardware[a]->enabled) {
+        cpu->reg[A] = cpu->hardware[a]->id & 0xFFFF;
+        cpu->reg[B] = (cpu->hardware[a]->id >> 16) & 0xFFFF;
+        cpu->reg[C] = cpu->hardware[a]->version & 0xFFFF;
+        cpu->reg[X] = cpu->hardware[a]->manufacturer & 0xFFFF;
+        cpu->reg[Y] = (cpu->hardware[a]->manufacturer >> 16) & 0xFFFF;
+    } else {
+        cpu->reg[A] = 0;
+        cpu->reg[B] = 0;
+        cpu->reg[C] = 0;
+        cpu->reg[X] = 0;
+        cpu->reg[Y] = 0;
+    }
+    goto next;
+hwi:
+    OPERAND();
+    if (a < cpu->hardware_count &&
+        cpu->hardware[a]->enabled &&
+        cpu->hardware[a]->interrupt) {
+        if (cpu->journal)
+            journal_call(cpu, cpu->hardware[a], SITE_INTERRUPT);
+        else
+            cpu->hardware[a]->interrupt(cpu->hardware[a]);
+        ticking = 1;
+        if (cpu->state != CPU_IDLE && cpu->state != CPU_OK)
+            goto stopped;
+        limit = next_deadline(cpu, end);
+    }
+    goto next;
+
+invalid:
+    // RES halts before its operand is consumed, unknown special ops still evaluate theirs
+    if (ins->op == (0x20 | RES))
+        cpu->reg[PC] = pc + 1;
+    else if (ins->op & 0x20)
+        OPERAND();
+    cpu->state = CPU_HALT;
+#undef OPERAND
+stopped:
+    if (cpu->journal)
+        journal_leave(cpu);
+    return cpu->state == CPU_ON_FIRE ? CPU_STOP_ON_FIRE : CPU_STOP_HALT;
+
+watched:
+    watch_report(cpu);
+    if (cpu->journal)
+        journal_leave(cpu);
+    return CPU_STOP_WATCH;
 }
 
-void cpu_interrupt(struct cpu_t *cpu, uint16_t message) {
+void cpu_step(struct cpu_t *cpu) {
+    // Every instruction that doesn't halt costs at least one cycle
+    cpu_run(cpu, 1);
+}
+
+static void trigger(struct cpu_t *cpu, uint16_t message) {
+    cpu->iaq_enabled = 1;
+    push(cpu, cpu->reg[PC]);
+    push(cpu, cpu->reg[A]);
+    cpu->reg[PC] = cpu->reg[IA];
+    cpu->reg[A]  = message;
+}
+
+static void interrupt(struct cpu_t *cpu, uint16_t message) {
     if (!cpu->reg[IA])
         return;
-    if (!cpu->iaq_enabled) {
-        cpu->iaq_enabled = 1;
-        cpu->memory[--cpu->reg[SP]] = cpu->reg[PC];
-        cpu->memory[--cpu->reg[SP]] = cpu->reg[A];
-        cpu->reg[PC] = cpu->reg[IA];
-        cpu->reg[A]  = message;
-    } else {
-        if (cpu->iaq_index >= 256)
+    // Anything still queued goes first, even once queueing is off again
+    if (!cpu->iaq_enabled && !cpu->iaq_count)
+        trigger(cpu, message);
+    else {
+        if (cpu->iaq_count >= 256)
             cpu->state = CPU_ON_FIRE;
         else
-            cpu->iaq[cpu->iaq_index++] = message;
+            cpu->iaq[(uint8_t)(cpu->iaq_head + cpu->iaq_count++)] = message;
+    }
+}
+
+void cpu_interrupt(struct cpu_t *cpu, uint16_t message) {
+    if (!cpu->journal)
+        interrupt(cpu, message);
+    else if (journal_interrupt(cpu, message)) {
+        interrupt(cpu, message);
+        journal_interrupted(cpu);
+    }
+}
+
+// Bounded ring after Vyukov's queue: a slot is free for position pos when its sequence is pos and ready once
+// it's pos + 1. Sequences are stored less the slot's index so zeroed memory is an empty queue
+int cpu_post_interrupt(struct cpu_t *cpu, uint16_t message) {
+    uint32_t pos = __atomic_load_n(&cpu->posted_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        uint8_t i = pos;
+        int32_t diff = (int32_t)(__atomic_load_n(&cpu->posted[i].sequence, __ATOMIC_ACQUIRE) + i - pos);
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&cpu->posted_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // Still holds a message from the last lap, so 256 are waiting
+            __atomic_add_fetch(&cpu->posted_overflow, 1, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&cpu->posted_pending, 1, __ATOMIC_RELEASE);
+            return 0;
+        } else
+            pos = __atomic_load_n(&cpu->posted_tail, __ATOMIC_RELAXED);
+    }
+    uint8_t i = pos;
+    cpu->posted[i].message = message;
+    __atomic_store_n(&cpu->posted[i].sequence, pos + 1 - i, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cpu->posted_pending, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Slots can be published out of order, this stops at the first that isn't ready and picks the rest up later
+static void drain_posted(struct cpu_t *cpu) {
+    uint32_t taken = 0;
+    for (;;) {
+        uint32_t pos = cpu->posted_head;
+        uint8_t i = pos;
+        if (__atomic_load_n(&cpu->posted[i].sequence, __ATOMIC_ACQUIRE) + i != pos + 1)
+            break;
+        uint16_t message = cpu->posted[i].message;
+        __atomic_store_n(&cpu->posted[i].sequence, pos + 256 - i, __ATOMIC_RELEASE);
+        cpu->posted_head = pos + 1;
+        taken++;
+        cpu_interrupt(cpu, message);
+    }
+    uint32_t overflow = __atomic_exchange_n(&cpu->posted_overflow, 0, __ATOMIC_ACQUIRE);
+    if (overflow)
+        cpu->state = CPU_ON_FIRE;
+    // Producers count after publishing, so this can briefly go below zero, which only costs another look
+    __atomic_sub_fetch(&cpu->posted_pending, taken + overflow, __ATOMIC_RELEASE);
+}
+
+// Writes made by the CPU itself, which never need journaling
+void jit_written(struct cpu_t *cpu, uint16_t address) {
+    trap(cpu, address);
+}
+
+// Have writes to address trap as if it had been decoded
+void code_watch(struct cpu_t *cpu, uint16_t address) {
+    cpu->page_flags[address >> CPU_PAGE_SHIFT] |= PAGE_CODE;
+}
+
+void watch_flag(struct cpu_t *cpu, uint16_t address, int breakpoint, int set) {
+    uint8_t flag = breakpoint ? PAGE_BREAK : PAGE_WATCH;
+    if (set)
+        cpu->page_flags[address >> CPU_PAGE_SHIFT] |= flag;
+    else
+        cpu->page_flags[address >> CPU_PAGE_SHIFT] &= ~flag;
+}
+
+// Decode pc again once a breakpoint there comes or goes
+void watch_redecode(struct cpu_t *cpu, uint16_t pc) {
+    struct instruction_t *ins = &cpu->icache[pc & (CPU_ICACHE_SIZE - 1)];
+    if (ins->pc == pc)
+        ins->valid = 0;
+}
+
+void cpu_invalidate(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    if (cpu->journal)
+        journal_written(cpu, address, count);
+    if (count >= CPU_ICACHE_SIZE) {
+        // Cheaper to drop the whole cache than to probe it word by word. Only written where needed so a
+        // fresh CPU's untouched cache stays on the zero page
+        for (int i = 0; i < CPU_ICACHE_SIZE; i++)
+            if (cpu->icache[i].valid)
+                cpu->icache[i].valid = 0;
+        uint32_t first = address >> CPU_PAGE_SHIFT, pages = ((address + count - 1) >> CPU_PAGE_SHIFT) - first + 1;
+        for (uint32_t i = 0; i < pages && i < CPU_PAGE_COUNT; i++)
+            touch(cpu, &cpu->page_flags[(first + i) % CPU_PAGE_COUNT]);
+        if (cpu->jit)
+            for (uint32_t i = 0; i < count && i < 0x10000; i++)
+                jit_invalidate(cpu, address + i);
+        if (cpu->aot)
+            aot_written(cpu, address, count);
+        if (cpu->watch)
+            watch_written(cpu, address, count);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t at = address + i;
+        trap(cpu, at);
+    }
+}
+
+int cpu_coverage_start(struct cpu_t *cpu, uint8_t *map, size_t size) {
+    if (!map || !size || size > 0x10000 || size & (size - 1))
+        return 0;
+    cpu->coverage = map;
+    cpu->coverage_mask = size - 1;
+    cpu->coverage_prev = 0;
+    return 1;
+}
+
+void cpu_coverage_stop(struct cpu_t *cpu) {
+    cpu->coverage = NULL;
+}
+
+struct snapshot_t* cpu_snapshot(struct cpu_t *cpu) {
+    // The oldest snapshot in a chain holds every page, the rest only what was written in between
+    int count = 0;
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        if (!cpu->snapshots || !(cpu->page_flags[i] & PAGE_CLEAN))
+            count++;
+    struct snapshot_t *snapshot = malloc(sizeof(struct snapshot_t));
+    if (!snapshot)
+        return NULL;
+    if (!(snapshot->pages = malloc(count * sizeof(*snapshot->pages)))) {
+        free(snapshot);
+        return NULL;
     }
+    memcpy(snapshot->reg, cpu->reg, sizeof(cpu->reg));
+    snapshot->state = cpu->state;
+    snapshot->iaq_enabled = cpu->iaq_enabled;
+    snapshot->iaq_count = cpu->iaq_count;
+    snapshot->iaq_head = cpu->iaq_head;
+    memcpy(snapshot->iaq, cpu->iaq, sizeof(cpu->iaq));
+    snapshot->cycles = cpu->cycles;
+    count = 0;
+    for (int i = 0; i < CPU_PAGE_COUNT; i++) {
+        if (!cpu->snapshots || !(cpu->page_flags[i] & PAGE_CLEAN)) {
+            memcpy(snapshot->pages[count], &cpu->memory[i * PAGE_WORDS], sizeof(*snapshot->pages));
+            snapshot->slot[i] = count++;
+        } else
+            snapshot->slot[i] = -1;
+        cpu->page_flags[i] |= PAGE_CLEAN;
+    }
+    snapshot->prev = cpu->snapshots;
+    cpu->snapshots = snapshot;
+    return snapshot;
+}
+
+static const uint16_t* saved_page(struct snapshot_t *snapshot, int page) {
+    while (snapshot->slot[page] < 0)
+        snapshot = snapshot->prev;
+    return snapshot->pages[snapshot->slot[page]];
+}
+
+static void free_snapshot(struct snapshot_t *snapshot) {
+    free(snapshot->pages);
+    free(snapshot);
+}
+
+int cpu_rewind(struct cpu_t *cpu, struct snapshot_t *snapshot) {
+    struct snapshot_t *s = cpu->snapshots;
+    while (s && s != snapshot)
+        s = s->prev;
+    if (!s)
+        return 0;
+
+    // Only pages written since the snapshot differ from it: anything dirty now or saved by a later snapshot
+    uint8_t stale[CPU_PAGE_COUNT];
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        stale[i] = !(cpu->page_flags[i] & PAGE_CLEAN);
+    while (cpu->snapshots != snapshot) {
+        s = cpu->snapshots;
+        for (int i = 0; i < CPU_PAGE_COUNT; i++)
+            if (s->slot[i] >= 0)
+                stale[i] = 1;
+        cpu->snapshots = s->prev;
+        free_snapshot(s);
+    }
+    for (int i = 0; i < CPU_PAGE_COUNT; i++) {
+        if (!stale[i])
+            continue;
+        memcpy(&cpu->memory[i * PAGE_WORDS], saved_page(snapshot, i), PAGE_WORDS * sizeof(uint16_t));
+        cpu_invalidate(cpu, i * PAGE_WORDS, PAGE_WORDS);
+        cpu->page_flags[i] |= PAGE_CLEAN;
+    }
+
+    memcpy(cpu->reg, snapshot->reg, sizeof(cpu->reg));
+    cpu->state = snapshot->state;
+    cpu->iaq_enabled = snapshot->iaq_enabled;
+    cpu->iaq_count = snapshot->iaq_count;
+    cpu->iaq_head = snapshot->iaq_head;
+    memcpy(cpu->iaq, snapshot->iaq, sizeof(cpu->iaq));
+    cpu->cycles = snapshot->cycles;
+    return 1;
+}
+
+void cpu_forget(struct cpu_t *cpu, struct snapshot_t *snapshot) {
+    struct snapshot_t *s = cpu->snapshots;
+    while (s && s != snapshot)
+        s = s->prev;
+    if (!s || !snapshot->prev)
+        return;
+    // Fold the older pages in so this becomes the full copy at the bottom of the chain
+    uint16_t (*pages)[PAGE_WORDS] = malloc(CPU_PAGE_COUNT * sizeof(*pages));
+    if (!pages)
+        return;
+    for (int i = 0; i < CPU_PAGE_COUNT; i++) {
+        memcpy(pages[i], saved_page(snapshot, i), sizeof(*pages));
+        snapshot->slot[i] = i;
+    }
+    free(snapshot->pages);
+    snapshot->pages = pages;
+    for (struct snapshot_t *s = snapshot->prev, *prev; s; s = prev) {
+        prev = s->prev;
+        free_snapshot(s);
+    }
+    snapshot->prev = NULL;
+}
+
+static size_t header_size(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(struct cpu_t) + page - 1) & ~(page - 1);
+}
+
+struct cpu_t* cpu_create(void) {
+    // One mapping holds the CPU followed by its memory, untouched pages cost nothing
+    size_t header = header_size();
+    void *base = mmap(NULL, header + MEMORY_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    struct cpu_t *cpu = base;
+    cpu->memory = (uint16_t*)((char*)base + header);
+    return cpu;
+}
+
+// Also used by image.c, an unlinked shared memory file the size of memory with one reference
+struct image_t* image_create(void) {
+    static int serial;
+    char name[64];
+    snprintf(name, sizeof(name), "/ccpu-%d-%d", (int)getpid(), __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    shm_unlink(name);
+    struct image_t *image = malloc(sizeof(struct image_t));
+    if (!image || ftruncate(fd, MEMORY_SIZE) != 0) {
+        free(image);
+        close(fd);
+        return NULL;
+    }
+    image->fd = fd;
+    image->refs = 1;
+    return image;
+}
+
+int image_fd(struct image_t *image) {
+    return image->fd;
+}
+
+void image_retain(struct image_t *image) {
+    __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+}
+
+void image_release(struct image_t *image) {
+    if (image && __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(image->fd);
+        free(image);
+    }
+}
+
+// Maps memory copy-on-write over the image, taking the caller's reference
+static int adopt(struct cpu_t *cpu, struct image_t *image) {
+    if (mmap(cpu->memory, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED)
+        return 0;
+    image_release(cpu->image);
+    cpu->image = image;
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        cpu->page_flags[i] |= PAGE_SHARED;
+    cpu->shared_pages = CPU_PAGE_COUNT;
+    return 1;
+}
+
+// Also used by image.c, replaces all of memory with the image as if it had been written in
+int image_map(struct cpu_t *cpu, struct image_t *image) {
+    image_retain(image);
+    if (!adopt(cpu, image)) {
+        image_release(image);
+        return 0;
+    }
+    // Drops decoded and translated code and clean flags, then marks every page shared again
+    cpu_invalidate(cpu, 0, 0x10000);
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        cpu->page_flags[i] |= PAGE_SHARED;
+    cpu->shared_pages = CPU_PAGE_COUNT;
+    return 1;
+}
+
+static struct image_t* freeze(struct cpu_t *cpu) {
+    // Untouched since the last fork, so the existing image is still an exact copy
+    if (cpu->image && cpu->shared_pages == CPU_PAGE_COUNT)
+        return cpu->image;
+
+    struct image_t *image = image_create();
+    if (!image)
+        return NULL;
+    // Filled through a mapping, macOS won't pwrite to shared memory objects
+    void *copy = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    if (copy == MAP_FAILED)
+        goto FAIL;
+    memcpy(copy, cpu->memory, MEMORY_SIZE);
+    munmap(copy, MEMORY_SIZE);
+    // Swap the parent onto the image too, from here on the kernel copies pages as they're written
+    if (!adopt(cpu, image))
+        goto FAIL;
+    return image;
+
+FAIL:
+    image_release(image);
+    return NULL;
+}
+
+struct cpu_t* cpu_fork(struct cpu_t *parent) {
+    // Device state we don't know how to copy can't be shared safely either
+    for (int i = 0; i < parent->hardware_count; i++)
+        if (parent->hardware[i]->data && !parent->hardware[i]->clone)
+            return NULL;
+    struct image_t *image = freeze(parent);
+    if (!image)
+        return NULL;
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu)
+        return NULL;
+    uint16_t *memory = cpu->memory;
+    if (mmap(memory, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED) {
+        cpu_destroy(cpu);
+        return NULL;
+    }
+    // Registers, interrupt queue and page flags, the instruction cache starts cold
+    memcpy(cpu, parent, offsetof(struct cpu_t, icache));
+    cpu->memory = memory;
+    image_retain(image);
+    cpu->image = image;
+    cpu->shared_pages = CPU_PAGE_COUNT;
+    // Watches aren't inherited
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        cpu->page_flags[i] &= ~(PAGE_BREAK | PAGE_WATCH);
+
+    if (parent->hardware_count) {
+        cpu->hardware = malloc(parent->hardware_capacity * sizeof(struct hardware_t*));
+        cpu->timers = malloc(parent->hardware_capacity * sizeof(struct hardware_t*));
+        if (!cpu->hardware || !cpu->timers)
+            goto FAIL;
+        cpu->hardware_capacity = parent->hardware_capacity;
+    }
+    for (int i = 0; i < parent->hardware_count; i++) {
+        struct hardware_t *src = parent->hardware[i];
+        struct hardware_t *hw = malloc(sizeof(struct hardware_t));
+        if (!hw)
+            goto FAIL;
+        *hw = *src;
+        hw->cpu = cpu;
+        hw->timer = 0;
+        if (src->clone && !src->clone(hw, src)) {
+            free(hw);
+            goto FAIL;
+        }
+        cpu->hardware[cpu->hardware_count++] = hw;
+        if (src->timer)
+            cpu_schedule_at(hw, src->deadline);
+    }
+    if (parent->jit)
+        cpu_jit_enable(cpu);
+    if (parent->aot && !cpu_aot_enable(cpu, aot_program(parent)))
+        goto FAIL;
+    return cpu;
+
+FAIL:
+    cpu_destroy(cpu);
+    return NULL;
+}
+
+void cpu_destroy(struct cpu_t *cpu) {
+    if (!cpu)
+        return;
+    for (int i = 0; i < cpu->hardware_count; i++) {
+        struct hardware_t *hw = cpu->hardware[i];
+        if (hw->deinit)
+            hw->deinit(hw);
+        free(hw);
+    }
+    free(cpu->hardware);
+    free(cpu->timers);
+    image_release(cpu->image);
+    cpu_journal_close(cpu);
+    cpu_trace_stop(cpu);
+    cpu_profile_stop(cpu);
+    for (struct snapshot_t *s = cpu->snapshots, *prev; s; s = prev) {
+        prev = s->prev;
+        free_snapshot(s);
+    }
+    cpu_jit_disable(cpu);
+    cpu_aot_disable(cpu);
+    cpu_watch_stop(cpu);
+    munmap(cpu, header_size() + MEMORY_SIZE);
 }
 
 int cpu_attach_hardware(struct cpu_t *cpu, int(*init_cb)(struct hardware_t*)) {
     if (cpu->hardware_count >= 0xFFFF)
         return 0;
-    struct hardware_t *hw = &cpu->hardware[cpu->hardware_count++];
-    memset(hw, 0, sizeof(struct hardware_t));
+    if (cpu->hardware_count == cpu->hardware_capacity) {
+        uint32_t capacity = cpu->hardware_capacity ? cpu->hardware_capacity * 2 : 4;
+        if (capacity > 0xFFFF)
+            capacity = 0xFFFF;
+        struct hardware_t **table = realloc(cpu->hardware, capacity * sizeof(struct hardware_t*));
+        if (!table)
+            return 0;
+        cpu->hardware = table;
+        struct hardware_t **timers = realloc(cpu->timers, capacity * sizeof(struct hardware_t*));
+        if (!timers)
+            return 0;
+        cpu->timers = timers;
+        cpu->hardware_capacity = capacity;
+    }
+    struct hardware_t *hw = calloc(1, sizeof(struct hardware_t));
+    if (!hw)
+        return 0;
+    cpu->hardware[cpu->hardware_count++] = hw;
     hw->enabled = 1;
     hw->cpu = cpu;
     int result = init_cb ? init_cb(hw) : 1;
@@ -24,12 +24,9 @@
  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include "ccpu.h"
-#include <stdio.h>
 #include <string.h>
 
-static char lval[16], rval[16];
-
-const char *opcode_table[0x20] = {
+static const char *opcode_table[0x20] = {
     "",
     "SET", "ADD", "SUB", "MUL", "MLI", "DIV", "DVI", "MOD", "MDI",
     "AND", "BOR", "XOR", "SHR", "ASR", "SHL",
@@ -40,7 +37,7 @@ const char *opcode_table[0x20] = {
     "STI", "STD"
 };
 
-const char *spc_opcode_table[0x20] = {
+static const char *spc_opcode_table[0x20] = {
     "",
     "JSR",
     "", "", "", "", "", "",
@@ -50,80 +47,189 @@ const char *spc_opcode_table[0x20] = {
     "", "", "", "", "", "", "", "", "", "", "", "", ""
 };
 
-const char *gpr_table[0x08] = {
-    "A", "B", "C", "X", "Y", "Z", "I", "J"
+// Operand text is prefix, then the next word (if it takes one), then suffix
+typedef struct {
+    const char *prefix, *suffix;
+    int word;
+} operand_t;
+
+static const operand_t operand_table[0x20] = {
+    {"A", "", 0}, {"B", "", 0}, {"C", "", 0}, {"X", "", 0},
+    {"Y", "", 0}, {"Z", "", 0}, {"I", "", 0}, {"J", "", 0},
+    {"[A]", "", 0}, {"[B]", "", 0}, {"[C]", "", 0}, {"[X]", "", 0},
+    {"[Y]", "", 0}, {"[Z]", "", 0}, {"[I]", "", 0}, {"[J]", "", 0},
+    {"[", "+A]", 1}, {"[", "+B]", 1}, {"[", "+C]", 1}, {"[", "+X]", 1},
+    {"[", "+Y]", 1}, {"[", "+Z]", 1}, {"[", "+I]", 1}, {"[", "+J]", 1},
+    {"PUSH", "", 0}, {"PEEK", "", 0}, {"[SP+", "]", 1}, {"SP", "", 0},
+    {"PC", "", 0}, {"EX", "", 0}, {"[", "]", 1}, {"", "", 1}
 };
 
-static int disasm_lval(uint16_t val, uint16_t next) {
-    int result = 0;
-    if (val < 0x08)
-        sprintf(lval, "%s", gpr_table[val]);
-    else if (val < 0x10)
-        sprintf(lval, "[%s]", gpr_table[val - 0x08]);
-    else if (val < 0x18) {
-        result = 1;
-        sprintf(lval, "[0x%.4x+%s]", next, gpr_table[val - 0x10]);
-    } else {
-        switch (val) {
-        case 0x18:
-            sprintf(lval, "PUSH");
-            break;
-        case 0x19:
-            sprintf(lval, "PEEK");
-            break;
-        case 0x1a:
-            result = 1;
-            sprintf(lval, "[SP+0x%.4x]", next);
-            break;
-        case 0x1b:
-            sprintf(lval, "SP");
-            break;
-        case 0x1c:
-            sprintf(lval, "PC");
-            break;
-        case 0x1d:
-            sprintf(lval, "EX");
-            break;
-        case 0x1e:
-            result = 1;
-            sprintf(lval, "[0x%.4x]", next);
-            break;
-        case 0x1f:
-            result = 1;
-            sprintf(lval, "0x%.4x", next);
-            break;
-        }
+static char* put(char *dst, const char *src) {
+    while (*src)
+        *dst++ = *src++;
+    return dst;
+}
+
+static char* put_digits(char *dst, uint16_t value) {
+    static const char digits[] = "0123456789abcdef";
+    for (int shift = 12; shift >= 0; shift -= 4)
+        *dst++ = digits[(value >> shift) & 0xF];
+    return dst;
+}
+
+static char* put_hex(char *dst, uint16_t value) {
+    *dst++ = '0';
+    *dst++ = 'x';
+    return put_digits(dst, value);
+}
+
+static char* put_label(char *dst, uint16_t address) {
+    *dst++ = 'L';
+    return put_digits(dst, address);
+}
+
+static int is_label(const uint8_t *labels, uint16_t address) {
+    return labels && labels[address >> 3] & (1 << (address & 7));
+}
+
+// labels is a bitmap of addresses to print literals as label names for, NULL for none
+static char* put_operand(char *dst, uint8_t value, int is_a, const uint16_t *next, int *words, const uint8_t *labels) {
+    if (value >= 0x20) {
+        uint16_t literal = value - 0x21;
+        return is_label(labels, literal) ? put_label(dst, literal) : put_hex(dst, literal);
+    }
+    if (is_a && value == 0x18)
+        return put(dst, "POP");
+    const operand_t *operand = &operand_table[value];
+    dst = put(dst, operand->prefix);
+    if (operand->word) {
+        uint16_t word = next[(*words)++];
+        dst = value == 0x1F && is_label(labels, word) ? put_label(dst, word) : put_hex(dst, word);
     }
-    return result;
+    return put(dst, operand->suffix);
+}
+
+// SET PC, a or JSR a, the only instructions whose literals are printed as labels
+static int is_jump(uint16_t word) {
+    return (word & 0x3FF) == (0x1C << 5 | 0x01) || (word & 0x3FF) == 0x01 << 5;
 }
 
-static int disasm_rval(uint16_t val, uint16_t next) {
-    int rv = 0;
-    char temp[16];
-    if (val >= 0x20)
-        sprintf(rval, "0x%.4x", (int16_t)val - 0x21);
-    else if (val == 0x18)
-        sprintf(rval, "POP");
-    else {
-        strncpy(temp, lval, 16);
-        rv = disasm_lval(val, next);
-        strncpy(rval, lval, 16);
-        strncpy(lval, temp, 16);
+// next holds the two words following word, which the operands may use. Returns the instruction length
+static int format(char *dst, uint16_t word, const uint16_t next[2], const uint8_t *labels) {
+    int words = 0;
+    uint8_t a = (word >> 10) & 0x3F, b = (word >> 5) & 0x1F, op = word & 0x1F;
+    if (!is_jump(word))
+        labels = NULL;
+    if (op ? !*opcode_table[op] : b && !*spc_opcode_table[b])
+        b = op = 0; // Undefined opcode, print it as data
+    if (op) {
+        char rval[24], *end;
+        end = put_operand(rval, a, 1, next, &words, labels);
+        *end = '\0';
+        dst = put(dst, opcode_table[op]);
+        *dst++ = ' ';
+        dst = put_operand(dst, b, 0, next, &words, labels);
+        *dst++ = ',';
+        *dst++ = ' ';
+        dst = put(dst, rval);
+    } else if (b) {
+        dst = put(dst, spc_opcode_table[b]);
+        *dst++ = ' ';
+        dst = put_operand(dst, a, 1, next, &words, labels);
+    } else {
+        dst = put(dst, "DAT ");
+        dst = put_hex(dst, word);
     }
-    return rv;
+    *dst = '\0';
+    return words + 1;
+}
+
+int disassemble(uint16_t *cursor, char dst[32]) {
+    return format(dst, cursor[0], cursor + 1, NULL);
+}
+
+// Literal a operand of SET PC or JSR
+static int jump_target(uint16_t word, uint16_t next, uint16_t *target) {
+    uint8_t a = (word >> 10) & 0x3F;
+    if (!is_jump(word))
+        return 0;
+    if (a >= 0x20)
+        *target = a - 0x21;
+    else if (a == 0x1F)
+        *target = next;
+    else
+        return 0;
+    return 1;
+}
+
+static int operand_words(uint8_t value) {
+    return value < 0x20 && operand_table[value].word;
+}
+
+// Short form literals cover -1 to 30
+static int fits(uint16_t value) {
+    return value == 0xFFFF || value <= 30;
 }
 
-int disassemble(uint16_t *memory, char *dst) {
-    uint16_t word = memory[0];
-    int words = 1;
-    if (word & 0x1F) {
-        words += disasm_rval((word >> 10) & 0x3F, memory[words]);
-        words += disasm_lval((word >> 5)  & 0x1F, memory[words]);
-        sprintf(dst, "%s %s, %s", opcode_table[word & 0x1F], lval, rval);
-    } else if ((word >> 5) & 0x1F) {
-        words += disasm_rval((word >> 10) & 0x3F, memory[words]);
-        sprintf(dst, "%s %s", spc_opcode_table[(word >> 5) & 0x1F], rval);
-    } else
-        sprintf(dst, "DAT 0x%.4x", word);
+// Words in the instruction at pc, or 0 when assemble() wouldn't give the same words back and it has to be
+// printed as data: a long form literal a that the assembler would shorten, or one running past the range
+static int instruction_words(const uint16_t memory[0x10000], uint16_t pc, uint32_t remaining) {
+    uint16_t word = memory[pc];
+    uint8_t a = (word >> 10) & 0x3F, b = (word >> 5) & 0x1F, op = word & 0x1F;
+    int words;
+    if (op && *opcode_table[op])
+        words = 1 + operand_words(a) + operand_words(b);
+    else if (!op && b && *spc_opcode_table[b])
+        words = 1 + operand_words(a);
+    else
+        return 1; // DAT
+    if (words > remaining || (a == 0x1F && fits(memory[(uint16_t)(pc + 1)])))
+        return 0;
     return words;
 }
+
+long disassemble_image(const uint16_t memory[0x10000], uint16_t start, uint32_t count, char *dst, size_t size) {
+    uint8_t starts[0x10000 / 8], labels[0x10000 / 8];
+    memset(starts, 0, sizeof(starts));
+    memset(labels, 0, sizeof(labels));
+    if (count > 0x10000)
+        count = 0x10000;
+
+    // First pass finds jump and call targets inside the range, only those an instruction starts at get a label
+    for (uint32_t offset = 0; offset < count;) {
+        uint16_t pc = start + offset, target;
+        int words = instruction_words(memory, pc, count - offset);
+        starts[pc >> 3] |= 1 << (pc & 7);
+        if (words && jump_target(memory[pc], memory[(uint16_t)(pc + 1)], &target) &&
+            (uint16_t)(target - start) < count)
+            labels[target >> 3] |= 1 << (target & 7);
+        offset += words ? words : 1;
+    }
+    for (int i = 0; i < sizeof(labels); i++)
+        labels[i] &= starts[i];
+
+    char *cursor = dst;
+    for (uint32_t offset = 0; offset < count;) {
+        uint16_t pc = start + offset;
+        // Worst case is a label line and a 28 character instruction, 40 characters with newlines
+        if ((size_t)(cursor - dst) + 41 > size)
+            return -1;
+        if (labels[pc >> 3] & (1 << (pc & 7))) {
+            *cursor++ = ':';
+            cursor = put_label(cursor, pc);
+            *cursor++ = '\n';
+        }
+        uint16_t next[2] = { memory[(uint16_t)(pc + 1)], memory[(uint16_t)(pc + 2)] };
+        cursor = put(cursor, "    ");
+        if (instruction_words(memory, pc, count - offset)) {
+            offset += format(cursor, memory[pc], next, labels);
+            cursor += strlen(cursor);
+        } else {
+            cursor = put_hex(put(cursor, "DAT "), memory[pc]);
+            offset++;
+        }
+        *cursor++ = '\n';
+    }
+    *cursor = '\0';
+    return cursor - dst;
+}
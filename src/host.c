@@ -0,0 +1,338 @@
+/* host.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMPTY -1
+#define ABORT -2
+// Failed rounds of stealing before an idle worker parks
+#define IDLE_ROUNDS 64
+
+// Chase-Lev work stealing deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models")
+// Every VM sits in at most one deque at a time, so a buffer as large as the pool never overflows
+typedef struct {
+    atomic_long top;
+    char padding[64 - sizeof(atomic_long)]; // Keep thieves and the owner off each other's cache line
+    atomic_long bottom;
+    atomic_int *buffer;
+    long mask;
+} deque_t;
+
+typedef struct {
+    struct cpu_t *cpu;
+    uint64_t quantum;
+    struct host_stats_t stats;
+} vm_t;
+
+typedef struct {
+    struct host_t *host;
+    deque_t deque;
+    pthread_t thread;
+    int index;
+    uint32_t seed;
+} worker_t;
+
+struct host_t {
+    vm_t *vms;
+    int vm_count, vm_capacity;
+    worker_t *workers;
+    int worker_count;
+    uint64_t quantum;
+    atomic_int live;
+    double seconds;
+    // Idle workers park here until a deque has a VM to spare or the last one retires
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    atomic_int sleepers;
+    unsigned wakes;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int deque_init(deque_t *d, int capacity) {
+    long size = 1;
+    while (size < capacity)
+        size <<= 1;
+    if (!(d->buffer = malloc(size * sizeof(atomic_int))))
+        return 0;
+    d->mask = size - 1;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    return 1;
+}
+
+static void deque_push(deque_t *d, int x) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(&d->buffer[b & d->mask], x, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static int deque_take(deque_t *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return EMPTY;
+    }
+    int x = atomic_load_explicit(&d->buffer[b & d->mask], memory_order_relaxed);
+    if (t == b) {
+        // Last item, race any thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            x = EMPTY;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+static int deque_steal(deque_t *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return EMPTY;
+    int x = atomic_load_explicit(&d->buffer[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return ABORT;
+    return x;
+}
+
+static long deque_size(deque_t *d) {
+    return atomic_load_explicit(&d->bottom, memory_order_relaxed) - atomic_load_explicit(&d->top, memory_order_relaxed);
+}
+
+static int find_work(worker_t *w) {
+    int vm = deque_take(&w->deque);
+    if (vm >= 0)
+        return vm;
+    struct host_t *host = w->host;
+    for (int attempt = 0; attempt < host->worker_count * 2; attempt++) {
+        w->seed = w->seed * 1103515245 + 12345;
+        worker_t *victim = &host->workers[(w->seed >> 16) % host->worker_count];
+        if (victim == w)
+            continue;
+        if ((vm = deque_steal(&victim->deque)) >= 0)
+            return vm;
+    }
+    return EMPTY;
+}
+
+// Tries every deque in turn rather than at random, so nothing pushed before a worker parks is missed
+static int scan(worker_t *w) {
+    struct host_t *host = w->host;
+    for (int i = 0; i < host->worker_count; i++) {
+        int vm;
+        while ((vm = deque_steal(&host->workers[i].deque)) == ABORT)
+            ;
+        if (vm >= 0)
+            return vm;
+    }
+    return EMPTY;
+}
+
+static void wake(struct host_t *host, int all) {
+    pthread_mutex_lock(&host->lock);
+    host->wakes++;
+    if (all)
+        pthread_cond_broadcast(&host->idle);
+    else
+        pthread_cond_signal(&host->idle);
+    pthread_mutex_unlock(&host->lock);
+}
+
+static int park(worker_t *w) {
+    struct host_t *host = w->host;
+    pthread_mutex_lock(&host->lock);
+    unsigned wakes = host->wakes;
+    atomic_fetch_add_explicit(&host->sleepers, 1, memory_order_seq_cst);
+    pthread_mutex_unlock(&host->lock);
+    // Pairs with the fence after a push, either this scan sees the VM or the pusher sees a sleeper
+    int vm = scan(w);
+    if (vm < 0) {
+        pthread_mutex_lock(&host->lock);
+        while (host->wakes == wakes && atomic_load_explicit(&host->live, memory_order_acquire) > 0)
+            pthread_cond_wait(&host->idle, &host->lock);
+        pthread_mutex_unlock(&host->lock);
+    }
+    atomic_fetch_sub_explicit(&host->sleepers, 1, memory_order_relaxed);
+    return vm;
+}
+
+static void* worker_main(void *arg) {
+    worker_t *w = arg;
+    struct host_t *host = w->host;
+    int idle = 0;
+    while (atomic_load_explicit(&host->live, memory_order_acquire) > 0) {
+        int index = find_work(w);
+        if (index < 0 && ++idle >= IDLE_ROUNDS) {
+            idle = 0;
+            index = park(w);
+        }
+        if (index < 0) {
+            sched_yield();
+            continue;
+        }
+        idle = 0;
+        // Whoever holds a VM's index has exclusive access to it and its stats
+        vm_t *vm = &host->vms[index];
+        uint64_t before = vm->cpu->cycles;
+        double start = now();
+        enum cpu_stop stop = cpu_run(vm->cpu, vm->quantum);
+        vm->stats.seconds += now() - start;
+        vm->stats.cycles += vm->cpu->cycles - before;
+        vm->stats.quanta++;
+        vm->stats.stop = stop;
+        if (stop == CPU_STOP_BUDGET) {
+            deque_push(&w->deque, index);
+            // Only a VM beyond the one this worker takes straight back is worth waking anyone for
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&host->sleepers, memory_order_relaxed) && deque_size(&w->deque) > 1)
+                wake(host, 0);
+        } else if (atomic_fetch_sub_explicit(&host->live, 1, memory_order_acq_rel) == 1)
+            wake(host, 1);
+    }
+    return NULL;
+}
+
+struct host_t* host_create(int workers, uint64_t quantum) {
+    struct host_t *host = calloc(1, sizeof(struct host_t));
+    if (!host)
+        return NULL;
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+    host->worker_count = workers;
+    host->quantum = quantum ? quantum : 10000;
+    pthread_mutex_init(&host->lock, NULL);
+    pthread_cond_init(&host->idle, NULL);
+    return host;
+}
+
+void host_destroy(struct host_t *host) {
+    if (!host)
+        return;
+    for (int i = 0; i < host->vm_count; i++)
+        cpu_destroy(host->vms[i].cpu);
+    free(host->vms);
+    pthread_mutex_destroy(&host->lock);
+    pthread_cond_destroy(&host->idle);
+    free(host);
+}
+
+int host_add(struct host_t *host, struct cpu_t *cpu, uint64_t quantum) {
+    if (host->vm_count == host->vm_capacity) {
+        int capacity = host->vm_capacity ? host->vm_capacity * 2 : 64;
+        vm_t *vms = realloc(host->vms, capacity * sizeof(vm_t));
+        if (!vms)
+            return -1;
+        host->vms = vms;
+        host->vm_capacity = capacity;
+    }
+    vm_t *vm = &host->vms[host->vm_count];
+    memset(vm, 0, sizeof(vm_t));
+    vm->cpu = cpu;
+    vm->quantum = quantum ? quantum : host->quantum;
+    return host->vm_count++;
+}
+
+int host_run(struct host_t *host) {
+    int result = 1;
+    worker_t *workers = calloc(host->worker_count, sizeof(worker_t));
+    if (!workers)
+        return 0;
+    host->workers = workers;
+    for (int i = 0; i < host->worker_count; i++) {
+        workers[i].host = host;
+        workers[i].index = i;
+        workers[i].seed = i * 2654435761u + 1;
+        if (!deque_init(&workers[i].deque, host->vm_count)) {
+            result = 0;
+            goto END;
+        }
+    }
+
+    // Deal runnable VMs out round robin, stealing evens out whatever imbalance follows
+    int live = 0;
+    for (int i = 0; i < host->vm_count; i++) {
+        struct cpu_t *cpu = host->vms[i].cpu;
+        if (cpu->state == CPU_HALT || cpu->state == CPU_ON_FIRE)
+            continue;
+        deque_push(&workers[live++ % host->worker_count].deque, i);
+    }
+    atomic_store(&host->live, live);
+
+    double start = now();
+    int started = 1;
+    for (int i = 1; i < host->worker_count; i++, started++)
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+            break;
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    host->seconds += now() - start;
+
+END:
+    for (int i = 0; i < host->worker_count; i++)
+        free(workers[i].deque.buffer);
+    free(workers);
+    host->workers = NULL;
+    return result;
+}
+
+int host_vm_stats(struct host_t *host, int vm, struct host_stats_t *out) {
+    if (vm < 0 || vm >= host->vm_count)
+        return 0;
+    *out = host->vms[vm].stats;
+    out->cycles_per_second = out->seconds > 0 ? out->cycles / out->seconds : 0;
+    return 1;
+}
+
+void host_stats(struct host_t *host, struct host_stats_t *out) {
+    memset(out, 0, sizeof(struct host_stats_t));
+    for (int i = 0; i < host->vm_count; i++) {
+        out->cycles += host->vms[i].stats.cycles;
+        out->quanta += host->vms[i].stats.quanta;
+    }
+    // Aggregate throughput is measured against wall clock time, not the sum of per-VM time
+    out->seconds = host->seconds;
+    out->cycles_per_second = out->seconds > 0 ? out->cycles / out->seconds : 0;
+    out->stop = CPU_STOP_BUDGET;
+}
@@ -0,0 +1,164 @@
+/* image.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Firmware is decoded once per process into a shared memory file and every CPU loading the same file maps
+// that copy-on-write, so booting a fleet reads and byte-swaps an image once and costs an mmap per VM after
+// that. Files are recognised by device, inode, size and modification time, so a rebuilt image is decoded
+// again. The cache keeps a reference to each image until image_cache_flush.
+
+#define MEMORY_SIZE (0x10000 * sizeof(uint16_t))
+
+typedef uint16_t vec_t __attribute__((vector_size(32)));
+
+#if defined(__APPLE__)
+#define st_mtim st_mtimespec
+#endif
+
+typedef struct entry_t {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime; // Seconds alone miss a rebuild within the same second
+    enum cpu_image_order order;
+    struct image_t *image;
+    struct entry_t *next;
+} entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static entry_t *cache;
+
+// cpu.c
+struct image_t* image_create(void);
+int image_fd(struct image_t *image);
+void image_retain(struct image_t *image);
+void image_release(struct image_t *image);
+int image_map(struct cpu_t *cpu, struct image_t *image);
+
+static void swap_words(uint16_t *dst, const uint16_t *src, size_t count) {
+    size_t i = 0;
+    // Whatever vector width the target has, the loads are unaligned for odd offsets into the file
+    for (; i + sizeof(vec_t) / 2 <= count; i += sizeof(vec_t) / 2) {
+        vec_t v;
+        memcpy(&v, src + i, sizeof(v));
+        v = v << 8 | v >> 8;
+        memcpy(dst + i, &v, sizeof(v));
+    }
+    for (; i < count; i++)
+        dst[i] = src[i] << 8 | src[i] >> 8;
+}
+
+static struct image_t* decode(int fd, size_t size, enum cpu_image_order order) {
+    struct image_t *image = image_create();
+    if (!image || !size)
+        return image;
+    const uint16_t *src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    uint16_t *dst = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd(image), 0);
+    if (src == MAP_FAILED || dst == MAP_FAILED)
+        goto FAIL;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int swap = order == CPU_IMAGE_LITTLE_ENDIAN;
+#else
+    int swap = order == CPU_IMAGE_BIG_ENDIAN;
+#endif
+    if (swap)
+        swap_words(dst, src, size / 2);
+    else
+        memcpy(dst, src, size);
+    munmap((void*)src, size);
+    munmap(dst, MEMORY_SIZE);
+    return image;
+
+FAIL:
+    if (src != MAP_FAILED)
+        munmap((void*)src, size);
+    if (dst != MAP_FAILED)
+        munmap(dst, MEMORY_SIZE);
+    image_release(image);
+    return NULL;
+}
+
+int cpu_load_image(struct cpu_t *cpu, const char *path, enum cpu_image_order order) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    // A trailing odd byte is padding some tools write out, not half a word
+    if (fstat(fd, &st) || (st.st_size & ~(off_t)1) > MEMORY_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size & ~(off_t)1;
+    // Held while decoding so a fleet booting at once decodes each image once
+    pthread_mutex_lock(&lock);
+    entry_t *e = cache;
+    while (e && (e->dev != st.st_dev || e->ino != st.st_ino || e->size != st.st_size ||
+                 e->mtime.tv_sec != st.st_mtim.tv_sec || e->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+                 e->order != order))
+        e = e->next;
+    if (!e && (e = malloc(sizeof(entry_t)))) {
+        if ((e->image = decode(fd, size, order))) {
+            e->dev = st.st_dev;
+            e->ino = st.st_ino;
+            e->size = st.st_size;
+            e->mtime = st.st_mtim;
+            e->order = order;
+            e->next = cache;
+            cache = e;
+        } else {
+            free(e);
+            e = NULL;
+        }
+    }
+    struct image_t *image = e ? e->image : NULL;
+    if (image)
+        image_retain(image);
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    if (!image)
+        return -1;
+    int result = image_map(cpu, image) ? (int)(size / 2) : -1;
+    image_release(image);
+    return result;
+}
+
+void image_cache_flush(void) {
+    pthread_mutex_lock(&lock);
+    for (entry_t *e = cache, *next; e; e = next) {
+        next = e->next;
+        image_release(e->image);
+        free(e);
+    }
+    cache = NULL;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,895 @@
+/* jit.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 64
+#endif
+#define JIT_BLOCKS 4096
+#define JIT_MAX_INSTRUCTIONS 64
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_BLOCK_SIZE (32 << 10) // Room reserved for one block, overruns fail the compile
+
+// cpu.c
+void jit_written(struct cpu_t *cpu, uint16_t address);
+
+enum {
+    SET = 0x01, ADD, SUB, MUL,
+    AND = 0x0A, BOR, XOR, SHR,
+    SHL = 0x0F,
+    IFB, IFC, IFE, IFN, IFG, IFA, IFL, IFU,
+    STI = 0x1E, STD
+};
+
+enum { JSR = 0x01 };
+enum { PC = 8, SP, EX };
+
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_AE = 0x3, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE
+};
+
+// Guest A, B, C, X, Y, Z, I, J, PC (never pinned), SP, EX live in these for the whole block
+static const int pinned[11] = {
+    R12, R13, R14, R15, RSI, RDI, R8, R9, -1, R10, R11
+};
+static const int guest_regs[10] = { 0, 1, 2, 3, 4, 5, 6, 7, SP, EX };
+
+typedef void(*block_fn)(struct cpu_t*, uint64_t);
+
+enum {
+    BLOCK_EMPTY = 0,
+    BLOCK_LIVE,
+    BLOCK_FAILED
+};
+
+typedef struct {
+    block_fn fn;
+    uint32_t max_cycles;
+    uint16_t pc;
+    uint32_t end;         // Covers [pc, end), blocks never wrap around memory
+    uint8_t state;
+    int16_t next[2];      // Links in the lists of the first and last page covered
+} block_t;
+
+struct jit_t {
+    block_t blocks[JIT_BLOCKS];
+    uint8_t hits[JIT_BLOCKS];
+    int16_t pages[CPU_PAGE_COUNT];
+    uint64_t covered[0x10000 / 64];
+    uint8_t *code;
+    size_t used;
+};
+
+typedef struct {
+    uint8_t *start, *p, *end;
+} emit_t;
+
+static void byte(emit_t *e, uint8_t b) {
+    if (e->p < e->end)
+        *e->p = b;
+    e->p++;
+}
+
+static void dword(emit_t *e, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        byte(e, v >> (i * 8));
+}
+
+static void qword(emit_t *e, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        byte(e, v >> (i * 8));
+}
+
+static void rex(emit_t *e, int w, int r, int x, int b) {
+    uint8_t v = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+    if (v != 0x40)
+        byte(e, v);
+}
+
+static void modrm_reg(emit_t *e, int reg, int rm) {
+    byte(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Memory operands are always encoded with a 32 bit displacement, which works for every base
+static void modrm_mem(emit_t *e, int reg, int base, int index, int scale, int32_t disp) {
+    if (index < 0 && (base & 7) != RSP)
+        byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    else {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        byte(e, 0x80 | ((reg & 7) << 3) | RSP);
+        byte(e, (ss << 6) | (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    }
+    dword(e, disp);
+}
+
+static void op_rr(emit_t *e, uint8_t opcode, int dst, int src) {
+    rex(e, 0, src, 0, dst);
+    byte(e, opcode);
+    modrm_reg(e, src, dst);
+}
+
+static void mov_rr(emit_t *e, int dst, int src) {
+    if (dst != src)
+        op_rr(e, 0x89, dst, src);
+}
+
+static void mov_ri(emit_t *e, int dst, uint32_t imm) {
+    rex(e, 0, 0, 0, dst);
+    byte(e, 0xB8 + (dst & 7));
+    dword(e, imm);
+}
+
+static void alu_ri(emit_t *e, int ext, int dst, uint32_t imm) {
+    rex(e, 0, 0, 0, dst);
+    byte(e, 0x81);
+    modrm_reg(e, ext, dst);
+    dword(e, imm);
+}
+
+static void shift_ri(emit_t *e, int ext, int dst, uint8_t n) {
+    rex(e, 0, 0, 0, dst);
+    byte(e, 0xC1);
+    modrm_reg(e, ext, dst);
+    byte(e, n);
+}
+
+static void extend16(emit_t *e, uint8_t opcode, int dst, int src) {
+    rex(e, 0, dst, 0, src);
+    byte(e, 0x0F);
+    byte(e, opcode);
+    modrm_reg(e, dst, src);
+}
+
+#define movzx16(E, D, S) extend16((E), 0xB7, (D), (S))
+#define movsx16(E, D, S) extend16((E), 0xBF, (D), (S))
+
+static void imul_rr(emit_t *e, int dst, int src) {
+    rex(e, 0, dst, 0, src);
+    byte(e, 0x0F);
+    byte(e, 0xAF);
+    modrm_reg(e, dst, src);
+}
+
+static void load16(emit_t *e, int dst, int base, int index, int32_t disp) {
+    rex(e, 0, dst, index < 0 ? 0 : index, base);
+    byte(e, 0x0F);
+    byte(e, 0xB7);
+    modrm_mem(e, dst, base, index, 2, disp);
+}
+
+static void store16(emit_t *e, int src, int base, int index, int32_t disp) {
+    byte(e, 0x66);
+    rex(e, 0, src, index < 0 ? 0 : index, base);
+    byte(e, 0x89);
+    modrm_mem(e, src, base, index, 2, disp);
+}
+
+static void store16_imm(emit_t *e, int base, int32_t disp, uint16_t imm) {
+    byte(e, 0x66);
+    rex(e, 0, 0, 0, base);
+    byte(e, 0xC7);
+    modrm_mem(e, 0, base, -1, 1, disp);
+    byte(e, imm);
+    byte(e, imm >> 8);
+}
+
+static void mem32(emit_t *e, uint8_t opcode, int reg, int base, int32_t disp) {
+    rex(e, 0, reg, 0, base);
+    byte(e, opcode);
+    modrm_mem(e, reg, base, -1, 1, disp);
+}
+
+static void mem64(emit_t *e, uint8_t opcode, int reg, int base, int32_t disp) {
+    rex(e, 1, reg, 0, base);
+    byte(e, opcode);
+    modrm_mem(e, reg, base, -1, 1, disp);
+}
+
+static void add_mem64_imm(emit_t *e, int base, int32_t disp, uint32_t imm) {
+    rex(e, 1, 0, 0, base);
+    byte(e, 0x81);
+    modrm_mem(e, 0, base, -1, 1, disp);
+    dword(e, imm);
+}
+
+static void cmp_mem8_zero(emit_t *e, int base, int index, int32_t disp) {
+    rex(e, 0, 0, index, base);
+    byte(e, 0x80);
+    modrm_mem(e, 7, base, index, 1, disp);
+    byte(e, 0);
+}
+
+static void push_r(emit_t *e, int r) {
+    rex(e, 0, 0, 0, r);
+    byte(e, 0x50 + (r & 7));
+}
+
+static void pop_r(emit_t *e, int r) {
+    rex(e, 0, 0, 0, r);
+    byte(e, 0x58 + (r & 7));
+}
+
+static void call_abs(emit_t *e, void *fn) {
+    rex(e, 1, 0, 0, RAX);
+    byte(e, 0xB8);
+    qword(e, (uint64_t)(uintptr_t)fn);
+    byte(e, 0xFF);
+    modrm_reg(e, 2, RAX);
+}
+
+static size_t jcc(emit_t *e, int cc) {
+    byte(e, 0x0F);
+    byte(e, 0x80 + cc);
+    dword(e, 0);
+    return e->p - e->start - 4;
+}
+
+static size_t jmp(emit_t *e) {
+    byte(e, 0xE9);
+    dword(e, 0);
+    return e->p - e->start - 4;
+}
+
+static void patch(emit_t *e, size_t at, size_t target) {
+    if (e->start + at + 4 > e->end)
+        return;
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(e->start + at, &rel, 4);
+}
+
+#define OFF_REG(R) ((int32_t)(offsetof(struct cpu_t, reg) + (R) * sizeof(uint16_t)))
+#define OFF_CYCLES ((int32_t)offsetof(struct cpu_t, cycles))
+#define OFF_MEMORY ((int32_t)offsetof(struct cpu_t, memory))
+#define OFF_FLAGS  ((int32_t)offsetof(struct cpu_t, page_flags))
+#define OFF_POSTED ((int32_t)offsetof(struct cpu_t, posted_pending))
+
+// Jumps are resolved once the whole block has been laid out
+enum {
+    TO_INSTRUCTION,
+    TO_EXIT,
+    TO_EPILOGUE,
+    TO_TAIL
+};
+
+typedef struct {
+    size_t at;
+    int kind;
+    uint32_t value;
+} fixup_t;
+
+typedef struct {
+    size_t at;
+    uint32_t cycles, target;
+} skip_t;
+
+typedef struct {
+    size_t at;
+    uint16_t pc_after;
+    int jsr;
+} slow_t;
+
+typedef struct {
+    uint16_t pc;
+    struct instruction_t ins;
+} entry_t;
+
+typedef struct {
+    emit_t e;
+    entry_t list[JIT_MAX_INSTRUCTIONS];
+    size_t labels[JIT_MAX_INSTRUCTIONS];
+    int count;
+    fixup_t fixups[JIT_MAX_INSTRUCTIONS * 8];
+    int fixup_count;
+    skip_t skips[JIT_MAX_INSTRUCTIONS];
+    int skip_count;
+    slow_t slows[JIT_MAX_INSTRUCTIONS];
+    int slow_count;
+    uint16_t start;
+    uint32_t max_cycles;
+} compiler_t;
+
+static void fixup(compiler_t *c, size_t at, int kind, uint32_t value) {
+    c->fixups[c->fixup_count++] = (fixup_t){ at, kind, value };
+}
+
+static void jump_to_pc(compiler_t *c, size_t at, uint32_t pc) {
+    for (int i = 0; i < c->count; i++)
+        if (c->list[i].pc == pc) {
+            fixup(c, at, TO_INSTRUCTION, i);
+            return;
+        }
+    fixup(c, at, TO_EXIT, pc);
+}
+
+static int is_literal(uint16_t v) {
+    return v == 0x1F || v >= 0x20;
+}
+
+static uint16_t literal(const struct instruction_t *ins) {
+    return ins->a == 0x1F ? ins->a_word : (uint16_t)(ins->a - 0x21);
+}
+
+static int is_if(const struct instruction_t *ins) {
+    return ins->op >= IFB && ins->op <= IFU;
+}
+
+static int is_branch(const struct instruction_t *ins) {
+    return ins->op == (0x20 | JSR) || (ins->b == 0x1C && !is_if(ins) && !(ins->op & 0x20));
+}
+
+static int supported(const struct instruction_t *ins) {
+    if (ins->op & 0x20)
+        return ins->op == (0x20 | JSR) && ins->a != 0x18;
+    if (ins->b == 0x1F)
+        return 0;
+    switch (ins->op) {
+        case ADD:
+        case SUB:
+        case MUL:
+            return ins->b != 0x1D;
+        case SHL:
+        case SHR:
+            return ins->b != 0x1D && is_literal(ins->a) && literal(ins) < 32;
+        case STI:
+        case STD:
+            return ins->b != 0x1C;
+        case SET:
+        case AND:
+        case BOR:
+        case XOR:
+        case IFB ... IFU:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void operand_a(compiler_t *c, uint16_t pc, const struct instruction_t *ins) {
+    emit_t *e = &c->e;
+    uint16_t v = ins->a;
+    switch (v) {
+        case 0x00 ... 0x07:
+            mov_rr(e, RCX, pinned[v]);
+            break;
+        case 0x08 ... 0x0F:
+            load16(e, RCX, RBP, pinned[v - 0x08], 0);
+            break;
+        case 0x10 ... 0x17:
+        case 0x1A:
+            mov_rr(e, RCX, v == 0x1A ? pinned[SP] : pinned[v - 0x10]);
+            alu_ri(e, 0, RCX, ins->a_word);
+            movzx16(e, RCX, RCX);
+            load16(e, RCX, RBP, RCX, 0);
+            break;
+        case 0x18:
+            load16(e, RCX, RBP, pinned[SP], 0);
+            alu_ri(e, 0, pinned[SP], 1);
+            movzx16(e, pinned[SP], pinned[SP]);
+            break;
+        case 0x19:
+            load16(e, RCX, RBP, pinned[SP], 0);
+            break;
+        case 0x1B:
+        case 0x1D:
+            mov_rr(e, RCX, pinned[v == 0x1B ? SP : EX]);
+            break;
+        case 0x1C:
+            mov_ri(e, RCX, (uint16_t)(pc + 1));
+            break;
+        case 0x1E:
+            load16(e, RCX, RBP, -1, ins->a_word * 2);
+            break;
+        default:
+            mov_ri(e, RCX, literal(ins));
+            break;
+    }
+}
+
+enum {
+    LOC_REG,
+    LOC_MEM, // Address in EDX
+    LOC_PC
+};
+
+static int operand_b(compiler_t *c, const struct instruction_t *ins, int *reg) {
+    emit_t *e = &c->e;
+    uint16_t v = ins->b;
+    switch (v) {
+        case 0x00 ... 0x07:
+            *reg = pinned[v];
+            return LOC_REG;
+        case 0x08 ... 0x0F:
+            mov_rr(e, RDX, pinned[v - 0x08]);
+            return LOC_MEM;
+        case 0x10 ... 0x17:
+        case 0x1A:
+            mov_rr(e, RDX, v == 0x1A ? pinned[SP] : pinned[v - 0x10]);
+            alu_ri(e, 0, RDX, ins->b_word);
+            movzx16(e, RDX, RDX);
+            return LOC_MEM;
+        case 0x18:
+            alu_ri(e, 5, pinned[SP], 1);
+            movzx16(e, pinned[SP], pinned[SP]);
+            mov_rr(e, RDX, pinned[SP]);
+            return LOC_MEM;
+        case 0x19:
+            mov_rr(e, RDX, pinned[SP]);
+            return LOC_MEM;
+        case 0x1B:
+        case 0x1D:
+            *reg = pinned[v == 0x1B ? SP : EX];
+            return LOC_REG;
+        case 0x1C:
+            return LOC_PC;
+        default:
+            mov_ri(e, RDX, ins->b_word);
+            return LOC_MEM;
+    }
+}
+
+// Stores AX to memory at EDX, leaving the block through a slow path if the page is being watched
+static void store_memory(compiler_t *c, uint16_t pc_after, int jsr) {
+    emit_t *e = &c->e;
+    store16(e, RAX, RBP, RDX, 0);
+    mov_rr(e, RCX, RDX);
+    shift_ri(e, 5, RCX, CPU_PAGE_SHIFT);
+    cmp_mem8_zero(e, RBX, RCX, OFF_FLAGS);
+    c->slows[c->slow_count++] = (slow_t){ jcc(e, CC_NE), pc_after, jsr };
+}
+
+static void overflow_to_ex(emit_t *e) {
+    mov_rr(e, pinned[EX], RAX);
+    shift_ri(e, 5, pinned[EX], 16);
+    movzx16(e, RAX, RAX);
+}
+
+// Where a failed IFx lands and what skipping there costs, UINT32_MAX if the chain wraps around memory
+static uint32_t skip_chain(struct cpu_t *cpu, uint32_t pc, uint32_t *cycles) {
+    const struct instruction_t *ins;
+    *cycles = 0;
+    do {
+        if (pc > 0xFFFF)
+            return UINT32_MAX;
+        ins = cpu_decode(cpu, pc);
+        *cycles += 2;
+        pc += ins->length;
+    } while (is_if(ins));
+    return pc;
+}
+
+static void instruction(struct cpu_t *cpu, compiler_t *c, int index) {
+    emit_t *e = &c->e;
+    uint16_t pc = c->list[index].pc;
+    const struct instruction_t *ins = &c->list[index].ins;
+    uint16_t pc_after = pc + ins->length;
+
+    c->labels[index] = e->p - e->start;
+    add_mem64_imm(e, RBX, OFF_CYCLES, ins->cycles);
+    operand_a(c, pc, ins);
+
+    if (ins->op == (0x20 | JSR)) {
+        // Keep the target in PC (and on the stack for the slow path) while pushing the return address
+        mem32(e, 0x89, RCX, RSP, 8);
+        store16(e, RCX, RBX, -1, OFF_REG(PC));
+        alu_ri(e, 5, pinned[SP], 1);
+        movzx16(e, pinned[SP], pinned[SP]);
+        mov_rr(e, RDX, pinned[SP]);
+        mov_ri(e, RAX, pc_after);
+        store_memory(c, pc_after, 1);
+        fixup(c, jmp(e), TO_EPILOGUE, 0);
+        return;
+    }
+
+    int reg = 0;
+    int loc = operand_b(c, ins, &reg);
+    if (ins->op != SET && ins->op != STI && ins->op != STD) {
+        if (loc == LOC_REG)
+            mov_rr(e, RAX, reg);
+        else if (loc == LOC_MEM)
+            load16(e, RAX, RBP, RDX, 0);
+        else
+            mov_ri(e, RAX, pc_after);
+    }
+
+    switch (ins->op) {
+        case SET:
+        case STI:
+        case STD:
+            mov_rr(e, RAX, RCX);
+            break;
+        case ADD:
+            op_rr(e, 0x01, RAX, RCX);
+            overflow_to_ex(e);
+            break;
+        case SUB:
+            op_rr(e, 0x29, RAX, RCX);
+            overflow_to_ex(e);
+            break;
+        case MUL:
+            imul_rr(e, RAX, RCX);
+            overflow_to_ex(e);
+            break;
+        case AND: op_rr(e, 0x21, RAX, RCX); break;
+        case BOR: op_rr(e, 0x09, RAX, RCX); break;
+        case XOR: op_rr(e, 0x31, RAX, RCX); break;
+        case SHL:
+            shift_ri(e, 4, RAX, literal(ins));
+            overflow_to_ex(e);
+            break;
+        case SHR:
+            mov_rr(e, pinned[EX], RAX);
+            shift_ri(e, 4, pinned[EX], 16);
+            shift_ri(e, 5, pinned[EX], literal(ins));
+            movzx16(e, pinned[EX], pinned[EX]);
+            shift_ri(e, 5, RAX, literal(ins));
+            break;
+        case IFB ... IFU: {
+            int cc = CC_E;
+            if (ins->op == IFA || ins->op == IFU) {
+                movsx16(e, RAX, RAX);
+                movsx16(e, RCX, RCX);
+            }
+            switch (ins->op) {
+                case IFB: op_rr(e, 0x85, RAX, RCX); cc = CC_E;  break;
+                case IFC: op_rr(e, 0x85, RAX, RCX); cc = CC_NE; break;
+                default:
+                    op_rr(e, 0x39, RAX, RCX);
+                    switch (ins->op) {
+                        case IFE: cc = CC_NE; break;
+                        case IFN: cc = CC_E;  break;
+                        case IFG: cc = CC_BE; break;
+                        case IFL: cc = CC_AE; break;
+                        case IFA: cc = CC_LE; break;
+                        case IFU: cc = CC_GE; break;
+                    }
+            }
+            uint32_t cycles, target = skip_chain(cpu, pc_after, &cycles);
+            c->skips[c->skip_count++] = (skip_t){ jcc(e, cc), cycles, target };
+            return;
+        }
+    }
+
+    if (loc == LOC_PC) {
+        if (ins->op == SET && is_literal(ins->a)) {
+            uint16_t target = literal(ins);
+            if (target == c->start) {
+                // Back edge, keep looping natively while another pass is sure to fit in the budget
+                mem64(e, 0x8B, RAX, RBX, OFF_CYCLES);
+                rex(e, 1, 0, 0, RAX);
+                byte(e, 0x05);
+                dword(e, c->max_cycles);
+                mem64(e, 0x3B, RAX, RSP, 0);
+                fixup(c, jcc(e, CC_A), TO_EXIT, target);
+                // and leave early when another thread has posted an interrupt, so it lands before the next pass
+                mem32(e, 0x8B, RAX, RBX, OFF_POSTED);
+                op_rr(e, 0x85, RAX, RAX);
+                fixup(c, jcc(e, CC_NE), TO_EXIT, target);
+                fixup(c, jmp(e), TO_INSTRUCTION, 0);
+            } else
+                fixup(c, jmp(e), TO_EXIT, target);
+        } else {
+            store16(e, RAX, RBX, -1, OFF_REG(PC));
+            fixup(c, jmp(e), TO_EPILOGUE, 0);
+        }
+        return;
+    }
+
+    if (loc == LOC_REG)
+        mov_rr(e, reg, RAX);
+    // Step I and J before the store so a slow path exit leaves them updated
+    if (ins->op == STI || ins->op == STD) {
+        alu_ri(e, ins->op == STI ? 0 : 5, pinned[6], 1);
+        movzx16(e, pinned[6], pinned[6]);
+        alu_ri(e, ins->op == STI ? 0 : 5, pinned[7], 1);
+        movzx16(e, pinned[7], pinned[7]);
+    }
+    if (loc == LOC_MEM)
+        store_memory(c, pc_after, 0);
+}
+
+static void spill(emit_t *e) {
+    for (int i = 0; i < 10; i++)
+        store16(e, pinned[guest_regs[i]], RBX, -1, OFF_REG(guest_regs[i]));
+}
+
+
+static void link_block(struct jit_t *jit, int index) {
+    block_t *blk = &jit->blocks[index];
+    int first = blk->pc >> CPU_PAGE_SHIFT, last = (blk->end - 1) >> CPU_PAGE_SHIFT;
+    blk->next[0] = jit->pages[first];
+    jit->pages[first] = index;
+    blk->next[1] = -1;
+    if (last != first) {
+        blk->next[1] = jit->pages[last];
+        jit->pages[last] = index;
+    }
+    for (uint32_t a = blk->pc; a < blk->end; a++)
+        jit->covered[a >> 6] |= 1ull << (a & 63);
+}
+
+static int16_t* link_of(struct jit_t *jit, int index, int page) {
+    block_t *blk = &jit->blocks[index];
+    return &blk->next[(blk->pc >> CPU_PAGE_SHIFT) == page ? 0 : 1];
+}
+
+static void recover(struct jit_t *jit, int page) {
+    for (int i = 0; i < (1 << CPU_PAGE_SHIFT) / 64; i++)
+        jit->covered[(page << CPU_PAGE_SHIFT) / 64 + i] = 0;
+    for (int i = jit->pages[page]; i >= 0; i = *link_of(jit, i, page)) {
+        block_t *blk = &jit->blocks[i];
+        for (uint32_t a = blk->pc; a < blk->end; a++)
+            if ((a >> CPU_PAGE_SHIFT) == page)
+                jit->covered[a >> 6] |= 1ull << (a & 63);
+    }
+}
+
+static void unlink_block(struct jit_t *jit, int index) {
+    block_t *blk = &jit->blocks[index];
+    int pages[2] = { blk->pc >> CPU_PAGE_SHIFT, (blk->end - 1) >> CPU_PAGE_SHIFT };
+    for (int p = 0; p < (pages[0] == pages[1] ? 1 : 2); p++) {
+        int16_t *link = &jit->pages[pages[p]];
+        while (*link >= 0 && *link != index)
+            link = link_of(jit, *link, pages[p]);
+        if (*link == index)
+            *link = *link_of(jit, index, pages[p]);
+    }
+    blk->state = BLOCK_EMPTY;
+    for (int p = 0; p < (pages[0] == pages[1] ? 1 : 2); p++)
+        recover(jit, pages[p]);
+}
+
+static void flush(struct jit_t *jit) {
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    for (int i = 0; i < CPU_PAGE_COUNT; i++)
+        jit->pages[i] = -1;
+    jit->used = 0;
+}
+
+static int compile(struct cpu_t *cpu, struct jit_t *jit, uint16_t start, block_t *blk) {
+    static __thread compiler_t c;
+    memset(&c, 0, sizeof(compiler_t));
+    c.start = start;
+
+    // Gather the block, it ends at anything that writes PC or that the translator doesn't handle
+    uint32_t pc = start, cover = start, max_cycles = 0;
+    while (c.count < JIT_MAX_INSTRUCTIONS) {
+        const struct instruction_t *ins = cpu_decode(cpu, pc);
+        if (pc + ins->length > 0x10000 || !supported(ins))
+            break;
+        c.list[c.count++] = (entry_t){ pc, *ins };
+        max_cycles += ins->cycles;
+        pc += ins->length;
+        if (is_if(ins)) {
+            uint32_t cycles, target = skip_chain(cpu, pc, &cycles);
+            if (target > 0xFFFF)
+                return 0;
+            max_cycles += cycles;
+            if (target > cover)
+                cover = target;
+        }
+        if (is_branch(ins))
+            break;
+    }
+    if (!c.count)
+        return 0;
+    if (pc > cover)
+        cover = pc;
+    if (cover - start > (1 << CPU_PAGE_SHIFT))
+        return 0;
+    c.max_cycles = max_cycles;
+
+    if (jit->used + JIT_BLOCK_SIZE > JIT_CODE_SIZE)
+        flush(jit);
+    emit_t *e = &c.e;
+    e->start = e->p = jit->code + jit->used;
+    e->end = e->start + JIT_BLOCK_SIZE;
+
+    // void block(struct cpu_t *cpu, uint64_t end)
+    push_r(e, RBX);
+    push_r(e, RBP);
+    push_r(e, R12);
+    push_r(e, R13);
+    push_r(e, R14);
+    push_r(e, R15);
+    rex(e, 1, 0, 0, RSP);
+    byte(e, 0x83);
+    modrm_reg(e, 5, RSP);
+    byte(e, 24);
+    rex(e, 1, RDI, 0, RBX);
+    byte(e, 0x89);
+    modrm_reg(e, RDI, RBX);
+    mem64(e, 0x89, RSI, RSP, 0);
+    mem64(e, 0x8B, RBP, RBX, OFF_MEMORY);
+    for (int i = 0; i < 10; i++)
+        load16(e, pinned[guest_regs[i]], RBX, -1, OFF_REG(guest_regs[i]));
+
+    for (int i = 0; i < c.count; i++)
+        instruction(cpu, &c, i);
+    if (!is_branch(&c.list[c.count - 1].ins))
+        fixup(&c, jmp(e), TO_EXIT, pc);
+
+    for (int i = 0; i < c.skip_count; i++) {
+        patch(e, c.skips[i].at, e->p - e->start);
+        add_mem64_imm(e, RBX, OFF_CYCLES, c.skips[i].cycles);
+        jump_to_pc(&c, jmp(e), c.skips[i].target);
+    }
+    for (int i = 0; i < c.slow_count; i++) {
+        patch(e, c.slows[i].at, e->p - e->start);
+        spill(e);
+        store16_imm(e, RBX, OFF_REG(PC), c.slows[i].pc_after);
+        rex(e, 1, RBX, 0, RDI);
+        byte(e, 0x89);
+        modrm_reg(e, RBX, RDI);
+        mov_rr(e, RSI, RDX);
+        call_abs(e, (void*)jit_written);
+        if (c.slows[i].jsr) {
+            mem32(e, 0x8B, RAX, RSP, 8);
+            store16(e, RAX, RBX, -1, OFF_REG(PC));
+        }
+        fixup(&c, jmp(e), TO_TAIL, 0);
+    }
+
+    size_t exits[JIT_MAX_INSTRUCTIONS * 8];
+    for (int i = 0; i < c.fixup_count; i++) {
+        if (c.fixups[i].kind != TO_EXIT)
+            continue;
+        int j;
+        for (j = 0; j < i; j++)
+            if (c.fixups[j].kind == TO_EXIT && c.fixups[j].value == c.fixups[i].value)
+                break;
+        if (j < i) {
+            exits[i] = exits[j];
+            continue;
+        }
+        exits[i] = e->p - e->start;
+        store16_imm(e, RBX, OFF_REG(PC), c.fixups[i].value);
+        fixup(&c, jmp(e), TO_EPILOGUE, 0);
+    }
+    size_t epilogue = e->p - e->start;
+    spill(e);
+    size_t tail = e->p - e->start;
+    rex(e, 1, 0, 0, RSP);
+    byte(e, 0x83);
+    modrm_reg(e, 0, RSP);
+    byte(e, 24);
+    pop_r(e, R15);
+    pop_r(e, R14);
+    pop_r(e, R13);
+    pop_r(e, R12);
+    pop_r(e, RBP);
+    pop_r(e, RBX);
+    byte(e, 0xC3);
+
+    if (e->p > e->end)
+        return 0;
+    for (int i = 0; i < c.fixup_count; i++)
+        switch (c.fixups[i].kind) {
+            case TO_INSTRUCTION: patch(e, c.fixups[i].at, c.labels[c.fixups[i].value]); break;
+            case TO_EXIT:        patch(e, c.fixups[i].at, exits[i]); break;
+            case TO_EPILOGUE:    patch(e, c.fixups[i].at, epilogue); break;
+            case TO_TAIL:        patch(e, c.fixups[i].at, tail); break;
+        }
+
+    jit->used += ((e->p - e->start) + 15) & ~15;
+    blk->fn = (block_fn)(void*)e->start;
+    blk->pc = start;
+    blk->end = cover;
+    blk->max_cycles = max_cycles;
+    blk->state = BLOCK_LIVE;
+    return 1;
+}
+
+int cpu_jit_enable(struct cpu_t *cpu) {
+    if (cpu->jit)
+        return 1;
+    struct jit_t *jit = calloc(1, sizeof(struct jit_t));
+    if (!jit)
+        return 0;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return 0;
+    }
+    flush(jit);
+    cpu->jit = jit;
+    return 1;
+}
+
+void cpu_jit_disable(struct cpu_t *cpu) {
+    if (!cpu->jit)
+        return;
+    munmap(cpu->jit->code, JIT_CODE_SIZE);
+    free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+int jit_enter(struct cpu_t *cpu, uint64_t end) {
+    struct jit_t *jit = cpu->jit;
+    uint16_t pc = cpu->reg[PC];
+    int index = pc & (JIT_BLOCKS - 1);
+    block_t *blk = &jit->blocks[index];
+    if (blk->pc == pc && blk->state != BLOCK_EMPTY) {
+        if (blk->state != BLOCK_LIVE || cpu->cycles > end || end - cpu->cycles < blk->max_cycles)
+            return 0;
+        blk->fn(cpu, end);
+        return 1;
+    }
+    if (++jit->hits[index] < JIT_THRESHOLD)
+        return 0;
+    jit->hits[index] = 0;
+    if (blk->state == BLOCK_LIVE)
+        unlink_block(jit, index);
+    if (compile(cpu, jit, pc, blk))
+        link_block(jit, index);
+    else {
+        blk->pc = pc;
+        blk->state = BLOCK_FAILED;
+    }
+    return 0;
+}
+
+void jit_invalidate(struct cpu_t *cpu, uint16_t address) {
+    struct jit_t *jit = cpu->jit;
+    if (!(jit->covered[address >> 6] & (1ull << (address & 63))))
+        return;
+    int page = address >> CPU_PAGE_SHIFT;
+    for (int i = jit->pages[page], next; i >= 0; i = next) {
+        next = *link_of(jit, i, page);
+        block_t *blk = &jit->blocks[i];
+        if (address >= blk->pc && address < blk->end)
+            unlink_block(jit, i);
+    }
+}
+
+#else
+
+int cpu_jit_enable(struct cpu_t *cpu) {
+    return 0;
+}
+
+void cpu_jit_disable(struct cpu_t *cpu) {}
+
+int jit_enter(struct cpu_t *cpu, uint64_t end) {
+    return 0;
+}
+
+void jit_invalidate(struct cpu_t *cpu, uint16_t address) {}
+
+#endif
@@ -0,0 +1,499 @@
+/* journal.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Everything that reaches the CPU from outside is grouped into frames, one per device callback that had an
+// effect, or per stretch of host calls between cpu_run. Frames are stamped with the cycle count they happened
+// at, their effects follow in the order they were made.
+//
+//   header    "CCPUJNL1", u64 cycles at the start of recording
+//   FRAME     varint cycles since the previous frame, u8 site, varint device
+//   REGISTER  u8 register (12 is the CPU state), u16 value
+//   MEMORY    u16 address, varint count, count * u16
+//   INTERRUPT u16 message
+//   SCHEDULE  varint device, varint deadline
+//   CANCEL    varint device
+//
+// Multi-byte fixed width values are little endian.
+
+#define MAGIC "CCPUJNL1"
+#define JOURNAL_BUFFER 65536
+#define MEMORY_CHUNK 1024
+
+enum {
+    FRAME = 1,
+    REGISTER,
+    MEMORY,
+    INTERRUPT,
+    SCHEDULE,
+    CANCEL
+};
+
+// Matches cpu.c
+enum {
+    SITE_HOST = 0,
+    SITE_TICK,
+    SITE_WAKE,
+    SITE_INTERRUPT
+};
+
+struct journal_t {
+    int replay;
+    int applying;
+    uint64_t stamp; // Cycles of the last frame written or read
+
+    // Recording, the CPU fills one buffer while the writer thread drains the other
+    FILE *file;
+    uint8_t *buffer, *spare;
+    size_t used;
+    uint8_t *full;
+    size_t full_size;
+    int done, failed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    int site, device, open;
+    uint16_t reg[13];
+
+    // Replaying, the whole log is mapped and read in place
+    const uint8_t *data;
+    size_t size, at;
+    uint64_t next_stamp;
+    int next_site, next_device;
+};
+
+static void* writer_main(void *arg) {
+    struct journal_t *j = arg;
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (!j->full && !j->done)
+            pthread_cond_wait(&j->work, &j->lock);
+        if (!j->full)
+            break;
+        uint8_t *data = j->full;
+        size_t size = j->full_size;
+        pthread_mutex_unlock(&j->lock);
+        if (fwrite(data, 1, size, j->file) != size)
+            j->failed = 1;
+        pthread_mutex_lock(&j->lock);
+        j->full = NULL;
+        pthread_cond_signal(&j->idle);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+static void hand_off(struct journal_t *j) {
+    pthread_mutex_lock(&j->lock);
+    while (j->full)
+        pthread_cond_wait(&j->idle, &j->lock);
+    j->full = j->buffer;
+    j->full_size = j->used;
+    pthread_cond_signal(&j->work);
+    pthread_mutex_unlock(&j->lock);
+    uint8_t *swap = j->buffer;
+    j->buffer = j->spare;
+    j->spare = swap;
+    j->used = 0;
+}
+
+static void reserve(struct journal_t *j, size_t size) {
+    if (j->used + size > JOURNAL_BUFFER)
+        hand_off(j);
+}
+
+static void put8(struct journal_t *j, uint8_t value) {
+    j->buffer[j->used++] = value;
+}
+
+static void put16(struct journal_t *j, uint16_t value) {
+    put8(j, value & 0xFF);
+    put8(j, value >> 8);
+}
+
+static void put_varint(struct journal_t *j, uint64_t value) {
+    while (value >= 0x80) {
+        put8(j, (value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    put8(j, value);
+}
+
+static int device_index(struct cpu_t *cpu, struct hardware_t *hw) {
+    for (int i = 0; i < cpu->hardware_count; i++)
+        if (cpu->hardware[i] == hw)
+            return i;
+    return 0;
+}
+
+static void open_frame(struct cpu_t *cpu, struct journal_t *j) {
+    if (j->open)
+        return;
+    reserve(j, 32);
+    put8(j, FRAME);
+    put_varint(j, cpu->cycles - j->stamp);
+    put8(j, j->site);
+    put_varint(j, j->device);
+    j->stamp = cpu->cycles;
+    j->open = 1;
+}
+
+static void save_registers(struct cpu_t *cpu, struct journal_t *j) {
+    memcpy(j->reg, cpu->reg, sizeof(cpu->reg));
+    j->reg[12] = cpu->state;
+}
+
+// Log whatever registers were changed directly since they were last saved
+static void diff_registers(struct cpu_t *cpu, struct journal_t *j) {
+    for (int i = 0; i < 13; i++) {
+        uint16_t value = i < 12 ? cpu->reg[i] : cpu->state;
+        if (value == j->reg[i])
+            continue;
+        open_frame(cpu, j);
+        reserve(j, 4);
+        put8(j, REGISTER);
+        put8(j, i);
+        put16(j, value);
+        j->reg[i] = value;
+    }
+}
+
+static int recording(struct cpu_t *cpu) {
+    return cpu->journal && !cpu->journal->replay;
+}
+
+static void* map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+static uint64_t get_varint(struct journal_t *j) {
+    uint64_t value = 0;
+    for (int shift = 0; j->at < j->size && shift < 64; shift += 7) {
+        uint8_t byte = j->data[j->at++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return value;
+}
+
+static uint16_t get16(struct journal_t *j) {
+    if (j->at + 2 > j->size) {
+        j->at = j->size;
+        return 0;
+    }
+    uint16_t value = j->data[j->at] | j->data[j->at + 1] << 8;
+    j->at += 2;
+    return value;
+}
+
+// Decode the header of the next frame, the log ends at anything else
+static void peek_frame(struct journal_t *j) {
+    if (j->at >= j->size || j->data[j->at] != FRAME) {
+        j->at = j->size;
+        j->next_stamp = UINT64_MAX;
+        return;
+    }
+    j->at++;
+    j->next_stamp = j->stamp + get_varint(j);
+    j->next_site = j->at < j->size ? j->data[j->at++] : SITE_HOST;
+    j->next_device = get_varint(j);
+}
+
+static void apply_frame(struct cpu_t *cpu, struct journal_t *j) {
+    j->stamp = j->next_stamp;
+    j->applying = 1;
+    while (j->at < j->size && j->data[j->at] != FRAME) {
+        switch (j->data[j->at++]) {
+            case REGISTER: {
+                int index = j->at < j->size ? j->data[j->at++] : 0;
+                uint16_t value = get16(j);
+                if (index < 12)
+                    cpu->reg[index] = value;
+                else
+                    cpu->state = value;
+                break;
+            }
+            case MEMORY: {
+                uint16_t address = get16(j);
+                uint32_t count = get_varint(j);
+                for (uint32_t i = 0; i < count; i++)
+                    cpu->memory[(uint16_t)(address + i)] = get16(j);
+                cpu_invalidate(cpu, address, count);
+                break;
+            }
+            case INTERRUPT:
+                cpu_interrupt(cpu, get16(j));
+                break;
+            case SCHEDULE: {
+                uint64_t device = get_varint(j), deadline = get_varint(j);
+                if (device < cpu->hardware_count)
+                    cpu_schedule_at(cpu->hardware[device], deadline);
+                break;
+            }
+            case CANCEL: {
+                uint64_t device = get_varint(j);
+                if (device < cpu->hardware_count)
+                    cpu_cancel(cpu->hardware[device]);
+                break;
+            }
+            default:
+                j->at = j->size;
+                break;
+        }
+    }
+    j->applying = 0;
+    peek_frame(j);
+}
+
+void journal_call(struct cpu_t *cpu, struct hardware_t *hw, int site) {
+    struct journal_t *j = cpu->journal;
+    if (j->replay) {
+        // The device itself never runs, only what it did the first time around
+        if (j->next_stamp == cpu->cycles && j->next_site == site && j->next_device == device_index(cpu, hw))
+            apply_frame(cpu, j);
+        return;
+    }
+    // The CPU changed its own registers since the last frame, only what the device does counts
+    save_registers(cpu, j);
+    j->site = site;
+    j->device = device_index(cpu, hw);
+    j->open = 0;
+    switch (site) {
+        case SITE_TICK:
+            hw->tick(hw);
+            break;
+        case SITE_WAKE:
+            hw->wake(hw);
+            break;
+        default:
+            hw->interrupt(hw);
+            break;
+    }
+    diff_registers(cpu, j);
+    j->site = SITE_HOST;
+    j->device = 0;
+    j->open = 0;
+}
+
+int journal_interrupt(struct cpu_t *cpu, uint16_t message) {
+    struct journal_t *j = cpu->journal;
+    if (j->replay)
+        return j->applying;
+    diff_registers(cpu, j);
+    open_frame(cpu, j);
+    reserve(j, 3);
+    put8(j, INTERRUPT);
+    put16(j, message);
+    return 1;
+}
+
+void journal_interrupted(struct cpu_t *cpu) {
+    if (recording(cpu))
+        save_registers(cpu, cpu->journal);
+}
+
+void journal_written(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    if (!recording(cpu))
+        return;
+    struct journal_t *j = cpu->journal;
+    diff_registers(cpu, j);
+    open_frame(cpu, j);
+    if (count > 0x10000)
+        count = 0x10000;
+    for (uint32_t done = 0; done < count;) {
+        uint32_t chunk = count - done < MEMORY_CHUNK ? count - done : MEMORY_CHUNK;
+        reserve(j, 8 + chunk * 2);
+        put8(j, MEMORY);
+        put16(j, address + done);
+        put_varint(j, chunk);
+        for (uint32_t i = 0; i < chunk; i++)
+            put16(j, cpu->memory[(uint16_t)(address + done + i)]);
+        done += chunk;
+    }
+}
+
+void journal_schedule(struct hardware_t *hw) {
+    struct cpu_t *cpu = hw->cpu;
+    if (!recording(cpu))
+        return;
+    struct journal_t *j = cpu->journal;
+    open_frame(cpu, j);
+    reserve(j, 24);
+    if (hw->timer) {
+        put8(j, SCHEDULE);
+        put_varint(j, device_index(cpu, hw));
+        put_varint(j, hw->deadline);
+    } else {
+        put8(j, CANCEL);
+        put_varint(j, device_index(cpu, hw));
+    }
+}
+
+void journal_host(struct cpu_t *cpu) {
+    struct journal_t *j = cpu->journal;
+    if (j->replay)
+        while (j->next_stamp <= cpu->cycles && j->next_site == SITE_HOST)
+            apply_frame(cpu, j);
+}
+
+void journal_enter(struct cpu_t *cpu) {
+    struct journal_t *j = cpu->journal;
+    if (j->replay)
+        journal_host(cpu);
+    else
+        diff_registers(cpu, j);
+}
+
+void journal_leave(struct cpu_t *cpu) {
+    struct journal_t *j = cpu->journal;
+    if (!j->replay) {
+        // Anything after this belongs to the host, until cpu_run is next called
+        save_registers(cpu, j);
+        j->open = 0;
+    }
+}
+
+uint64_t journal_deadline(struct cpu_t *cpu) {
+    struct journal_t *j = cpu->journal;
+    return j->replay && j->next_site == SITE_HOST ? j->next_stamp : UINT64_MAX;
+}
+
+int cpu_journal_record(struct cpu_t *cpu, const char *path) {
+    if (cpu->journal)
+        return 0;
+    struct journal_t *j = calloc(1, sizeof(struct journal_t));
+    if (!j)
+        return 0;
+    if (!(j->file = fopen(path, "wb")) ||
+        !(j->buffer = malloc(JOURNAL_BUFFER)) ||
+        !(j->spare = malloc(JOURNAL_BUFFER)))
+        goto FAIL;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->work, NULL);
+    pthread_cond_init(&j->idle, NULL);
+    if (pthread_create(&j->thread, NULL, writer_main, j)) {
+        pthread_mutex_destroy(&j->lock);
+        pthread_cond_destroy(&j->work);
+        pthread_cond_destroy(&j->idle);
+        goto FAIL;
+    }
+    memcpy(j->buffer, MAGIC, 8);
+    j->used = 8;
+    for (int i = 0; i < 8; i++)
+        put8(j, (cpu->cycles >> (i * 8)) & 0xFF);
+    j->stamp = cpu->cycles;
+    save_registers(cpu, j);
+    cpu->journal = j;
+    return 1;
+
+FAIL:
+    if (j->file)
+        fclose(j->file);
+    free(j->buffer);
+    free(j->spare);
+    free(j);
+    return 0;
+}
+
+int cpu_journal_replay(struct cpu_t *cpu, const char *path) {
+    if (cpu->journal)
+        return 0;
+    struct journal_t *j = calloc(1, sizeof(struct journal_t));
+    if (!j)
+        return 0;
+    j->replay = 1;
+    if (!(j->data = map_file(path, &j->size)))
+        goto FAIL;
+    uint64_t start = 0;
+    if (j->size < 16 || memcmp(j->data, MAGIC, 8))
+        goto FAIL;
+    for (int i = 0; i < 8; i++)
+        start |= (uint64_t)j->data[8 + i] << (i * 8);
+    // Replay has to begin from the same point recording did
+    if (start != cpu->cycles)
+        goto FAIL;
+    j->at = 16;
+    j->stamp = start;
+    peek_frame(j);
+    cpu->journal = j;
+    return 1;
+
+FAIL:
+    if (j->data)
+        munmap((void*)j->data, j->size);
+    free(j);
+    return 0;
+}
+
+int cpu_journal_close(struct cpu_t *cpu) {
+    struct journal_t *j = cpu->journal;
+    if (!j)
+        return 1;
+    cpu->journal = NULL;
+    int result = 1;
+    if (j->replay)
+        munmap((void*)j->data, j->size);
+    else {
+        if (j->used)
+            hand_off(j);
+        pthread_mutex_lock(&j->lock);
+        j->done = 1;
+        pthread_cond_signal(&j->work);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+        // Closed even after a failed write
+        int closed = fclose(j->file) == 0;
+        result = closed && !j->failed;
+        pthread_mutex_destroy(&j->lock);
+        pthread_cond_destroy(&j->work);
+        pthread_cond_destroy(&j->idle);
+        free(j->buffer);
+        free(j->spare);
+    }
+    free(j);
+    return result;
+}
@@ -0,0 +1,308 @@
+/* lem1802.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+// NYA ELEKTRISKA LEM1802. 32x12 cells of 4x8 pixels, each cell a word of foreground, background, blink and
+// character (ffffbbbbBccccccc), glyphs two words of four column bytes (bit 0 the top row) and the palette
+// 16 words of 0000rrrrggggbbbb. Screen, font and palette are read from cpu->memory wherever the guest mapped
+// them, or the built in font and palette when not.
+//
+// Nothing is rendered until the frame is asked for. The words a frame was rendered from are kept, so the
+// next one only redraws cells whose word changed, whose glyph or colours changed, or that blink. Glyphs are
+// kept turned into a 4-bit mask per pixel row, and a row is drawn as one 4-lane select between the
+// foreground and background colours (GCC vector extensions, so SSE2 by default).
+
+#define COLUMNS 32
+#define ROWS 12
+#define CELLS (COLUMNS * ROWS)
+#define GLYPHS 128
+#define FONT_WORDS (GLYPHS * 2)
+#define PALETTE_WORDS 16
+#define DUMP_FONT_CYCLES 256
+#define DUMP_PALETTE_CYCLES 16
+
+typedef uint32_t row_t __attribute__((vector_size(4 * sizeof(uint32_t))));
+
+enum { A, B };
+
+enum {
+    MEM_MAP_SCREEN = 0,
+    MEM_MAP_FONT,
+    MEM_MAP_PALETTE,
+    SET_BORDER_COLOR,
+    MEM_DUMP_FONT,
+    MEM_DUMP_PALETTE
+};
+
+static const uint16_t default_font[FONT_WORDS] = {
+    0xb79e, 0x388e, 0x722c, 0x75f4, 0x19bb, 0x7f8f, 0x85f9, 0xb158,
+    0x242e, 0x2400, 0x082a, 0x0800, 0x0008, 0x0000, 0x0808, 0x0808,
+    0x00ff, 0x0000, 0x00f8, 0x0808, 0xf808, 0x0000, 0x080f, 0x0000,
+    0x000f, 0x0808, 0x00ff, 0x0808, 0x08f8, 0x0808, 0x08ff, 0x0000,
+    0x080f, 0x0808, 0x08ff, 0x0808, 0x6633, 0x99cc, 0x9933, 0x66cc,
+    0xfef8, 0xe080, 0x7f1f, 0x0701, 0x0107, 0x1f7f, 0x80e0, 0xf8fe,
+    0x5500, 0xaa00, 0x55aa, 0x55aa, 0xffaa, 0xff55, 0x0f0f, 0x0f0f,
+    0xf0f0, 0xf0f0, 0x0000, 0xffff, 0xffff, 0x0000, 0xffff, 0xffff,
+    0x0000, 0x0000, 0x005f, 0x0000, 0x0300, 0x0300, 0x3e14, 0x3e00,
+    0x266b, 0x3200, 0x611c, 0x4300, 0x3629, 0x7650, 0x0002, 0x0100,
+    0x1c22, 0x4100, 0x4122, 0x1c00, 0x1408, 0x1400, 0x081c, 0x0800,
+    0x4020, 0x0000, 0x0808, 0x0800, 0x0040, 0x0000, 0x601c, 0x0300,
+    0x3e49, 0x3e00, 0x427f, 0x4000, 0x6259, 0x4600, 0x2249, 0x3600,
+    0x0f08, 0x7f00, 0x2745, 0x3900, 0x3e49, 0x3200, 0x6119, 0x0700,
+    0x3649, 0x3600, 0x2649, 0x3e00, 0x0024, 0x0000, 0x4024, 0x0000,
+    0x0814, 0x2200, 0x1414, 0x1400, 0x2214, 0x0800, 0x0259, 0x0600,
+    0x3e59, 0x5e00, 0x7e09, 0x7e00, 0x7f49, 0x3600, 0x3e41, 0x2200,
+    0x7f41, 0x3e00, 0x7f49, 0x4100, 0x7f09, 0x0100, 0x3e41, 0x7a00,
+    0x7f08, 0x7f00, 0x417f, 0x4100, 0x2040, 0x3f00, 0x7f08, 0x7700,
+    0x7f40, 0x4000, 0x7f06, 0x7f00, 0x7f01, 0x7e00, 0x3e41, 0x3e00,
+    0x7f09, 0x0600, 0x3e61, 0x7e00, 0x7f09, 0x7600, 0x2649, 0x3200,
+    0x017f, 0x0100, 0x3f40, 0x7f00, 0x1f60, 0x1f00, 0x7f30, 0x7f00,
+    0x7708, 0x7700, 0x0778, 0x0700, 0x7149, 0x4700, 0x007f, 0x4100,
+    0x031c, 0x6000, 0x417f, 0x0000, 0x0201, 0x0200, 0x8080, 0x8000,
+    0x0001, 0x0200, 0x2454, 0x7800, 0x7f44, 0x3800, 0x3844, 0x2800,
+    0x3844, 0x7f00, 0x3854, 0x5800, 0x087e, 0x0900, 0x4854, 0x3c00,
+    0x7f04, 0x7800, 0x047d, 0x0000, 0x2040, 0x3d00, 0x7f10, 0x6c00,
+    0x017f, 0x0000, 0x7c18, 0x7c00, 0x7c04, 0x7800, 0x3844, 0x3800,
+    0x7c14, 0x0800, 0x0814, 0x7c00, 0x7c04, 0x0800, 0x4854, 0x2400,
+    0x043e, 0x4400, 0x3c40, 0x7c00, 0x1c60, 0x1c00, 0x7c30, 0x7c00,
+    0x6c10, 0x6c00, 0x4c50, 0x3c00, 0x6454, 0x4c00, 0x0836, 0x4100,
+    0x0077, 0x0000, 0x4136, 0x0800, 0x0201, 0x0201, 0x0205, 0x0200
+};
+
+static const uint16_t default_palette[PALETTE_WORDS] = {
+    0x000, 0x00a, 0x0a0, 0x0aa, 0xa00, 0xa0a, 0xa50, 0xaaa,
+    0x555, 0x55f, 0x5f5, 0x5ff, 0xf55, 0xf5f, 0xff5, 0xfff
+};
+
+// Lane c all ones where bit c of the index is set
+static const row_t masks[16] = {
+#define MASK(N) { (N) & 1 ? ~0u : 0, (N) & 2 ? ~0u : 0, (N) & 4 ? ~0u : 0, (N) & 8 ? ~0u : 0 }
+    MASK(0), MASK(1), MASK(2), MASK(3), MASK(4), MASK(5), MASK(6), MASK(7),
+    MASK(8), MASK(9), MASK(10), MASK(11), MASK(12), MASK(13), MASK(14), MASK(15)
+#undef MASK
+};
+
+struct lem1802_t {
+    uint32_t frame[LEM1802_HEIGHT][LEM1802_WIDTH] __attribute__((aligned(16)));
+    uint16_t screen_address, font_address, palette_address; // 0 when not mapped
+    uint16_t border;
+    // What the frame shows
+    uint16_t screen[CELLS];
+    uint16_t font[FONT_WORDS];
+    uint16_t palette[PALETTE_WORDS];
+    uint8_t rows[GLYPHS][8]; // Pixel row masks of each glyph, bit c is column c
+    uint32_t colours[PALETTE_WORDS];
+    int blink;
+    int drawn, blank; // Whether every cell is up to date, whether the frame is all zeroes
+};
+
+static uint32_t rgba(uint16_t colour) {
+    uint32_t r = (colour >> 8 & 0xF) * 0x11, g = (colour >> 4 & 0xF) * 0x11, b = (colour & 0xF) * 0x11;
+    // Bytes R, G, B, A in memory on little endian hosts
+    return r | g << 8 | b << 16 | 0xFFu << 24;
+}
+
+static void glyph_rows(struct lem1802_t *lem, int glyph) {
+    uint8_t columns[4] = {
+        lem->font[glyph * 2] >> 8, lem->font[glyph * 2] & 0xFF,
+        lem->font[glyph * 2 + 1] >> 8, lem->font[glyph * 2 + 1] & 0xFF
+    };
+    for (int r = 0; r < 8; r++) {
+        uint8_t row = 0;
+        for (int c = 0; c < 4; c++)
+            row |= (columns[c] >> r & 1) << c;
+        lem->rows[glyph][r] = row;
+    }
+}
+
+// Copies count words from memory at address (wrapping) or from fallback when address is 0
+static void gather(const struct cpu_t *cpu, uint16_t address, const uint16_t *fallback, uint16_t *dst,
+                   int count) {
+    if (!address)
+        memcpy(dst, fallback, count * sizeof(uint16_t));
+    else if (address + count <= 0x10000)
+        memcpy(dst, &cpu->memory[address], count * sizeof(uint16_t));
+    else
+        for (int i = 0; i < count; i++)
+            dst[i] = cpu->memory[(uint16_t)(address + i)];
+}
+
+static void draw_cell(struct lem1802_t *lem, int cell, uint16_t word) {
+    row_t fg = (row_t){0} + lem->colours[word >> 12], bg = (row_t){0} + lem->colours[word >> 8 & 0xF];
+    const uint8_t *rows = lem->rows[word & 0x7F];
+    // Blinking characters are hidden for half the period
+    uint8_t visible = (word & 0x80) && !lem->blink ? 0 : 0xF;
+    uint32_t *dst = &lem->frame[cell / COLUMNS * 8][cell % COLUMNS * 4];
+    for (int r = 0; r < 8; r++) {
+        row_t mask = masks[rows[r] & visible];
+        *(row_t*)&dst[r * LEM1802_WIDTH] = (fg & mask) | (bg & ~mask);
+    }
+}
+
+const uint32_t* lem1802_render(struct hardware_t *hw, int blink, int *cells) {
+    struct lem1802_t *lem = hw->data;
+    struct cpu_t *cpu = hw->cpu;
+    int drawn = 0;
+    blink = !!blink;
+    if (!lem->screen_address) {
+        // Disconnected, the panel is dark
+        if (!lem->blank)
+            memset(lem->frame, 0, sizeof(lem->frame));
+        lem->blank = 1;
+        lem->drawn = 0;
+        if (cells)
+            *cells = 0;
+        return &lem->frame[0][0];
+    }
+
+    uint16_t font[FONT_WORDS], palette[PALETTE_WORDS], screen[CELLS];
+    gather(cpu, lem->font_address, default_font, font, FONT_WORDS);
+    gather(cpu, lem->palette_address, default_palette, palette, PALETTE_WORDS);
+    gather(cpu, lem->screen_address, NULL, screen, CELLS);
+
+    // Glyphs and colours that differ from what the frame was drawn with
+    uint64_t glyphs[GLYPHS / 64] = {0};
+    uint16_t colours = 0;
+    if (!lem->drawn || memcmp(font, lem->font, sizeof(font))) {
+        for (int g = 0; g < GLYPHS; g++)
+            if (!lem->drawn || font[g * 2] != lem->font[g * 2] || font[g * 2 + 1] != lem->font[g * 2 + 1]) {
+                lem->font[g * 2] = font[g * 2];
+                lem->font[g * 2 + 1] = font[g * 2 + 1];
+                glyph_rows(lem, g);
+                glyphs[g / 64] |= 1ull << g % 64;
+            }
+    }
+    if (!lem->drawn || memcmp(palette, lem->palette, sizeof(palette))) {
+        for (int c = 0; c < PALETTE_WORDS; c++)
+            if (!lem->drawn || palette[c] != lem->palette[c]) {
+                lem->palette[c] = palette[c];
+                lem->colours[c] = rgba(palette[c]);
+                colours |= 1 << c;
+            }
+    }
+    int toggled = blink != lem->blink;
+    lem->blink = blink;
+
+    for (int i = 0; i < CELLS; i++) {
+        uint16_t word = screen[i];
+        if (lem->drawn && word == lem->screen[i] && !(glyphs[(word & 0x7F) / 64] >> (word & 0x3F) & 1) &&
+            !(colours >> (word >> 12) & 1) && !(colours >> (word >> 8 & 0xF) & 1) && !(toggled && (word & 0x80)))
+            continue;
+        lem->screen[i] = word;
+        draw_cell(lem, i, word);
+        drawn++;
+    }
+    lem->drawn = 1;
+    lem->blank = 0;
+    if (cells)
+        *cells = drawn;
+    return &lem->frame[0][0];
+}
+
+uint32_t lem1802_border(struct hardware_t *hw) {
+    struct lem1802_t *lem = hw->data;
+    uint16_t colour = lem->palette_address ? hw->cpu->memory[(uint16_t)(lem->palette_address + lem->border)]
+                                           : default_palette[lem->border];
+    return rgba(colour);
+}
+
+static void dump(struct cpu_t *cpu, uint16_t address, const uint16_t *words, int count) {
+    for (int i = 0; i < count; i++)
+        cpu->memory[(uint16_t)(address + i)] = words[i];
+    cpu_invalidate(cpu, address, count);
+}
+
+static void lem1802_interrupt(struct hardware_t *hw) {
+    struct lem1802_t *lem = hw->data;
+    struct cpu_t *cpu = hw->cpu;
+    uint16_t *reg = cpu->reg;
+    switch (reg[A]) {
+        case MEM_MAP_SCREEN:
+            lem->screen_address = reg[B];
+            lem->drawn = 0;
+            break;
+        case MEM_MAP_FONT:
+            lem->font_address = reg[B];
+            break;
+        case MEM_MAP_PALETTE:
+            lem->palette_address = reg[B];
+            break;
+        case SET_BORDER_COLOR:
+            lem->border = reg[B] & 0xF;
+            break;
+        case MEM_DUMP_FONT:
+            dump(cpu, reg[B], default_font, FONT_WORDS);
+            cpu->cycles += DUMP_FONT_CYCLES;
+            break;
+        case MEM_DUMP_PALETTE:
+            dump(cpu, reg[B], default_palette, PALETTE_WORDS);
+            cpu->cycles += DUMP_PALETTE_CYCLES;
+            break;
+    }
+}
+
+static void lem1802_deinit(struct hardware_t *hw) {
+    free(hw->data);
+}
+
+static struct lem1802_t* create(void) {
+    struct lem1802_t *lem;
+    if (posix_memalign((void**)&lem, 16, sizeof(struct lem1802_t)))
+        return NULL;
+    memset(lem, 0, sizeof(struct lem1802_t));
+    lem->blank = 1;
+    return lem;
+}
+
+// Forks start with the parent's frame and carry on from it
+static int lem1802_clone(struct hardware_t *dst, struct hardware_t *src) {
+    struct lem1802_t *lem = create();
+    if (!lem)
+        return 0;
+    memcpy(lem, src->data, sizeof(struct lem1802_t));
+    dst->data = lem;
+    return 1;
+}
+
+static int lem1802_init(struct hardware_t *hw) {
+    if (!(hw->data = create()))
+        return 0;
+    hw->id = 0x7349f615;
+    hw->version = 0x1802;
+    hw->manufacturer = 0x1c6c8b36;
+    hw->interrupt = lem1802_interrupt;
+    hw->deinit = lem1802_deinit;
+    hw->clone = lem1802_clone;
+    return 1;
+}
+
+struct hardware_t* lem1802_attach(struct cpu_t *cpu) {
+    if (!cpu_attach_hardware(cpu, lem1802_init))
+        return NULL;
+    return cpu->hardware[cpu->hardware_count - 1];
+}
@@ -0,0 +1,310 @@
+/* m35fd.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Mackapar 3.5" Floppy Drive. Disks are 1440 sectors of 512 words (80 tracks of 18) stored raw in host word
+// order. A disk is opened once and shared by any number of drives, each drive maps it privately so the
+// pages it never writes stay in the page cache once for everyone and the ones it does are copied by the
+// kernel. That copy is the drive's overlay, gone on eject.
+//
+// Commands run at the drive's speed: 2.4ms per track seeked plus 512 words at 30700 words/s, both at the
+// DCPU's 100kHz. The transfer to or from cpu->memory happens when that time is up, in the meantime the
+// kernel is asked to read the sector in so the copy rarely waits on the disk.
+
+#define SECTOR_WORDS 512
+#define SECTORS 1440
+#define SECTORS_PER_TRACK 18
+#define DISK_BYTES (SECTORS * SECTOR_WORDS * sizeof(uint16_t))
+#define SEEK_CYCLES 240
+#define TRANSFER_CYCLES 1668
+
+enum { A, B, C, X, Y };
+
+enum {
+    STATE_NO_MEDIA = 0,
+    STATE_READY,
+    STATE_READY_WP,
+    STATE_BUSY
+};
+
+enum {
+    ERROR_NONE = 0,
+    ERROR_BUSY,
+    ERROR_NO_MEDIA,
+    ERROR_PROTECTED,
+    ERROR_EJECT,
+    ERROR_BAD_SECTOR,
+    ERROR_BROKEN = 0xFFFF
+};
+
+enum {
+    POLL = 0,
+    SET_INTERRUPT,
+    READ_SECTOR,
+    WRITE_SECTOR
+};
+
+struct disk_t {
+    int fd;
+    size_t bytes;
+    int refs;
+};
+
+struct m35fd_t {
+    struct disk_t *disk; // NULL when the drive is empty
+    uint16_t *words;     // DISK_BYTES of this drive's view of the disk
+    int protect;
+    uint16_t state, error, message;
+    uint16_t track;
+    // The command in flight while STATE_BUSY
+    int writing;
+    uint16_t sector, address;
+    uint8_t dirty[SECTORS / 8]; // Sectors in the overlay, so forks can copy them
+};
+
+struct disk_t* disk_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    struct disk_t *disk = NULL;
+    if (fstat(fd, &st) || st.st_size > DISK_BYTES || !(disk = malloc(sizeof(struct disk_t)))) {
+        close(fd);
+        return NULL;
+    }
+    disk->fd = fd;
+    disk->bytes = st.st_size;
+    disk->refs = 1;
+    return disk;
+}
+
+void disk_close(struct disk_t *disk) {
+    if (disk && __atomic_sub_fetch(&disk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(disk->fd);
+        free(disk);
+    }
+}
+
+// Short images read as zeroes past their end rather than faulting
+static uint16_t* map_disk(struct disk_t *disk) {
+    void *base = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (disk->bytes && mmap(base, disk->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, disk->fd, 0) == MAP_FAILED) {
+        munmap(base, DISK_BYTES);
+        return NULL;
+    }
+    return base;
+}
+
+static void notify(struct hardware_t *hw) {
+    struct m35fd_t *drive = hw->data;
+    if (drive->message)
+        cpu_interrupt(hw->cpu, drive->message);
+}
+
+// The guest is told whenever the state or error changes, if it asked to be
+static void set_status(struct hardware_t *hw, uint16_t state, uint16_t error) {
+    struct m35fd_t *drive = hw->data;
+    if (drive->state == state && drive->error == error)
+        return;
+    drive->state = state;
+    drive->error = error;
+    notify(hw);
+}
+
+static uint16_t idle_state(struct m35fd_t *drive) {
+    return !drive->disk ? STATE_NO_MEDIA : drive->protect ? STATE_READY_WP : STATE_READY;
+}
+
+static int start(struct hardware_t *hw, int writing, uint16_t sector, uint16_t address) {
+    struct m35fd_t *drive = hw->data;
+    uint16_t error = ERROR_NONE;
+    if (!drive->disk)
+        error = ERROR_NO_MEDIA;
+    else if (drive->state == STATE_BUSY)
+        error = ERROR_BUSY;
+    else if (sector >= SECTORS)
+        error = ERROR_BAD_SECTOR;
+    else if (writing && drive->protect)
+        error = ERROR_PROTECTED;
+    if (error) {
+        set_status(hw, drive->state, error);
+        return 0;
+    }
+    uint16_t track = sector / SECTORS_PER_TRACK;
+    uint64_t seek = (track > drive->track ? track - drive->track : drive->track - track) * SEEK_CYCLES;
+    drive->track = track;
+    drive->writing = writing;
+    drive->sector = sector;
+    drive->address = address;
+    // Page the sector in while the seek is modelled, a write still has to read the page to copy it
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)&drive->words[sector * SECTOR_WORDS] & ~(page - 1);
+    uintptr_t last = (uintptr_t)&drive->words[(sector + 1) * SECTOR_WORDS];
+    madvise((void*)first, last - first, MADV_WILLNEED);
+    cpu_schedule(hw, seek + TRANSFER_CYCLES);
+    set_status(hw, STATE_BUSY, drive->error);
+    return 1;
+}
+
+static void m35fd_wake(struct hardware_t *hw) {
+    struct m35fd_t *drive = hw->data;
+    struct cpu_t *cpu = hw->cpu;
+    uint16_t *sector = &drive->words[drive->sector * SECTOR_WORDS];
+    // Memory wraps at 0x10000, so the transfer is split where it does
+    uint32_t first = 0x10000 - drive->address;
+    if (first > SECTOR_WORDS)
+        first = SECTOR_WORDS;
+    if (drive->writing) {
+        memcpy(sector, &cpu->memory[drive->address], first * sizeof(uint16_t));
+        memcpy(sector + first, cpu->memory, (SECTOR_WORDS - first) * sizeof(uint16_t));
+        drive->dirty[drive->sector / 8] |= 1 << drive->sector % 8;
+    } else {
+        memcpy(&cpu->memory[drive->address], sector, first * sizeof(uint16_t));
+        memcpy(cpu->memory, sector + first, (SECTOR_WORDS - first) * sizeof(uint16_t));
+        cpu_invalidate(cpu, drive->address, SECTOR_WORDS);
+    }
+    set_status(hw, idle_state(drive), drive->error);
+}
+
+static void m35fd_interrupt(struct hardware_t *hw) {
+    struct m35fd_t *drive = hw->data;
+    uint16_t *reg = hw->cpu->reg;
+    switch (reg[A]) {
+        case POLL:
+            reg[B] = drive->state;
+            reg[C] = drive->error;
+            drive->error = ERROR_NONE;
+            break;
+        case SET_INTERRUPT:
+            drive->message = reg[X];
+            break;
+        case READ_SECTOR:
+        case WRITE_SECTOR:
+            reg[B] = start(hw, reg[A] == WRITE_SECTOR, reg[X], reg[Y]);
+            break;
+    }
+}
+
+void m35fd_eject(struct hardware_t *hw) {
+    struct m35fd_t *drive = hw->data;
+    if (!drive->disk)
+        return;
+    uint16_t error = drive->error;
+    if (drive->state == STATE_BUSY) {
+        cpu_cancel(hw);
+        error = ERROR_EJECT;
+    }
+    munmap(drive->words, DISK_BYTES);
+    disk_close(drive->disk);
+    drive->disk = NULL;
+    drive->words = NULL;
+    memset(drive->dirty, 0, sizeof(drive->dirty));
+    set_status(hw, STATE_NO_MEDIA, error);
+}
+
+int m35fd_insert(struct hardware_t *hw, struct disk_t *disk, int protect) {
+    struct m35fd_t *drive = hw->data;
+    uint16_t *words = map_disk(disk);
+    if (!words)
+        return 0;
+    m35fd_eject(hw);
+    __atomic_add_fetch(&disk->refs, 1, __ATOMIC_RELAXED);
+    drive->disk = disk;
+    drive->words = words;
+    drive->protect = protect;
+    set_status(hw, idle_state(drive), drive->error);
+    return 1;
+}
+
+int m35fd_save(struct hardware_t *hw, const char *path) {
+    struct m35fd_t *drive = hw->data;
+    if (!drive->disk)
+        return 0;
+    FILE *fh = fopen(path, "wb");
+    if (!fh)
+        return 0;
+    int ok = fwrite(drive->words, DISK_BYTES, 1, fh) == 1;
+    return !fclose(fh) && ok;
+}
+
+static void m35fd_deinit(struct hardware_t *hw) {
+    struct m35fd_t *drive = hw->data;
+    if (drive->disk) {
+        munmap(drive->words, DISK_BYTES);
+        disk_close(drive->disk);
+    }
+    free(drive);
+}
+
+// The fork maps the disk afresh and copies over whatever the parent wrote
+static int m35fd_clone(struct hardware_t *dst, struct hardware_t *src) {
+    struct m35fd_t *from = src->data, *drive = malloc(sizeof(struct m35fd_t));
+    if (!drive)
+        return 0;
+    *drive = *from;
+    if (from->disk) {
+        if (!(drive->words = map_disk(from->disk))) {
+            free(drive);
+            return 0;
+        }
+        for (int i = 0; i < SECTORS; i++)
+            if (from->dirty[i / 8] & 1 << i % 8)
+                memcpy(&drive->words[i * SECTOR_WORDS], &from->words[i * SECTOR_WORDS], SECTOR_WORDS * sizeof(uint16_t));
+        __atomic_add_fetch(&from->disk->refs, 1, __ATOMIC_RELAXED);
+    }
+    dst->data = drive;
+    return 1;
+}
+
+static int m35fd_init(struct hardware_t *hw) {
+    if (!(hw->data = calloc(1, sizeof(struct m35fd_t))))
+        return 0;
+    hw->id = 0x4fd524c5;
+    hw->version = 0x000b;
+    hw->manufacturer = 0x1eb37e91;
+    hw->interrupt = m35fd_interrupt;
+    hw->wake = m35fd_wake;
+    hw->deinit = m35fd_deinit;
+    hw->clone = m35fd_clone;
+    return 1;
+}
+
+struct hardware_t* m35fd_attach(struct cpu_t *cpu, struct disk_t *disk, int protect) {
+    if (!cpu_attach_hardware(cpu, m35fd_init))
+        return NULL;
+    struct hardware_t *hw = cpu->hardware[cpu->hardware_count - 1];
+    if (disk && !m35fd_insert(hw, disk, protect))
+        return NULL;
+    return hw;
+}
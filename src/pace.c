@@ -0,0 +1,206 @@
+/* pace.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Runs VMs in real time from one thread. Every VM owes frequency cycles per second of wall clock since the
+// run started, so each wakeup hands it the difference between that and cpu->cycles as one cpu_run batch.
+// Overshooting a batch by part of an instruction, a wakeup coming late or a pass running long all show up in
+// the next difference and are made up there, nothing accumulates. Wakeups are at absolute times on the
+// monotonic clock for the same reason, and between them the thread sleeps once for every VM together.
+//
+// A VM that falls more than MAX_BEHIND behind (the host can't keep up, or the process was stopped) gives
+// the excess up rather than race through it, its clock is moved on and the cycles counted as dropped.
+
+#define NSEC 1000000000ull
+#define MAX_BEHIND 4 // 1 / MAX_BEHIND seconds
+
+typedef struct {
+    struct cpu_t *cpu;
+    uint64_t frequency;
+    uint64_t base; // cpu->cycles the run started from, plus anything dropped
+    struct pace_stats_t stats;
+} paced_t;
+
+struct pace_t {
+    paced_t *vms;
+    int vm_count, vm_capacity;
+    uint64_t frequency, period; // Default clock rate, and nanoseconds between wakeups
+    int stopping;
+    struct pace_stats_t stats;
+};
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when) {
+#if defined(__APPLE__)
+    // No clock_nanosleep, close enough given the next deadline is absolute again
+    uint64_t current = now();
+    if (when > current) {
+        struct timespec ts = { (when - current) / NSEC, (when - current) % NSEC };
+        nanosleep(&ts, NULL);
+    }
+#else
+    struct timespec ts = { when / NSEC, when % NSEC };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#endif
+}
+
+// Cycles due after elapsed nanoseconds, split so days of running at any rate can't overflow
+static uint64_t due(uint64_t elapsed, uint64_t frequency) {
+    return elapsed / NSEC * frequency + elapsed % NSEC * frequency / NSEC;
+}
+
+struct pace_t* pace_create(uint64_t frequency, uint64_t period) {
+    struct pace_t *pace = calloc(1, sizeof(struct pace_t));
+    if (!pace)
+        return NULL;
+    pace->frequency = frequency ? frequency : 100000;
+    pace->period = period ? period : 10000000;
+    return pace;
+}
+
+void pace_destroy(struct pace_t *pace) {
+    if (!pace)
+        return;
+    for (int i = 0; i < pace->vm_count; i++)
+        cpu_destroy(pace->vms[i].cpu);
+    free(pace->vms);
+    free(pace);
+}
+
+int pace_add(struct pace_t *pace, struct cpu_t *cpu, uint64_t frequency) {
+    if (pace->vm_count == pace->vm_capacity) {
+        int capacity = pace->vm_capacity ? pace->vm_capacity * 2 : 64;
+        paced_t *vms = realloc(pace->vms, capacity * sizeof(paced_t));
+        if (!vms)
+            return -1;
+        pace->vms = vms;
+        pace->vm_capacity = capacity;
+    }
+    paced_t *vm = &pace->vms[pace->vm_count];
+    memset(vm, 0, sizeof(paced_t));
+    vm->cpu = cpu;
+    vm->frequency = frequency ? frequency : pace->frequency;
+    return pace->vm_count++;
+}
+
+void pace_stop(struct pace_t *pace) {
+    __atomic_store_n(&pace->stopping, 1, __ATOMIC_RELEASE);
+}
+
+static int stopped(struct cpu_t *cpu) {
+    return cpu->state == CPU_HALT || cpu->state == CPU_ON_FIRE;
+}
+
+int pace_run(struct pace_t *pace, double seconds) {
+    // Time spent outside of a run isn't owed
+    for (int i = 0; i < pace->vm_count; i++)
+        pace->vms[i].base = pace->vms[i].cpu->cycles;
+    __atomic_store_n(&pace->stopping, 0, __ATOMIC_RELAXED);
+    uint64_t start = now(), end = seconds > 0 ? start + (uint64_t)(seconds * NSEC) : UINT64_MAX;
+    uint64_t tick = start, wake = start; // When the pass was due and when it started
+    int live, watched = 0;
+    for (;;) {
+        uint64_t elapsed = wake - start;
+        live = 0;
+        for (int i = 0; i < pace->vm_count; i++) {
+            paced_t *vm = &pace->vms[i];
+            struct cpu_t *cpu = vm->cpu;
+            if (stopped(cpu))
+                continue;
+            uint64_t target = vm->base + due(elapsed, vm->frequency), limit = vm->frequency / MAX_BEHIND;
+            if (target > cpu->cycles + limit) {
+                uint64_t dropped = target - cpu->cycles - limit;
+                vm->base += dropped;
+                vm->stats.dropped += dropped;
+                target -= dropped;
+            }
+            if (target > cpu->cycles) {
+                uint64_t before = cpu->cycles;
+                vm->stats.stop = cpu_run(cpu, target - cpu->cycles);
+                watched |= vm->stats.stop == CPU_STOP_WATCH;
+                vm->stats.cycles += cpu->cycles - before;
+                vm->stats.batches++;
+            }
+            // Against the clock now rather than at the wakeup, VMs late in a long pass are further behind
+            uint64_t owed = vm->base + due(now() - start, vm->frequency);
+            vm->stats.lag = ((double)owed - (double)cpu->cycles) / vm->frequency;
+            if (vm->stats.lag > vm->stats.max_lag)
+                vm->stats.max_lag = vm->stats.lag;
+            live += !stopped(cpu);
+        }
+        uint64_t done = now();
+        pace->stats.seconds += (done - wake) / (double)NSEC;
+        // A watch hit ends the run like pace_stop, the rest of the pass keeps every VM on the same clock
+        if (!live || done >= end || watched || __atomic_load_n(&pace->stopping, __ATOMIC_ACQUIRE))
+            break;
+        // A pass that ran into the next wakeup goes straight on, the VMs catch up on their own
+        uint64_t next = tick + pace->period;
+        if (next <= done) {
+            pace->stats.overruns++;
+            tick = wake = done;
+            continue;
+        }
+        sleep_until(next < end ? next : end);
+        tick = next;
+        wake = now();
+        pace->stats.batches++;
+        if (wake > tick && wake - tick > pace->stats.late * NSEC)
+            pace->stats.late = (wake - tick) / (double)NSEC;
+    }
+    return live;
+}
+
+int pace_vm_stats(struct pace_t *pace, int vm, struct pace_stats_t *out) {
+    if (vm < 0 || vm >= pace->vm_count)
+        return 0;
+    *out = pace->vms[vm].stats;
+    return 1;
+}
+
+void pace_stats(struct pace_t *pace, struct pace_stats_t *out) {
+    *out = pace->stats;
+    out->cycles = out->dropped = 0;
+    out->lag = out->max_lag = 0;
+    for (int i = 0; i < pace->vm_count; i++) {
+        struct pace_stats_t *vm = &pace->vms[i].stats;
+        out->cycles += vm->cycles;
+        out->dropped += vm->dropped;
+        if (vm->lag > out->lag)
+            out->lag = vm->lag;
+        if (vm->max_lag > out->max_lag)
+            out->max_lag = vm->max_lag;
+    }
+}
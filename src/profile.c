@@ -0,0 +1,502 @@
+/* profile.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Cycles are charged to a call tree, nodes are a function entry reached through a call site from their
+// parent, and within a node to the PC that spent them. Calls are followed through JSR and SET PC, POP,
+// a return pops back to the frame it returns into (or is ignored when none matches, e.g. RFI).
+
+#define PROFILE_DEPTH 128
+
+enum { PC = 8, SP };
+enum { SET = 0x01 };
+enum { JSR = 0x01 };
+
+enum {
+    KIND_OTHER,
+    KIND_CALL,
+    KIND_RETURN
+};
+
+typedef struct {
+    int parent;
+    uint16_t site, entry;
+} node_t;
+
+typedef struct {
+    uint32_t node; // UINT32_MAX when empty
+    uint16_t pc;
+    uint64_t cycles;
+} cell_t;
+
+struct profile_t {
+    uint64_t period, next_sample, last_cycles;
+    uint32_t seed;
+    uint16_t last_pc, last_return;
+    int last_kind;
+    int node;
+    struct {
+        int node;
+        uint16_t ret;
+    } stack[PROFILE_DEPTH];
+    int depth;
+    node_t *nodes;
+    int node_count, node_capacity;
+    int *node_buckets; // Index + 1
+    uint32_t node_mask;
+    cell_t *cells;
+    uint32_t cell_count, cell_mask;
+    struct symbol_t *symbols;
+    int symbol_count;
+};
+
+static uint32_t mix(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ull;
+    return key >> 32;
+}
+
+static uint64_t node_key(int parent, uint16_t site, uint16_t entry) {
+    return (uint64_t)(uint32_t)parent << 32 | (uint32_t)site << 16 | entry;
+}
+
+static int grow_nodes(struct profile_t *p) {
+    uint32_t size = p->node_mask ? (p->node_mask + 1) * 2 : 256;
+    int *buckets = calloc(size, sizeof(int));
+    if (!buckets)
+        return 0;
+    for (int i = 0; i < p->node_count; i++) {
+        node_t *n = &p->nodes[i];
+        uint32_t slot = mix(node_key(n->parent, n->site, n->entry)) & (size - 1);
+        while (buckets[slot])
+            slot = (slot + 1) & (size - 1);
+        buckets[slot] = i + 1;
+    }
+    free(p->node_buckets);
+    p->node_buckets = buckets;
+    p->node_mask = size - 1;
+    return 1;
+}
+
+// Returns the child of parent for a call from site to entry, or parent if it can't be added
+static int find_node(struct profile_t *p, int parent, uint16_t site, uint16_t entry) {
+    uint64_t key = node_key(parent, site, entry);
+    uint32_t slot = mix(key) & p->node_mask;
+    for (; p->node_buckets[slot]; slot = (slot + 1) & p->node_mask) {
+        node_t *n = &p->nodes[p->node_buckets[slot] - 1];
+        if (node_key(n->parent, n->site, n->entry) == key)
+            return p->node_buckets[slot] - 1;
+    }
+    if (p->node_count == p->node_capacity) {
+        int capacity = p->node_capacity * 2;
+        node_t *nodes = realloc(p->nodes, capacity * sizeof(node_t));
+        if (!nodes)
+            return parent;
+        p->nodes = nodes;
+        p->node_capacity = capacity;
+    }
+    int index = p->node_count++;
+    p->nodes[index] = (node_t){ parent, site, entry };
+    if ((uint32_t)p->node_count * 2 > p->node_mask) {
+        if (!grow_nodes(p)) {
+            p->node_count--;
+            return parent;
+        }
+    } else
+        p->node_buckets[slot] = index + 1;
+    return index;
+}
+
+static int grow_cells(struct profile_t *p) {
+    uint32_t size = (p->cell_mask + 1) * 2;
+    cell_t *cells = malloc(size * sizeof(cell_t));
+    if (!cells)
+        return 0;
+    for (uint32_t i = 0; i < size; i++)
+        cells[i].node = UINT32_MAX;
+    for (uint32_t i = 0; i <= p->cell_mask; i++) {
+        if (p->cells[i].node == UINT32_MAX)
+            continue;
+        uint32_t slot = mix((uint64_t)p->cells[i].node << 16 | p->cells[i].pc) & (size - 1);
+        while (cells[slot].node != UINT32_MAX)
+            slot = (slot + 1) & (size - 1);
+        cells[slot] = p->cells[i];
+    }
+    free(p->cells);
+    p->cells = cells;
+    p->cell_mask = size - 1;
+    return 1;
+}
+
+static void charge(struct profile_t *p, int node, uint16_t pc, uint64_t cycles) {
+    uint32_t slot = mix((uint64_t)node << 16 | pc) & p->cell_mask;
+    for (; p->cells[slot].node != UINT32_MAX; slot = (slot + 1) & p->cell_mask)
+        if (p->cells[slot].node == (uint32_t)node && p->cells[slot].pc == pc) {
+            p->cells[slot].cycles += cycles;
+            return;
+        }
+    if ((p->cell_count + 1) * 2 > p->cell_mask && grow_cells(p)) {
+        charge(p, node, pc, cycles);
+        return;
+    }
+    if (p->cell_count == p->cell_mask)
+        return; // Full and couldn't grow, drop it
+    p->cells[slot] = (cell_t){ node, pc, cycles };
+    p->cell_count++;
+}
+
+static void call(struct profile_t *p, uint16_t site, uint16_t entry, uint16_t ret) {
+    if (p->depth == PROFILE_DEPTH)
+        return;
+    p->stack[p->depth].node = p->node;
+    p->stack[p->depth++].ret = ret;
+    p->node = find_node(p, p->node, site, entry);
+}
+
+static void ret(struct profile_t *p, uint16_t pc) {
+    for (int i = p->depth - 1; i >= 0; i--)
+        if (p->stack[i].ret == pc) {
+            p->node = p->stack[i].node;
+            p->depth = i;
+            return;
+        }
+}
+
+// Sampling intervals are jittered around the period so loops can't alias with it
+static uint64_t interval(struct profile_t *p) {
+    if (!p->period)
+        return 0;
+    p->seed ^= p->seed << 13;
+    p->seed ^= p->seed >> 17;
+    p->seed ^= p->seed << 5;
+    return p->period / 2 + p->seed % (p->period + 1);
+}
+
+// Called before every instruction the interpreter executes while profiling
+void profile_record(struct cpu_t *cpu, const struct instruction_t *ins) {
+    struct profile_t *p = cpu->profile;
+    uint16_t pc = cpu->reg[PC];
+    // The previous instruction ran in the frame it started in, when sampling it takes all since the last sample
+    if (!p->period || cpu->cycles >= p->next_sample) {
+        charge(p, p->node, p->last_pc, cpu->cycles - p->last_cycles);
+        p->last_cycles = cpu->cycles;
+        p->next_sample = cpu->cycles + interval(p);
+    }
+    if (p->last_kind == KIND_CALL)
+        call(p, p->last_pc, pc, p->last_return);
+    else if (p->last_kind == KIND_RETURN)
+        ret(p, pc);
+
+    p->last_pc = pc;
+    p->last_return = pc + ins->length;
+    if (ins->op == (0x20 | JSR))
+        p->last_kind = KIND_CALL;
+    else if (ins->op == SET && ins->b == 0x1C && ins->a == 0x18)
+        p->last_kind = KIND_RETURN;
+    else
+        p->last_kind = KIND_OTHER;
+}
+
+int cpu_profile_start(struct cpu_t *cpu, uint64_t period) {
+    if (cpu->profile)
+        return 0;
+    struct profile_t *p = calloc(1, sizeof(struct profile_t));
+    if (!p)
+        return 0;
+    p->node_capacity = 256;
+    p->cell_mask = 4095;
+    if (!(p->nodes = malloc(p->node_capacity * sizeof(node_t))) ||
+        !(p->cells = malloc((p->cell_mask + 1) * sizeof(cell_t))) ||
+        !grow_nodes(p))
+        goto FAIL;
+    for (uint32_t i = 0; i <= p->cell_mask; i++)
+        p->cells[i].node = UINT32_MAX;
+    // The root is wherever execution was when profiling started
+    p->nodes[0] = (node_t){ -1, 0, cpu->reg[PC] };
+    p->node_count = 1;
+    p->period = period;
+    p->seed = 2463534242u;
+    p->next_sample = cpu->cycles + interval(p);
+    p->last_cycles = cpu->cycles;
+    p->last_pc = cpu->reg[PC];
+    cpu->profile = p;
+    return 1;
+
+FAIL:
+    free(p->nodes);
+    free(p->cells);
+    free(p);
+    return 0;
+}
+
+static void free_symbols(struct profile_t *p) {
+    for (int i = 0; i < p->symbol_count; i++)
+        free((char*)p->symbols[i].name);
+    free(p->symbols);
+    p->symbols = NULL;
+    p->symbol_count = 0;
+}
+
+static int compare_symbols(const void *x, const void *y) {
+    const struct symbol_t *a = x, *b = y;
+    return a->address - b->address;
+}
+
+int cpu_profile_symbols(struct cpu_t *cpu, const struct symbol_t *symbols, int count) {
+    struct profile_t *p = cpu->profile;
+    if (!p)
+        return 0;
+    free_symbols(p);
+    if (!(p->symbols = malloc((count ? count : 1) * sizeof(struct symbol_t))))
+        return 0;
+    for (; p->symbol_count < count; p->symbol_count++) {
+        p->symbols[p->symbol_count].address = symbols[p->symbol_count].address;
+        if (!(p->symbols[p->symbol_count].name = strdup(symbols[p->symbol_count].name))) {
+            free_symbols(p);
+            return 0;
+        }
+    }
+    qsort(p->symbols, count, sizeof(struct symbol_t), compare_symbols);
+    return 1;
+}
+
+// Functions are named by the label at their entry, or the address when there isn't one
+static const char* symbol(struct profile_t *p, uint16_t address, char fallback[8]) {
+    int low = 0, high = p->symbol_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (p->symbols[mid].address == address)
+            return p->symbols[mid].name;
+        if (p->symbols[mid].address < address)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    snprintf(fallback, 8, "0x%04x", address);
+    return fallback;
+}
+
+// Charge what the current instruction has run so far, so a profile can be written mid-run
+static void settle(struct cpu_t *cpu, struct profile_t *p) {
+    if (!p->period && cpu->cycles > p->last_cycles) {
+        charge(p, p->node, p->last_pc, cpu->cycles - p->last_cycles);
+        p->last_cycles = cpu->cycles;
+    }
+}
+
+static int write_folded(struct profile_t *p, FILE *out) {
+    uint64_t *cycles = calloc(p->node_count, sizeof(uint64_t));
+    if (!cycles)
+        return 0;
+    for (uint32_t i = 0; i <= p->cell_mask; i++)
+        if (p->cells[i].node != UINT32_MAX)
+            cycles[p->cells[i].node] += p->cells[i].cycles;
+    int path[PROFILE_DEPTH + 1];
+    for (int i = 0; i < p->node_count; i++) {
+        if (!cycles[i])
+            continue;
+        int depth = 0;
+        for (int n = i; n >= 0 && depth <= PROFILE_DEPTH; n = p->nodes[n].parent)
+            path[depth++] = n;
+        while (depth--) {
+            char fallback[8];
+            fputs(symbol(p, p->nodes[path[depth]].entry, fallback), out);
+            fputc(depth ? ';' : ' ', out);
+        }
+        fprintf(out, "%llu\n", (unsigned long long)cycles[i]);
+    }
+    free(cycles);
+    return 1;
+}
+
+// Just enough protobuf to write the pprof Profile message (github.com/google/pprof/blob/main/proto/profile.proto)
+typedef struct {
+    uint8_t *data;
+    size_t used, capacity;
+    int failed;
+} buffer_t;
+
+static void put_raw(buffer_t *b, const void *data, size_t size) {
+    if (b->used + size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        while (capacity < b->used + size)
+            capacity *= 2;
+        uint8_t *grown = realloc(b->data, capacity);
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->used, data, size);
+    b->used += size;
+}
+
+static void put_varint(buffer_t *b, uint64_t value) {
+    uint8_t bytes[10];
+    int n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    bytes[n++] = value;
+    put_raw(b, bytes, n);
+}
+
+static void put_uint(buffer_t *b, int field, uint64_t value) {
+    put_varint(b, field << 3);
+    put_varint(b, value);
+}
+
+static void put_bytes(buffer_t *b, int field, const void *data, size_t size) {
+    put_varint(b, field << 3 | 2);
+    put_varint(b, size);
+    put_raw(b, data, size);
+}
+
+// Moves a finished submessage into its parent
+static void put_message(buffer_t *b, int field, buffer_t *message) {
+    put_bytes(b, field, message->data, message->used);
+    b->failed |= message->failed;
+    message->used = 0;
+}
+
+// Locations are a PC inside a function, ids are index + 1
+typedef struct {
+    uint32_t *keys;
+    uint32_t mask, count;
+} locations_t;
+
+static uint32_t location(locations_t *l, buffer_t *out, buffer_t *scratch, buffer_t *line, uint16_t pc, uint16_t entry) {
+    uint32_t key = (uint32_t)pc << 16 | entry;
+    uint32_t slot = mix(key) & l->mask;
+    for (; l->keys[slot]; slot = (slot + 1) & l->mask)
+        if (l->keys[slot + l->mask + 1] == key)
+            return l->keys[slot];
+    l->keys[slot] = ++l->count;
+    l->keys[slot + l->mask + 1] = key;
+    put_uint(line, 1, entry + 1); // function_id
+    put_uint(scratch, 1, l->count); // id
+    put_uint(scratch, 3, pc); // address
+    put_message(scratch, 4, line); // line
+    put_message(out, 4, scratch); // location
+    return l->count;
+}
+
+static int write_pprof(struct profile_t *p, FILE *out) {
+    int result = 0;
+    buffer_t b = { 0 }, scratch = { 0 }, line = { 0 }, ids = { 0 };
+    locations_t l = { 0 };
+    uint8_t *used = calloc(0x10000 / 8, 1);
+    // Every cell is its own location at most, plus a call site per node
+    uint32_t size = 16;
+    while (size < (p->cell_count + p->node_count) * 2)
+        size <<= 1;
+    l.mask = size - 1;
+    if (!used || !(l.keys = calloc(size * 2, sizeof(uint32_t))))
+        goto END;
+
+    // String 0 has to be empty, 1 and 2 are the sample type, function names follow from 3
+    put_bytes(&b, 6, "", 0);
+    put_bytes(&b, 6, "cycles", 6);
+    put_bytes(&b, 6, "count", 5);
+    put_uint(&scratch, 1, 1);
+    put_uint(&scratch, 2, 2);
+    put_message(&b, 1, &scratch);
+
+    for (uint32_t i = 0; i <= p->cell_mask; i++) {
+        cell_t *cell = &p->cells[i];
+        if (cell->node == UINT32_MAX || !cell->cycles)
+            continue;
+        // Leaf first, then each call site up to the root
+        int n = cell->node, depth = 0;
+        put_varint(&ids, location(&l, &b, &scratch, &line, cell->pc, p->nodes[n].entry));
+        used[p->nodes[n].entry >> 3] |= 1 << (p->nodes[n].entry & 7);
+        for (; p->nodes[n].parent >= 0 && depth++ < PROFILE_DEPTH; n = p->nodes[n].parent) {
+            uint16_t entry = p->nodes[p->nodes[n].parent].entry;
+            put_varint(&ids, location(&l, &b, &scratch, &line, p->nodes[n].site, entry));
+            used[entry >> 3] |= 1 << (entry & 7);
+        }
+        put_message(&scratch, 1, &ids); // location_id, packed
+        put_varint(&ids, cell->cycles);
+        put_message(&scratch, 2, &ids); // value, packed
+        put_message(&b, 2, &scratch);
+    }
+
+    int string = 3;
+    for (int entry = 0; entry < 0x10000; entry++) {
+        if (!(used[entry >> 3] & (1 << (entry & 7))))
+            continue;
+        char fallback[8];
+        const char *name = symbol(p, entry, fallback);
+        put_bytes(&b, 6, name, strlen(name));
+        put_uint(&scratch, 1, entry + 1); // id
+        put_uint(&scratch, 2, string++); // name
+        put_uint(&scratch, 5, entry); // start_line, the entry address
+        put_message(&b, 5, &scratch);
+    }
+    put_uint(&b, 12, p->period ? p->period : 1); // period
+    put_uint(&scratch, 1, 1);
+    put_uint(&scratch, 2, 1);
+    put_message(&b, 11, &scratch); // period_type, cycles
+
+    result = !b.failed && !scratch.failed && !line.failed && !ids.failed &&
+             fwrite(b.data, 1, b.used, out) == b.used;
+END:
+    free(b.data);
+    free(scratch.data);
+    free(line.data);
+    free(ids.data);
+    free(l.keys);
+    free(used);
+    return result;
+}
+
+int cpu_profile_write(struct cpu_t *cpu, const char *path, enum cpu_profile_format format) {
+    struct profile_t *p = cpu->profile;
+    if (!p)
+        return 0;
+    FILE *out = fopen(path, "wb");
+    if (!out)
+        return 0;
+    settle(cpu, p);
+    int result = format == CPU_PROFILE_PPROF ? write_pprof(p, out) : write_folded(p, out);
+    return fclose(out) == 0 && result;
+}
+
+void cpu_profile_stop(struct cpu_t *cpu) {
+    struct profile_t *p = cpu->profile;
+    if (!p)
+        return;
+    cpu->profile = NULL;
+    free_symbols(p);
+    free(p->nodes);
+    free(p->node_buckets);
+    free(p->cells);
+    free(p);
+}
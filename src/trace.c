@@ -0,0 +1,415 @@
+/* trace.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The CPU thread appends a record per instruction to a single-producer single-consumer ring of words and
+// never waits, if the ring is full the record is dropped and counted. A writer thread drains the ring,
+// packs the records and writes them out. Records in the ring:
+//
+//   flags     length << 14 | GAP | LONG | mask of registers changed since the last record (PC excluded)
+//   GAP       u32 records dropped, nothing else
+//   otherwise pc, length instruction words, cycles since the last record (two words with LONG), registers
+//
+// A record's register changes and cycles are what the previous instruction did, a final record with no
+// instruction carries the last one's. In the file every record starts with a tag byte:
+//
+//   header    "CCPUTRC1", u64 cycles at the start, 12 * u16 registers
+//   tag       length | PC (pc doesn't follow on from the last) | CODE (words differ from the last seen at pc)
+//             | REGS | GAP
+//   GAP       varint records dropped
+//   otherwise [u16 pc], [length * u16], varint cycles, [varint mask, mask-selected zigzag varint deltas]
+//
+// Multi-byte fixed width values are little endian.
+
+#define MAGIC "CCPUTRC1"
+#define RING_WORDS (1 << 21)
+#define RECORD_WORDS 18
+#define TRACE_BUFFER 65536
+#define REG_MASK 0x0EFF // Every register but PC
+
+enum { PC = 8 };
+
+enum {
+    FLAG_LONG = 1 << 12,
+    FLAG_GAP = 1 << 13
+};
+
+enum {
+    TAG_PC = 1 << 2,
+    TAG_CODE = 1 << 3,
+    TAG_REGS = 1 << 4,
+    TAG_GAP = 1 << 5
+};
+
+struct trace_t {
+    // Producer side, only touched by the CPU's thread
+    uint16_t reg[12];
+    uint64_t cycles;
+    uint32_t head, cached_tail;
+    uint32_t dropped;
+    char padding[64];
+    // Shared
+    uint32_t published, consumed;
+    int done;
+    uint16_t *ring;
+
+    // Writer side
+    pthread_t thread;
+    FILE *file;
+    uint8_t *buffer;
+    size_t used;
+    int failed;
+    uint16_t shadow[12];
+    uint16_t pc, length;
+    uint16_t (*code)[3];
+    uint8_t *seen;
+};
+
+static void put_ring(struct trace_t *t, uint16_t value) {
+    t->ring[t->head++ & (RING_WORDS - 1)] = value;
+}
+
+// Called before every instruction the interpreter executes while tracing
+void trace_record(struct cpu_t *cpu, const struct instruction_t *ins) {
+    struct trace_t *t = cpu->trace;
+    if (RING_WORDS - (t->head - t->cached_tail) < RECORD_WORDS * 2) {
+        t->cached_tail = __atomic_load_n(&t->consumed, __ATOMIC_ACQUIRE);
+        if (RING_WORDS - (t->head - t->cached_tail) < RECORD_WORDS * 2) {
+            t->dropped++;
+            return;
+        }
+    }
+    if (t->dropped) {
+        put_ring(t, FLAG_GAP);
+        put_ring(t, t->dropped & 0xFFFF);
+        put_ring(t, t->dropped >> 16);
+        t->dropped = 0;
+    }
+    uint16_t mask = 0;
+    for (int i = 0; i < 12; i++)
+        mask |= (cpu->reg[i] != t->reg[i]) << i;
+    mask &= REG_MASK;
+    uint64_t delta = cpu->cycles - t->cycles;
+    t->cycles = cpu->cycles;
+    uint16_t length = ins ? ins->length : 0;
+    put_ring(t, length << 14 | (delta > 0xFFFF ? FLAG_LONG : 0) | mask);
+    put_ring(t, cpu->reg[PC]);
+    for (int i = 0; i < length; i++)
+        put_ring(t, cpu->memory[(uint16_t)(cpu->reg[PC] + i)]);
+    if (delta > 0xFFFF) {
+        if (delta > 0xFFFFFFFF)
+            delta = 0xFFFFFFFF;
+        put_ring(t, delta >> 16);
+    }
+    put_ring(t, delta & 0xFFFF);
+    for (int i = 0; mask; i++, mask >>= 1)
+        if (mask & 1) {
+            put_ring(t, cpu->reg[i]);
+            t->reg[i] = cpu->reg[i];
+        }
+    __atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+}
+
+static void flush(struct trace_t *t) {
+    if (t->used && fwrite(t->buffer, 1, t->used, t->file) != t->used)
+        t->failed = 1;
+    t->used = 0;
+}
+
+static void put8(struct trace_t *t, uint8_t value) {
+    t->buffer[t->used++] = value;
+}
+
+static void put16(struct trace_t *t, uint16_t value) {
+    put8(t, value & 0xFF);
+    put8(t, value >> 8);
+}
+
+static void put_varint(struct trace_t *t, uint64_t value) {
+    while (value >= 0x80) {
+        put8(t, (value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    put8(t, value);
+}
+
+// Packs one record from the ring, returns the position after it
+static uint32_t pack(struct trace_t *t, uint32_t at) {
+#define GET() t->ring[at++ & (RING_WORDS - 1)]
+    if (TRACE_BUFFER - t->used < 64)
+        flush(t);
+    uint16_t flags = GET();
+    if (flags & FLAG_GAP) {
+        uint32_t dropped = GET();
+        dropped |= (uint32_t)GET() << 16;
+        put8(t, TAG_GAP);
+        put_varint(t, dropped);
+        // Whatever was dropped, the next pc can't be predicted
+        t->length = 0xFFFF;
+        return at;
+    }
+    uint16_t length = flags >> 14, mask = flags & REG_MASK, pc = GET(), code[3];
+    uint8_t tag = length | (mask ? TAG_REGS : 0);
+    for (int i = 0; i < length; i++)
+        code[i] = GET();
+    if (pc != (uint16_t)(t->pc + t->length))
+        tag |= TAG_PC;
+    if (length && (!(t->seen[pc >> 3] & (1 << (pc & 7))) || memcmp(t->code[pc], code, length * 2))) {
+        tag |= TAG_CODE;
+        memcpy(t->code[pc], code, length * 2);
+        t->seen[pc >> 3] |= 1 << (pc & 7);
+    }
+    put8(t, tag);
+    if (tag & TAG_PC)
+        put16(t, pc);
+    if (tag & TAG_CODE)
+        for (int i = 0; i < length; i++)
+            put16(t, code[i]);
+    uint32_t cycles = GET();
+    if (flags & FLAG_LONG)
+        cycles = cycles << 16 | GET();
+    put_varint(t, cycles);
+    if (mask) {
+        put_varint(t, mask);
+        for (int i = 0; i < 12; i++)
+            if (mask & (1 << i)) {
+                uint16_t value = GET();
+                uint16_t delta = value - t->shadow[i];
+                put_varint(t, (uint16_t)(delta << 1 ^ -(delta >> 15))); // Zigzag, small steps either way stay short
+                t->shadow[i] = value;
+            }
+    }
+    t->pc = pc;
+    t->length = length;
+    return at;
+#undef GET
+}
+
+static void* writer_main(void *arg) {
+    struct trace_t *t = arg;
+    uint32_t at = t->consumed;
+    for (;;) {
+        int done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+        uint32_t end = __atomic_load_n(&t->published, __ATOMIC_ACQUIRE);
+        if (at == end) {
+            if (done)
+                break;
+            // Polled rather than signalled so the CPU thread never makes a system call
+            struct timespec pause = { 0, 200000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        while (at != end)
+            at = pack(t, at);
+        __atomic_store_n(&t->consumed, at, __ATOMIC_RELEASE);
+    }
+    flush(t);
+    return NULL;
+}
+
+int cpu_trace_start(struct cpu_t *cpu, const char *path) {
+    if (cpu->trace)
+        return 0;
+    struct trace_t *t = calloc(1, sizeof(struct trace_t));
+    if (!t)
+        return 0;
+    if (!(t->file = fopen(path, "wb")) ||
+        !(t->ring = malloc(RING_WORDS * sizeof(uint16_t))) ||
+        !(t->buffer = malloc(TRACE_BUFFER)) ||
+        !(t->code = malloc(0x10000 * sizeof(*t->code))) ||
+        !(t->seen = calloc(0x10000 / 8, 1)))
+        goto FAIL;
+    memcpy(t->buffer, MAGIC, 8);
+    t->used = 8;
+    for (int i = 0; i < 8; i++)
+        put8(t, (cpu->cycles >> (i * 8)) & 0xFF);
+    for (int i = 0; i < 12; i++)
+        put16(t, cpu->reg[i]);
+    memcpy(t->reg, cpu->reg, sizeof(cpu->reg));
+    memcpy(t->shadow, cpu->reg, sizeof(cpu->reg));
+    t->cycles = cpu->cycles;
+    t->length = 0xFFFF;
+    if (pthread_create(&t->thread, NULL, writer_main, t))
+        goto FAIL;
+    cpu->trace = t;
+    return 1;
+
+FAIL:
+    if (t->file)
+        fclose(t->file);
+    free(t->ring);
+    free(t->buffer);
+    free(t->code);
+    free(t->seen);
+    free(t);
+    return 0;
+}
+
+int cpu_trace_stop(struct cpu_t *cpu) {
+    struct trace_t *t = cpu->trace;
+    if (!t)
+        return 1;
+    // Make room for what the last instruction did
+    struct timespec pause = { 0, 200000 };
+    while (__atomic_load_n(&t->consumed, __ATOMIC_ACQUIRE) != t->head)
+        nanosleep(&pause, NULL);
+    trace_record(cpu, NULL);
+    cpu->trace = NULL;
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+    // Closed even after a failed write
+    int closed = fclose(t->file) == 0;
+    int result = closed && !t->failed;
+    free(t->ring);
+    free(t->buffer);
+    free(t->code);
+    free(t->seen);
+    free(t);
+    return result;
+}
+
+static void* map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+typedef struct {
+    const uint8_t *data;
+    size_t size, at;
+} reader_t;
+
+static uint8_t get8(reader_t *r) {
+    return r->at < r->size ? r->data[r->at++] : 0;
+}
+
+static uint16_t get16(reader_t *r) {
+    uint16_t value = get8(r);
+    return value | get8(r) << 8;
+}
+
+static uint64_t get_varint(reader_t *r) {
+    uint64_t value = 0;
+    for (int shift = 0; r->at < r->size && shift < 64; shift += 7) {
+        uint8_t byte = r->data[r->at++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return value;
+}
+
+static void print_line(FILE *out, uint64_t cycles, uint16_t pc, uint16_t *code, uint16_t mask, uint16_t *reg) {
+    static const char *names[12] = { "A", "B", "C", "X", "Y", "Z", "I", "J", "PC", "SP", "EX", "IA" };
+    char text[32];
+    disassemble(code, text);
+    fprintf(out, mask ? "%10llu %04x %-28s" : "%10llu %04x %s", (unsigned long long)cycles, pc, text);
+    for (int i = 0; i < 12; i++)
+        if (mask & (1 << i))
+            fprintf(out, " %s=%04x", names[i], reg[i]);
+    fputc('\n', out);
+}
+
+long trace_decode(const char *path, FILE *out) {
+    reader_t r = { 0 };
+    if (!(r.data = map_file(path, &r.size)))
+        return -1;
+    long count = -1;
+    uint16_t (*cache)[3] = calloc(0x10000, sizeof(*cache));
+    if (!cache || r.size < 40 || memcmp(r.data, MAGIC, 8))
+        goto END;
+    r.at = 8;
+    uint64_t cycles = 0;
+    for (int i = 0; i < 8; i++)
+        cycles |= (uint64_t)get8(&r) << (i * 8);
+    uint16_t reg[12], pc = 0, length = 0xFFFF;
+    for (int i = 0; i < 12; i++)
+        reg[i] = get16(&r);
+
+    // Each line is printed once the next record says what the instruction changed
+    int pending = 0;
+    uint16_t last_pc = 0, last_code[3];
+    uint64_t last_cycles = 0, dropped = 0;
+    count = 0;
+    while (r.at < r.size) {
+        uint8_t tag = get8(&r);
+        if (tag & TAG_GAP) {
+            dropped += get_varint(&r);
+            length = 0xFFFF;
+            continue;
+        }
+        uint16_t this_length = tag & 3, mask = 0;
+        pc = tag & TAG_PC ? get16(&r) : pc + length;
+        length = this_length;
+        if (tag & TAG_CODE)
+            for (int i = 0; i < length; i++)
+                cache[pc][i] = get16(&r);
+        cycles += get_varint(&r);
+        if (tag & TAG_REGS) {
+            mask = get_varint(&r) & REG_MASK;
+            for (int i = 0; i < 12; i++)
+                if (mask & (1 << i)) {
+                    uint16_t zigzag = get_varint(&r);
+                    reg[i] += (zigzag >> 1) ^ -(zigzag & 1);
+                }
+        }
+        if (pending) {
+            print_line(out, last_cycles, last_pc, last_code, mask, reg);
+            count++;
+        }
+        if (dropped) {
+            fprintf(out, "; %llu instructions dropped\n", (unsigned long long)dropped);
+            dropped = 0;
+        }
+        pending = length > 0;
+        last_pc = pc;
+        last_cycles = cycles;
+        memcpy(last_code, cache[pc], sizeof(last_code));
+    }
+
+END:
+    free(cache);
+    munmap((void*)r.data, r.size);
+    return count;
+}
@@ -0,0 +1,208 @@
+/* watch.c -- https://github.com/takeiteasy/mir2
+ 
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 George Watson
+ 
+ Permission is hereby granted, free of charge, to any person
+ obtaining a copy of this software and associated documentation
+ files (the "Software"), to deal in the Software without restriction,
+ including without limitation the rights to use, copy, modify, merge,
+ publish, distribute, sublicense, and/or sell copies of the Software,
+ and to permit persons to whom the Software is furnished to do so,
+ subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be
+ included in all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "ccpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Breakpoints and write watchpoints hang off the page flags cpu.c already keeps, so nothing is checked for
+// pages without one. A breakpoint marks its page and the instruction decoded there is flagged in the
+// instruction cache, which cpu_run only looks at on the path fused instructions already take. Writes to a
+// watched page go through the same trap as writes to code and are compared against a shadow copy of the
+// watched words, so the old value is known and devices or the host writing (through cpu_invalidate) are
+// caught too. Hits wait here until cpu_run reaches the next instruction boundary, then it reports them and
+// returns CPU_STOP_WATCH.
+
+#define MAX_PENDING 16
+
+struct watch_t {
+    void(*callback)(struct cpu_t *cpu, const struct cpu_watch_hit_t *hit, void *userdata);
+    void *userdata;
+    uint64_t breaks[0x10000 / 64];
+    uint64_t watched[0x10000 / 64];
+    uint16_t break_count[CPU_PAGE_COUNT];
+    uint16_t watch_count[CPU_PAGE_COUNT];
+    // Where the last breakpoint stopped, running again from there executes the instruction
+    uint16_t resume_pc;
+    uint64_t resume_cycles;
+    int resuming;
+    struct cpu_watch_hit_t pending[MAX_PENDING];
+    int pending_count;
+    uint16_t shadow[0x10000];
+};
+
+// cpu.c
+void watch_flag(struct cpu_t *cpu, uint16_t address, int breakpoint, int set);
+void watch_redecode(struct cpu_t *cpu, uint16_t pc);
+
+static int test(const uint64_t *bits, uint16_t address) {
+    return bits[address >> 6] >> (address & 63) & 1;
+}
+
+static void queue(struct cpu_t *cpu, enum cpu_watch_kind kind, uint16_t address, uint16_t old, uint16_t new) {
+    struct watch_t *watch = cpu->watch;
+    if (watch->pending_count == MAX_PENDING)
+        return;
+    // The interpreter notices at its next check for posted interrupts
+    if (!watch->pending_count)
+        __atomic_add_fetch(&cpu->posted_pending, 1, __ATOMIC_RELEASE);
+    watch->pending[watch->pending_count++] = (struct cpu_watch_hit_t) {
+        .kind = kind,
+        .address = address,
+        .old_value = old,
+        .new_value = new,
+        .pc = cpu->reg[8],
+        .cycles = cpu->cycles
+    };
+}
+
+// Called from cpu.c for writes to watched pages
+void watch_written(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch)
+        return;
+    for (uint32_t i = 0; i < count && i < 0x10000; i++) {
+        uint16_t at = address + i;
+        if (test(watch->watched, at) && cpu->memory[at] != watch->shadow[at]) {
+            queue(cpu, CPU_WATCH_WRITE, at, watch->shadow[at], cpu->memory[at]);
+            watch->shadow[at] = cpu->memory[at];
+        }
+    }
+}
+
+int watch_breakpoint(struct cpu_t *cpu, uint16_t pc) {
+    return cpu->watch && test(cpu->watch->breaks, pc);
+}
+
+// Called from cpu_run at a flagged instruction, returns 1 to stop before it
+int watch_break(struct cpu_t *cpu, uint16_t pc) {
+    struct watch_t *watch = cpu->watch;
+    if (watch->resuming && watch->resume_pc == pc && watch->resume_cycles == cpu->cycles) {
+        watch->resuming = 0;
+        return 0;
+    }
+    queue(cpu, CPU_WATCH_BREAK, pc, cpu->memory[pc], cpu->memory[pc]);
+    watch->resuming = 1;
+    watch->resume_pc = pc;
+    watch->resume_cycles = cpu->cycles;
+    return 1;
+}
+
+int watch_pending(struct cpu_t *cpu) {
+    return cpu->watch && cpu->watch->pending_count;
+}
+
+// Called from cpu_run at the boundary after a hit
+void watch_report(struct cpu_t *cpu) {
+    struct watch_t *watch = cpu->watch;
+    struct cpu_watch_hit_t hits[MAX_PENDING];
+    int count = watch->pending_count;
+    memcpy(hits, watch->pending, count * sizeof(struct cpu_watch_hit_t));
+    watch->pending_count = 0;
+    __atomic_sub_fetch(&cpu->posted_pending, 1, __ATOMIC_RELEASE);
+    // The callback may arm or disarm watches, even stop watching
+    void(*callback)(struct cpu_t*, const struct cpu_watch_hit_t*, void*) = watch->callback;
+    void *userdata = watch->userdata;
+    for (int i = 0; i < count && callback; i++)
+        callback(cpu, &hits[i], userdata);
+}
+
+int cpu_watch_start(struct cpu_t *cpu, void(*callback)(struct cpu_t*, const struct cpu_watch_hit_t*, void*),
+                    void *userdata) {
+    if (!cpu->watch && !(cpu->watch = calloc(1, sizeof(struct watch_t))))
+        return 0;
+    cpu->watch->callback = callback;
+    cpu->watch->userdata = userdata;
+    return 1;
+}
+
+void cpu_watch_stop(struct cpu_t *cpu) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch)
+        return;
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        if (test(watch->breaks, i))
+            cpu_unbreak(cpu, i);
+        if (test(watch->watched, i))
+            cpu_unwatch(cpu, i, 1);
+    }
+    if (watch->pending_count)
+        __atomic_sub_fetch(&cpu->posted_pending, 1, __ATOMIC_RELEASE);
+    free(watch);
+    cpu->watch = NULL;
+}
+
+int cpu_break(struct cpu_t *cpu, uint16_t pc) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch)
+        return 0;
+    if (!test(watch->breaks, pc)) {
+        watch->breaks[pc >> 6] |= 1ull << (pc & 63);
+        if (!watch->break_count[pc >> CPU_PAGE_SHIFT]++)
+            watch_flag(cpu, pc, 1, 1);
+        watch_redecode(cpu, pc);
+    }
+    return 1;
+}
+
+void cpu_unbreak(struct cpu_t *cpu, uint16_t pc) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch || !test(watch->breaks, pc))
+        return;
+    watch->breaks[pc >> 6] &= ~(1ull << (pc & 63));
+    if (!--watch->break_count[pc >> CPU_PAGE_SHIFT])
+        watch_flag(cpu, pc, 1, 0);
+    watch_redecode(cpu, pc);
+}
+
+int cpu_watch(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch)
+        return 0;
+    for (uint32_t i = 0; i < count && i < 0x10000; i++) {
+        uint16_t at = address + i;
+        if (test(watch->watched, at))
+            continue;
+        watch->watched[at >> 6] |= 1ull << (at & 63);
+        watch->shadow[at] = cpu->memory[at];
+        if (!watch->watch_count[at >> CPU_PAGE_SHIFT]++)
+            watch_flag(cpu, at, 0, 1);
+    }
+    return 1;
+}
+
+void cpu_unwatch(struct cpu_t *cpu, uint16_t address, uint32_t count) {
+    struct watch_t *watch = cpu->watch;
+    if (!watch)
+        return;
+    for (uint32_t i = 0; i < count && i < 0x10000; i++) {
+        uint16_t at = address + i;
+        if (!test(watch->watched, at))
+            continue;
+        watch->watched[at >> 6] &= ~(1ull << (at & 63));
+        if (!--watch->watch_count[at >> CPU_PAGE_SHIFT])
+            watch_flag(cpu, at, 0, 0);
+    }
+}
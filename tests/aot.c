@@ -0,0 +1,45 @@
+//
+//  aot.c
+//  ccpu
+//
+//  Translates a firmware image to C ahead of time, see aot_translate. Compile the output with the program
+//  and pass the named struct to cpu_aot_enable after loading the same image.
+//
+//  usage: aot [-l] image.bin name [entry...] > name.c
+//         -l for little endian words, entries in hex (0 if none are given)
+//
+
+#include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, const char *argv[]) {
+    int little = argc > 1 && !strcmp(argv[1], "-l");
+    argv += little;
+    argc -= little;
+    if (argc < 3) {
+        fprintf(stderr, "usage: aot [-l] image.bin name [entry...] > name.c\n");
+        return 1;
+    }
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu)
+        return 1;
+    if (cpu_load_image(cpu, argv[1], little ? CPU_IMAGE_LITTLE_ENDIAN : CPU_IMAGE_BIG_ENDIAN) < 0) {
+        fprintf(stderr, "aot: can't load %s\n", argv[1]);
+        cpu_destroy(cpu);
+        return 1;
+    }
+    uint16_t entries[256];
+    int count = 0;
+    for (int i = 3; i < argc && count < 256; i++)
+        entries[count++] = strtol(argv[i], NULL, 16);
+    int blocks = aot_translate(cpu->memory, entries, count, argv[2], stdout);
+    cpu_destroy(cpu);
+    if (blocks < 0) {
+        fprintf(stderr, "aot: translation failed\n");
+        return 1;
+    }
+    fprintf(stderr, "aot: %d blocks\n", blocks);
+    return 0;
+}
@@ -0,0 +1,285 @@
+//
+//  bench.c
+//  ccpu
+//
+//  Guest workloads plus assembler and disassembler throughput, one JSON object per line so runs can be
+//  diffed or loaded elsewhere. Every workload is deterministic and runs for a fixed number of cycles,
+//  each figure is the median of the repeats.
+//
+//  usage: bench [cycles per workload] [repeats]
+//
+
+#include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    const char *src;
+    int(*attach)(struct cpu_t *cpu);
+} workload_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *x, const void *y) {
+    double a = *(const double*)x, b = *(const double*)y;
+    return (a > b) - (a < b);
+}
+
+static double median(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+// Raises an interrupt every 50 cycles
+static void clock_wake(struct hardware_t *hw) {
+    cpu_interrupt(hw->cpu, 0x10);
+    cpu_schedule_at(hw, hw->deadline + 50);
+}
+
+static int clock_init(struct hardware_t *hw) {
+    hw->id = 0x12d0b402;
+    hw->wake = clock_wake;
+    cpu_schedule(hw, 50);
+    return 1;
+}
+
+// HWI fills 64 words at B with a counter, like a disk sector arriving
+static void disk_interrupt(struct hardware_t *hw) {
+    struct cpu_t *cpu = hw->cpu;
+    uint16_t address = cpu->reg[1];
+    for (int i = 0; i < 64; i++)
+        cpu->memory[(uint16_t)(address + i)] = cpu->reg[0] + i;
+    cpu_invalidate(cpu, address, 64);
+}
+
+static int disk_init(struct hardware_t *hw) {
+    hw->id = 0x4fd524c5;
+    hw->interrupt = disk_interrupt;
+    return 1;
+}
+
+static int attach_clock(struct cpu_t *cpu) {
+    return cpu_attach_hardware(cpu, clock_init);
+}
+
+static int attach_devices(struct cpu_t *cpu) {
+    return cpu_attach_hardware(cpu, disk_init) && cpu_attach_hardware(cpu, clock_init);
+}
+
+static const workload_t workloads[] = {
+    {"alu",
+     ":loop ADD A, 3\n"
+     "      XOR B, A\n"
+     "      SHL C, 1\n"
+     "      BOR C, B\n"
+     "      MUL X, A\n"
+     "      SUB Y, X\n"
+     "      SET PC, loop\n", NULL},
+    {"memcpy",
+     ":top  SET I, 0x8000\n"
+     "      SET J, 0x4000\n"
+     ":copy STI [I], [J]\n"
+     "      IFN I, 0x9000\n"
+     "      SET PC, copy\n"
+     "      SET PC, top\n", NULL},
+    {"recursion",
+     ":top  SET A, 18\n"
+     "      JSR fib\n"
+     "      SET PC, top\n"
+     ":fib  IFL A, 2\n"
+     "      SET PC, POP\n"
+     "      SET PUSH, A\n"
+     "      SUB A, 1\n"
+     "      JSR fib\n"
+     "      SET B, POP\n"
+     "      SET PUSH, A\n"
+     "      SET A, B\n"
+     "      SUB A, 2\n"
+     "      JSR fib\n"
+     "      ADD A, POP\n"
+     "      SET PC, POP\n", NULL},
+    {"branches",
+     ":loop ADD I, 1\n"
+     "      SET A, I\n"
+     "      AND A, 7\n"
+     "      IFE A, 0\n"
+     "      ADD X, 1\n"
+     "      IFE A, 1\n"
+     "      ADD Y, 1\n"
+     "      IFG A, 3\n"
+     "      IFL A, 6\n"
+     "      ADD Z, 1\n"
+     "      IFN A, 7\n"
+     "      SET PC, loop\n"
+     "      ADD J, 1\n"
+     "      SET PC, loop\n", NULL},
+    {"interrupts",
+     "      IAS handler\n"
+     ":loop INT 1\n"
+     "      ADD B, 1\n"
+     "      SET PC, loop\n"
+     ":handler ADD C, A\n"
+     "      RFI 0\n", attach_clock},
+    {"devices",
+     "      IAS handler\n"
+     ":loop SET B, 0x8000\n"
+     "      HWI 0\n"
+     "      ADD A, [0x803f]\n"
+     "      SET PC, loop\n"
+     ":handler ADD C, 1\n"
+     "      RFI 0\n", attach_devices},
+};
+
+enum {
+    MODE_STEP,
+    MODE_RUN,
+    MODE_JIT
+};
+
+static const char *modes[] = { "step", "run", "jit" };
+
+// Returns seconds taken, or a negative value if the mode isn't available
+static double run_workload(const workload_t *w, int mode, uint64_t cycles, uint64_t *instructions) {
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu)
+        abort();
+    if (assemble(w->src, cpu->memory) < 0 || (w->attach && !w->attach(cpu)))
+        abort();
+    if (mode == MODE_JIT && !cpu_jit_enable(cpu)) {
+        cpu_destroy(cpu);
+        return -1;
+    }
+    uint64_t end = cpu->cycles + cycles, count = 0;
+    double start = now();
+    if (mode == MODE_STEP)
+        while (cpu->cycles < end && cpu->state != CPU_HALT && cpu->state != CPU_ON_FIRE) {
+            cpu_step(cpu);
+            count++;
+        }
+    else
+        cpu_run(cpu, cycles);
+    double seconds = now() - start;
+    if (cpu->state == CPU_HALT || cpu->state == CPU_ON_FIRE) {
+        fprintf(stderr, "%s stopped early in %s mode\n", w->name, modes[mode]);
+        abort();
+    }
+    *instructions = count;
+    cpu_destroy(cpu);
+    return seconds;
+}
+
+static void bench_workload(const workload_t *w, uint64_t cycles, int repeats) {
+    double *times = malloc(repeats * sizeof(double));
+    uint64_t step_instructions = 0;
+    for (int mode = MODE_STEP; mode <= MODE_JIT; mode++) {
+        uint64_t instructions = 0;
+        int i;
+        for (i = 0; i < repeats; i++)
+            if ((times[i] = run_workload(w, mode, cycles, &instructions)) < 0)
+                break;
+        if (i < repeats)
+            continue;
+        // Only stepping counts instructions, the runs are deterministic so they execute the same ones
+        if (mode == MODE_STEP)
+            step_instructions = instructions;
+        double seconds = median(times, repeats);
+        printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"cycles\": %llu, \"instructions\": %llu, "
+               "\"seconds\": %.6f, \"mips\": %.3f, \"cycles_per_second\": %.0f}\n",
+               w->name, modes[mode], (unsigned long long)cycles, (unsigned long long)step_instructions,
+               seconds, step_instructions / seconds / 1e6, cycles / seconds);
+    }
+    free(times);
+}
+
+// Looks like generated code, every routine calls the next
+static char* generate_source(int routines, size_t *length) {
+    size_t capacity = routines * 256 + 1;
+    char *src = malloc(capacity);
+    if (!src)
+        abort();
+    size_t used = 0;
+    for (int i = 0; i < routines; i++)
+        used += snprintf(src + used, capacity - used,
+                         ":routine%d SET A, 0x%x ; load\n"
+                         "    ADD [B+0x%x], %d\n"
+                         "    IFE A, B\n"
+                         "    JSR routine%d\n"
+                         "    SET PC, POP\n",
+                         i, i * 7 & 0xFFFF, i & 0xFFF, i % 40, (i + 1) % routines);
+    *length = used;
+    return src;
+}
+
+static void bench_assemble(int repeats) {
+    static uint16_t image[0x10000];
+    size_t length;
+    char *src = generate_source(6000, &length);
+    double *times = malloc(repeats * sizeof(double));
+    int words = 0;
+    for (int i = 0; i < repeats; i++) {
+        double start = now();
+        if ((words = assemble(src, image)) < 0)
+            abort();
+        times[i] = now() - start;
+    }
+    double seconds = median(times, repeats);
+    printf("{\"bench\": \"assemble\", \"bytes\": %zu, \"words\": %d, \"seconds\": %.6f, "
+           "\"bytes_per_second\": %.0f, \"words_per_second\": %.0f}\n",
+           length, words, seconds, length / seconds, words / seconds);
+    free(times);
+    free(src);
+}
+
+static void bench_disassemble(int repeats) {
+    static uint16_t image[0x10002];
+    static char text[40 * 0x10000 + 1];
+    uint32_t seed = 1;
+    for (int i = 0; i < 0x10002; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+    double *times = malloc(repeats * sizeof(double));
+    uint64_t instructions = 0;
+    for (int i = 0; i < repeats; i++) {
+        char line[32];
+        instructions = 0;
+        double start = now();
+        for (int pc = 0; pc < 0x10000; pc += disassemble(&image[pc], line))
+            instructions++;
+        times[i] = now() - start;
+    }
+    double seconds = median(times, repeats);
+    printf("{\"bench\": \"disassemble\", \"instructions\": %llu, \"seconds\": %.6f, \"instructions_per_second\": %.0f}\n",
+           (unsigned long long)instructions, seconds, instructions / seconds);
+
+    long chars = 0;
+    for (int i = 0; i < repeats; i++) {
+        double start = now();
+        if ((chars = disassemble_image(image, 0, 0x10000, text, sizeof(text))) < 0)
+            abort();
+        times[i] = now() - start;
+    }
+    seconds = median(times, repeats);
+    printf("{\"bench\": \"disassemble_image\", \"words\": %d, \"bytes\": %ld, \"seconds\": %.6f, \"words_per_second\": %.0f}\n",
+           0x10000, chars, seconds, 0x10000 / seconds);
+    free(times);
+}
+
+int main(int argc, const char *argv[]) {
+    uint64_t cycles = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000000;
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+    if (!cycles || repeats <= 0)
+        return 1;
+    for (int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        bench_workload(&workloads[i], cycles, repeats);
+    bench_assemble(repeats);
+    bench_disassemble(repeats);
+    return 0;
+}
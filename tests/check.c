@@ -0,0 +1,606 @@
+//
+//  check.c
+//  ccpu
+//
+//  Differential checks. Every way of running a program has to end where stepping it one instruction at a
+//  time does: registers, cycles, state, interrupt queue and memory. The programs are generated, random
+//  instruction mixes with jumps, calls and interrupts plus a few structured ones with fusable loops, and
+//  each runs alone and with a device that rewrites code and interrupts as it goes. Watching has to stop at
+//  every hit without changing where a run ends, and an interrupt posted from another thread has to land while
+//  the JIT loops. The LEM1802's frames are compared with drawing every pixel straight from the spec.
+//
+//  usage: check [-t translated.c]
+//
+//  -t writes every program translated ahead of time to translated.c and exits. A second build with that file
+//  and -DCHECK_AOT runs the translations as well, `make check` does both
+//
+
+#include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PROGRAMS 60
+#define CYCLES 200000
+#define LANES 48
+
+static int failures;
+
+static uint32_t seed;
+
+static uint32_t next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static const char *structured[] = {
+    // Interrupts, calls and most of the instruction set, depending on the registers it starts with
+    "      IAS handler\n"
+    ":top  SET I, A\n"
+    "      AND I, 15\n"
+    ":loop ADD B, I\n"
+    "      MUL C, B\n"
+    "      IFG B, 100\n"
+    "      SUB B, 50\n"
+    "      IFB A, 1\n"
+    "      JSR odd\n"
+    "      SHR X, I\n"
+    "      SHL Y, A\n"
+    "      ASR Z, 3\n"
+    "      DVI C, A\n"
+    "      DIV X, B\n"
+    "      MDI Y, C\n"
+    "      ADX Z, EX\n"
+    "      SBX EX, A\n"
+    "      SET [0x1000+I], C\n"
+    "      STI [0x2000], [0x1000+J]\n"
+    "      IFE I, 7\n"
+    "      INT 3\n"
+    "      SUB I, 1\n"
+    "      IFN I, 0xffff\n"
+    "      SET PC, loop\n"
+    "      ADD A, 1\n"
+    "      SET PC, top\n"
+    ":odd  XOR A, 0x5555\n"
+    "      SET PUSH, A\n"
+    "      ADD [SP], PC\n"
+    "      SET A, POP\n"
+    "      SET PC, POP\n"
+    ":handler ADD [0x3000], A\n"
+    "      INT 9\n"
+    "      RFI 0\n",
+    // Store loops the interpreter runs fused
+    "      SET C, 0x400\n"
+    ":seed SET [0x4000+C], C\n"
+    "      SUB C, 1\n"
+    "      IFN C, 0\n"
+    "      SET PC, seed\n"
+    ":top  SET I, 0x8000\n"
+    "      SET J, 0x4000\n"
+    ":copy STI [I], [J]\n"
+    "      IFN I, 0x8400\n"
+    "      SET PC, copy\n"
+    "      SET C, 0x300\n"
+    ":fill SET [0x5000+C], [0x4000+C]\n"
+    "      SUB C, 1\n"
+    "      IFN C, 0\n"
+    "      SET PC, fill\n"
+    "      SET I, 0x6000\n"
+    "      SET J, 0x6100\n"
+    ":back STD [J], [I]\n"
+    "      IFN J, 0x6000\n"
+    "      SET PC, back\n"
+    "      SET B, 0\n"
+    ":up   SET [0x7000+B], A\n"
+    "      ADD B, 1\n"
+    "      IFN B, 40\n"
+    "      SET PC, up\n"
+    "      ADD A, 0x21\n"
+    "      ADD [0x4000+A], B\n"
+    "      SET PC, top\n",
+};
+
+#define STRUCTURED (int)(sizeof(structured) / sizeof(structured[0]))
+
+// An address in the program, a small number, somewhere on the screen or anything
+static uint16_t random_word(int size) {
+    switch (next_random() % 4) {
+        case 0:  return next_random() % size;
+        case 1:  return next_random() % 16;
+        case 2:  return 0x8000 + next_random() % 64;
+        default: return next_random();
+    }
+}
+
+static int has_word(uint8_t v) {
+    return (v >= 0x10 && v < 0x18) || v == 0x1A || v == 0x1E || v == 0x1F;
+}
+
+// The same program every time for the same number
+static void generate(int program, uint16_t memory[0x10000]) {
+    memset(memory, 0, 0x10000 * sizeof(uint16_t));
+    if (program < STRUCTURED) {
+        if (assemble(structured[program], memory) < 0)
+            abort();
+        return;
+    }
+    seed = program * 2654435761u + 1;
+    static const uint8_t ops[] = {
+        0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+        0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x1a, 0x1b, 0x1e, 0x1f
+    };
+    int size = (int[]){ 60, 200, 400 }[next_random() % 3];
+    for (int pc = 0; pc < size;) {
+        int r = next_random() % 100;
+        if (r < 10) { // SET PC, somewhere
+            memory[pc++] = 0x1F << 10 | 0x1C << 5 | 0x01;
+            memory[pc++] = next_random() % size;
+        } else if (r < 13) { // JSR
+            memory[pc++] = 0x1F << 10 | 0x01 << 5;
+            memory[pc++] = next_random() % size;
+        } else if (r < 15) // SET PC, POP
+            memory[pc++] = 0x18 << 10 | 0x1C << 5 | 0x01;
+        else if (r < 17) // INT 0
+            memory[pc++] = 0x21 << 10 | 0x08 << 5;
+        else if (r < 18) // IAS 0xffff
+            memory[pc++] = 0x20 << 10 | 0x0A << 5;
+        else {
+            uint8_t op = ops[next_random() % sizeof(ops)];
+            uint8_t b = next_random() % 10 < 3 ? next_random() % 0x20 : next_random() % 8;
+            uint8_t a = next_random() % 0x40;
+            if (b == 0x1C && next_random() % 10 < 7)
+                b = 0;
+            memory[pc++] = a << 10 | b << 5 | op;
+            if (has_word(a))
+                memory[pc++] = random_word(size);
+            if (has_word(b))
+                memory[pc++] = random_word(size);
+        }
+    }
+}
+
+static struct cpu_t* create(const uint16_t memory[0x10000]) {
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu)
+        abort();
+    memcpy(cpu->memory, memory, 0x10000 * sizeof(uint16_t));
+    cpu_invalidate(cpu, 0, 0x10000);
+    return cpu;
+}
+
+// Flips a bit in the first 64 words (where the code is) and interrupts every 997 cycles
+static void rewriter_wake(struct hardware_t *hw) {
+    struct cpu_t *cpu = hw->cpu;
+    uint16_t address = hw->deadline * 7 % 64;
+    cpu->memory[address] ^= 1;
+    cpu_invalidate(cpu, address, 1);
+    cpu_interrupt(cpu, 3);
+    cpu_schedule_at(hw, hw->deadline + 997);
+}
+
+static int rewriter_init(struct hardware_t *hw) {
+    hw->id = 0x6c6c0001;
+    hw->wake = rewriter_wake;
+    cpu_schedule(hw, 997);
+    return 1;
+}
+
+static int same(const struct cpu_t *x, const struct cpu_t *y) {
+    return !memcmp(x->reg, y->reg, sizeof(x->reg)) && x->cycles == y->cycles && x->state == y->state &&
+           x->iaq_count == y->iaq_count && !memcmp(x->memory, y->memory, 0x10000 * sizeof(uint16_t));
+}
+
+static void fail(const char *check, int program, const struct cpu_t *expected, const struct cpu_t *got) {
+    fprintf(stderr, "%s: program %d differs, pc %04x/%04x cycles %llu/%llu state %d/%d\n", check, program,
+            expected->reg[8], got->reg[8], (unsigned long long)expected->cycles, (unsigned long long)got->cycles,
+            expected->state, got->state);
+    failures++;
+}
+
+static void failed(const char *what) {
+    fprintf(stderr, "%s\n", what);
+    failures++;
+}
+
+static int stopped(const struct cpu_t *cpu) {
+    return cpu->state == CPU_HALT || cpu->state == CPU_ON_FIRE;
+}
+
+// One instruction at a time, what everything else is compared with
+static void step(struct cpu_t *cpu, uint64_t cycles) {
+    uint64_t end = cpu->cycles + cycles;
+    while (cpu->cycles < end && !stopped(cpu))
+        cpu_step(cpu);
+}
+
+// Random budgets, forking halfway through. Returns the CPU it finished on
+static struct cpu_t* chunked(struct cpu_t *cpu, uint64_t cycles) {
+    uint64_t end = cpu->cycles + cycles;
+    int forked = 0;
+    while (cpu->cycles < end && !stopped(cpu)) {
+        uint64_t budget = next_random() % 4 ? next_random() % 500 + 1 : 1;
+        cpu_run(cpu, budget < end - cpu->cycles ? budget : end - cpu->cycles);
+        if (!forked && cpu->cycles >= end / 2) {
+            struct cpu_t *child = cpu_fork(cpu);
+            if (!child)
+                abort();
+            cpu_destroy(cpu);
+            cpu = child;
+            forked = 1;
+        }
+    }
+    return cpu;
+}
+
+enum {
+    MODE_RUN,
+    MODE_CHUNKED,
+    MODE_JIT,
+    MODE_AOT,
+    MODE_AOT_CHUNKED,
+    MODES
+};
+
+static const char *modes[] = { "run", "chunked", "jit", "aot", "aot chunked" };
+
+// Built by a second pass with -DCHECK_AOT, see translate
+#if defined(CHECK_AOT)
+extern const struct cpu_aot_t *const check_translated[PROGRAMS];
+static const struct cpu_aot_t *const *translated = check_translated;
+#else
+static const struct cpu_aot_t *const *translated = NULL;
+#endif
+
+static int jit_available = -1;
+
+// Stepping against one run, random chunks, the JIT and translated code, each alone and with the rewriter
+static int check_modes(void) {
+    static uint16_t memory[0x10000];
+    int runs = 0;
+    for (int program = 0; program < PROGRAMS; program++) {
+        generate(program, memory);
+        for (int device = 0; device < 2; device++) {
+            struct cpu_t *expected = create(memory), *cpu;
+            if (device && !cpu_attach_hardware(expected, rewriter_init))
+                abort();
+            step(expected, CYCLES);
+            for (int mode = 0; mode < MODES; mode++) {
+                cpu = create(memory);
+                if (device && !cpu_attach_hardware(cpu, rewriter_init))
+                    abort();
+                int available = 1;
+                if (mode == MODE_JIT)
+                    available = jit_available = cpu_jit_enable(cpu);
+                else if (mode == MODE_AOT || mode == MODE_AOT_CHUNKED)
+                    available = translated && cpu_aot_enable(cpu, translated[program]);
+                if (!available) {
+                    cpu_destroy(cpu);
+                    continue;
+                }
+                seed = program * 31 + device;
+                if (mode == MODE_CHUNKED || mode == MODE_AOT_CHUNKED)
+                    cpu = chunked(cpu, CYCLES);
+                else
+                    cpu_run(cpu, CYCLES);
+                if (!same(expected, cpu))
+                    fail(modes[mode], program, expected, cpu);
+                cpu_destroy(cpu);
+                runs++;
+            }
+            cpu_destroy(expected);
+        }
+    }
+    return runs;
+}
+
+static void* post_later(void *cpu) {
+    nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+    cpu_post_interrupt(cpu, 0x1234);
+    return NULL;
+}
+
+// An interrupt posted from another thread lands while the JIT loops natively, not once the budget is spent
+static uint64_t check_posted(void) {
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu || assemble("      IAS handler\n"
+                         ":loop ADD X, 1\n"
+                         "      IFE X, 0\n"
+                         "      ADD Y, 1\n"
+                         "      SET PC, loop\n"
+                         ":handler SET Z, A\n"
+                         "      DAT 0\n", cpu->memory) < 0)
+        abort();
+    cpu_invalidate(cpu, 0, 0x10000);
+    if (!cpu_jit_enable(cpu)) {
+        cpu_destroy(cpu);
+        return 0;
+    }
+    pthread_t poster;
+    if (pthread_create(&poster, NULL, post_later, cpu))
+        abort();
+    enum cpu_stop stop = cpu_run(cpu, 1000000000);
+    pthread_join(poster, NULL);
+    // The post comes 20ms in, a native loop gets through the whole budget in a few hundred
+    if (stop != CPU_STOP_HALT || cpu->reg[5] != 0x1234 || cpu->cycles >= 1000000000 / 2)
+        failed("posted: interrupt waited for the budget");
+    uint64_t cycles = cpu->cycles;
+    cpu_destroy(cpu);
+    return cycles;
+}
+
+// Runs HWI device with A and B set, as the guest would
+static void hwi(struct cpu_t *cpu, uint16_t device, uint16_t a, uint16_t b) {
+    cpu->reg[0] = a;
+    cpu->reg[1] = b;
+    cpu->reg[8] = 0xF000;
+    cpu->memory[0xF000] = (0x21 + device) << 10 | 0x12 << 5;
+    cpu_invalidate(cpu, 0xF000, 1);
+    cpu_step(cpu);
+}
+
+static uint32_t rgba(uint16_t colour) {
+    return (colour >> 8 & 15) * 17 | (colour >> 4 & 15) * 17 << 8 | (colour & 15) * 17 << 16 | 0xFFu << 24;
+}
+
+// Pixel by pixel from the spec, font and palette 0 for the defaults the display dumped
+static void draw(const struct cpu_t *cpu, uint16_t screen, uint16_t font, uint16_t palette, int blink,
+                 const uint16_t *default_font, const uint16_t *default_palette, uint32_t *frame) {
+    for (int y = 0; y < LEM1802_HEIGHT; y++)
+        for (int x = 0; x < LEM1802_WIDTH; x++) {
+            uint16_t cell = cpu->memory[(uint16_t)(screen + y / 8 * 32 + x / 4)], glyph = cell & 0x7F;
+            uint16_t half = font ? cpu->memory[(uint16_t)(font + glyph * 2 + x % 4 / 2)]
+                                 : default_font[glyph * 2 + x % 4 / 2];
+            int on = (x % 2 ? half : half >> 8) >> y % 8 & 1 && (!(cell & 0x80) || blink);
+            int colour = on ? cell >> 12 : cell >> 8 & 15;
+            frame[y * LEM1802_WIDTH + x] = rgba(palette ? cpu->memory[(uint16_t)(palette + colour)]
+                                                        : default_palette[colour]);
+        }
+}
+
+// Random frames with the screen, font and palette edited and remapped (wrapping round memory), blinking,
+// against the reference drawing. Returns the frames compared
+static int check_lem1802(void) {
+    static uint32_t expected[LEM1802_WIDTH * LEM1802_HEIGHT];
+    uint16_t default_font[256], default_palette[16];
+    struct cpu_t *cpu = cpu_create();
+    struct hardware_t *display;
+    if (!cpu || !(display = lem1802_attach(cpu)))
+        abort();
+    int cells, frames = 0;
+    const uint32_t *frame = lem1802_render(display, 1, &cells);
+    if (cells || frame[0])
+        failed("lem1802: drew before a screen was mapped");
+    hwi(cpu, 0, 4, 0x7000);
+    hwi(cpu, 0, 5, 0x7100);
+    memcpy(default_font, &cpu->memory[0x7000], sizeof(default_font));
+    memcpy(default_palette, &cpu->memory[0x7100], sizeof(default_palette));
+
+    uint16_t screen = 0x8000, font = 0, palette = 0;
+    hwi(cpu, 0, 0, screen);
+    seed = 3;
+    for (; frames < 3000; frames++) {
+        int r = next_random() % 100;
+        if (r < 60)
+            for (int n = next_random() % 5; n > 0; n--)
+                cpu->memory[(uint16_t)(screen + next_random() % 384)] = next_random();
+        else if (r < 66 && font)
+            cpu->memory[(uint16_t)(font + next_random() % 256)] = next_random();
+        else if (r < 70 && palette)
+            cpu->memory[(uint16_t)(palette + next_random() % 16)] = next_random();
+        else if (r < 72)
+            hwi(cpu, 0, 1, font = next_random() % 3 ? 0xFF80 + next_random() % 8 : 0);
+        else if (r < 74)
+            hwi(cpu, 0, 2, palette = next_random() % 3 ? 0x9000 : 0);
+        else if (r < 75)
+            hwi(cpu, 0, 0, screen = next_random() % 5 ? 0x8000 + next_random() % 0x100 : 0xFF00);
+        int blink = frames / 7 % 2;
+        frame = lem1802_render(display, blink, &cells);
+        draw(cpu, screen, font, palette, blink, default_font, default_palette, expected);
+        if (memcmp(frame, expected, sizeof(expected))) {
+            fprintf(stderr, "lem1802: frame %d differs\n", frames);
+            failures++;
+            break;
+        }
+    }
+    lem1802_render(display, 0, NULL);
+    if (lem1802_render(display, 0, &cells) && cells)
+        failed("lem1802: redrew cells with nothing changed");
+
+    // A fork's display carries on from the parent's frame
+    struct cpu_t *child = cpu_fork(cpu);
+    if (!child)
+        abort();
+    frame = lem1802_render(child->hardware[0], 0, &cells);
+    draw(child, screen, font, palette, 0, default_font, default_palette, expected);
+    if (cells || memcmp(frame, expected, sizeof(expected)))
+        failed("lem1802: a fork drew a different frame");
+    cpu_destroy(child);
+
+    hwi(cpu, 0, 0, 0);
+    frame = lem1802_render(display, 0, &cells);
+    if (cells || frame[LEM1802_WIDTH * LEM1802_HEIGHT / 2])
+        failed("lem1802: not blank once disconnected");
+    cpu_destroy(cpu);
+    return frames;
+}
+
+typedef struct {
+    int breaks, writes, wrong;
+} hits_t;
+
+static void count_hit(struct cpu_t *cpu, const struct cpu_watch_hit_t *hit, void *userdata) {
+    hits_t *hits = userdata;
+    if (hit->kind == CPU_WATCH_BREAK) {
+        hits->breaks++;
+        hits->wrong += cpu->reg[8] != hit->address || hit->cycles != cpu->cycles;
+    } else {
+        hits->writes++;
+        hits->wrong += hit->old_value == hit->new_value || hit->cycles > cpu->cycles;
+    }
+}
+
+static void watch_words(struct cpu_t *cpu) {
+    if (!cpu_watch(cpu, 0x0000, 64) || !cpu_watch(cpu, 0x8000, 64) || !cpu_watch(cpu, 0xFFF0, 16))
+        abort();
+}
+
+// Watched words the last step changed
+static int changed(const struct cpu_t *cpu, uint16_t *before) {
+    static const uint16_t ranges[][2] = { { 0x0000, 64 }, { 0x8000, 64 }, { 0xFFF0, 16 } };
+    int count = 0;
+    for (int i = 0; i < 3; i++)
+        for (uint32_t a = ranges[i][0]; a < ranges[i][0] + ranges[i][1]; a++) {
+            count += cpu->memory[a] != before[a];
+            before[a] = cpu->memory[a];
+        }
+    return count;
+}
+
+// Watching stops the run at every hit but changes nothing else: resumed until the budget is spent, a watched
+// run ends where stepping does with a hit for each change to a watched word. Returns the stops
+static int check_watch(void) {
+    static uint16_t memory[0x10000], before[0x10000];
+    int stops = 0;
+    hits_t hits = {0};
+
+    // A hit from the last instruction of a budget stops that run, not the next one
+    struct cpu_t *cpu = cpu_create();
+    if (!cpu || assemble("SET A, 5\nSET [0x2000], A\n:loop ADD [0x2000], 1\nSET PC, loop\n", cpu->memory) < 0)
+        abort();
+    cpu_invalidate(cpu, 0, 0x10000);
+    cpu_watch_start(cpu, count_hit, &hits);
+    cpu_watch(cpu, 0x2000, 1);
+    if (cpu_run(cpu, 3) != CPU_STOP_WATCH || hits.writes != 1 || cpu->cycles != 3)
+        failed("watch: the budget's last write wasn't reported by its run");
+    if (cpu_run(cpu, 4) != CPU_STOP_WATCH || cpu->cycles != 6 || hits.writes != 2)
+        failed("watch: the run after a hit didn't execute");
+    // Stepping sees every write and never loses a step to one
+    for (int i = 0; i < 100; i++) {
+        uint64_t cycles = cpu->cycles;
+        cpu_step(cpu);
+        if (cpu->cycles == cycles) {
+            failed("watch: a step didn't execute");
+            break;
+        }
+    }
+    if (hits.writes != 52 || hits.wrong)
+        failed("watch: stepping missed writes");
+    cpu_destroy(cpu);
+
+    for (int program = 0; program < PROGRAMS; program++) {
+        generate(program, memory);
+        for (int device = 0; device < 2; device++) {
+            struct cpu_t *expected = create(memory);
+            if (device && !cpu_attach_hardware(expected, rewriter_init))
+                abort();
+            int writes = 0;
+            memcpy(before, memory, sizeof(before));
+            for (uint64_t end = CYCLES; expected->cycles < end && !stopped(expected);) {
+                cpu_step(expected);
+                writes += changed(expected, before);
+            }
+
+            cpu = create(memory);
+            if (device && !cpu_attach_hardware(cpu, rewriter_init))
+                abort();
+            memset(&hits, 0, sizeof(hits));
+            cpu_watch_start(cpu, count_hit, &hits);
+            watch_words(cpu);
+            seed = program;
+            for (int i = 0; i < 3; i++)
+                cpu_break(cpu, i ? next_random() % 64 : 0);
+            while (cpu->cycles < CYCLES && !stopped(cpu))
+                stops += cpu_run(cpu, CYCLES - cpu->cycles) == CPU_STOP_WATCH;
+            // The rewriter can write a word the same step's instruction writes again, two hits for one change
+            if (!same(expected, cpu))
+                fail("watch", program, expected, cpu);
+            else if ((!device && hits.writes != writes) || hits.wrong) {
+                fprintf(stderr, "watch: program %d reported %d writes, stepping made %d\n", program,
+                        hits.writes, writes);
+                failures++;
+            }
+            cpu_destroy(cpu);
+            cpu_destroy(expected);
+        }
+    }
+    return stops;
+}
+
+// Writes every program translated by aot_translate to path, with the table a build with -DCHECK_AOT expects
+static int translate(const char *path) {
+    static uint16_t memory[0x10000];
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return 0;
+    for (int program = 0; program < PROGRAMS; program++) {
+        char name[32];
+        snprintf(name, sizeof(name), "program_%d", program);
+        generate(program, memory);
+        if (aot_translate(memory, NULL, 0, name, out) < 0) {
+            fclose(out);
+            return 0;
+        }
+    }
+    fprintf(out, "const struct cpu_aot_t *const check_translated[] = {\n");
+    for (int program = 0; program < PROGRAMS; program++)
+        fprintf(out, "    &program_%d,\n", program);
+    fprintf(out, "};\n");
+    return fclose(out) == 0;
+}
+
+// Every lane of a batch starts from different registers and has to match cpu_run from the same start
+static int check_batch(void) {
+    static uint16_t memory[0x10000];
+    int runs = 0;
+    for (int program = 0; program < PROGRAMS; program++) {
+        generate(program, memory);
+        struct cpu_t *base = create(memory);
+        struct batch_t *batch = batch_create(base, LANES);
+        if (!batch)
+            abort();
+        uint16_t start[LANES][8];
+        seed = program * 17 + 5;
+        for (int lane = 0; lane < LANES; lane++)
+            for (int r = 0; r < 8; r++)
+                batch_set_register(batch, lane, r, start[lane][r] = lane % 2 ? next_random() : lane * 7 + r);
+        // Twice, so lanes that went their own way pick up again where they stopped
+        uint64_t budget = CYCLES / 10 + next_random() % CYCLES;
+        batch_run(batch, budget);
+        batch_run(batch, budget / 3);
+        struct cpu_t *got = cpu_create();
+        if (!got)
+            abort();
+        for (int lane = 0; lane < LANES; lane++, runs++) {
+            struct cpu_t *expected = create(memory);
+            memcpy(expected->reg, start[lane], sizeof(start[lane]));
+            cpu_run(expected, budget);
+            cpu_run(expected, budget / 3);
+            batch_export(batch, lane, got);
+            if (!same(expected, got))
+                fail("batch", program, expected, got);
+            cpu_destroy(expected);
+        }
+        cpu_destroy(got);
+        batch_destroy(batch);
+        cpu_destroy(base);
+    }
+    return runs;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc == 3 && !strcmp(argv[1], "-t"))
+        return !translate(argv[2]);
+    int runs = check_modes();
+    printf("modes: %d runs%s%s\n", runs, jit_available ? "" : ", no JIT on this target",
+           translated ? "" : ", no translated code (build with -DCHECK_AOT)");
+    printf("posted: %llu cycles\n", (unsigned long long)check_posted());
+    printf("batch: %d lanes\n", check_batch());
+    printf("watch: %d stops\n", check_watch());
+    printf("lem1802: %d frames\n", check_lem1802());
+    printf("%d failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,241 @@
+//
+//  fuzz.c
+//  ccpu
+//
+//  Coverage-guided fuzzing of a firmware image. Guest edges (see cpu_coverage_start) go into the fuzzer's
+//  own map and each input starts from a snapshot taken once the firmware is loaded, so a reset only copies
+//  back the pages the last input wrote.
+//
+//  libFuzzer:  clang -fsanitize=fuzzer -DLIBFUZZER -Isrc tests/fuzz.c src/*.c
+//  AFL++:      afl-clang-fast -Isrc tests/fuzz.c src/*.c, persistent mode, inputs on stdin
+//  neither:    cc -Isrc tests/fuzz.c src/*.c, runs the inputs named on the command line (triage) and
+//              reports executions per second
+//
+//  FUZZ_IMAGE   firmware loaded at 0, required
+//  FUZZ_ORDER   "big" (default) or "little" endian words in FUZZ_IMAGE
+//  FUZZ_INPUT   "keyboard" (default) types the input on a generic keyboard one key every FUZZ_KEY_CYCLES
+//               (1000), or a hex address to copy the input into memory at
+//  FUZZ_CYCLES  budget per input, 100000 by default
+//
+//  Catching fire (the interrupt queue overflowing included) and halting on an illegal instruction abort() so
+//  both fuzzers keep them as crashes. Running out of cycles isn't a failure.
+//
+
+#include "ccpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAP_SIZE 0x10000
+#define KEY_BUFFER 64
+
+enum { A, B, C };
+
+static struct cpu_t *cpu;
+static struct snapshot_t *start;
+static struct hardware_t *keyboard;
+static uint8_t *map;
+static size_t map_size = MAP_SIZE;
+static uint64_t budget = 100000, key_cycles = 1000;
+static int32_t input_address = -1; // -1 types the input instead
+
+// The keyboard the input is typed on
+static struct {
+    const uint8_t *keys;
+    size_t count, next;
+    uint16_t buffer[KEY_BUFFER];
+    int head, length;
+    uint16_t pressed, message;
+} typing;
+
+static void keyboard_wake(struct hardware_t *hw) {
+    if (typing.next >= typing.count) {
+        typing.pressed = 0;
+        return;
+    }
+    typing.pressed = typing.keys[typing.next++];
+    if (typing.length < KEY_BUFFER)
+        typing.buffer[(typing.head + typing.length++) % KEY_BUFFER] = typing.pressed;
+    if (typing.message)
+        cpu_interrupt(hw->cpu, typing.message);
+    cpu_schedule_at(hw, hw->deadline + key_cycles);
+}
+
+static void keyboard_interrupt(struct hardware_t *hw) {
+    uint16_t *reg = hw->cpu->reg;
+    switch (reg[A]) {
+        case 0:
+            typing.length = 0;
+            break;
+        case 1:
+            reg[C] = 0;
+            if (typing.length) {
+                reg[C] = typing.buffer[typing.head];
+                typing.head = (typing.head + 1) % KEY_BUFFER;
+                typing.length--;
+            }
+            break;
+        case 2:
+            reg[C] = typing.pressed && reg[B] == typing.pressed;
+            break;
+        case 3:
+            typing.message = reg[B];
+            break;
+    }
+}
+
+static int keyboard_init(struct hardware_t *hw) {
+    hw->id = 0x30cf7406;
+    hw->version = 1;
+    hw->wake = keyboard_wake;
+    hw->interrupt = keyboard_interrupt;
+    keyboard = hw;
+    return 1;
+}
+
+static void setup(void) {
+    const char *image = getenv("FUZZ_IMAGE"), *input = getenv("FUZZ_INPUT"), *value;
+    if (!image) {
+        fprintf(stderr, "fuzz: set FUZZ_IMAGE to the firmware to fuzz\n");
+        abort();
+    }
+    if ((value = getenv("FUZZ_CYCLES")))
+        budget = strtoull(value, NULL, 10);
+    if ((value = getenv("FUZZ_KEY_CYCLES")))
+        key_cycles = strtoull(value, NULL, 10);
+    if (input && strcmp(input, "keyboard"))
+        input_address = strtol(input, NULL, 16) & 0xFFFF;
+    if (!(cpu = cpu_create()) || !cpu_attach_hardware(cpu, keyboard_init))
+        abort();
+    const char *order = getenv("FUZZ_ORDER");
+    int little = order && !strcmp(order, "little");
+    if (cpu_load_image(cpu, image, little ? CPU_IMAGE_LITTLE_ENDIAN : CPU_IMAGE_BIG_ENDIAN) < 0) {
+        fprintf(stderr, "fuzz: can't load FUZZ_IMAGE %s\n", image);
+        abort();
+    }
+    if (!(start = cpu_snapshot(cpu)))
+        abort();
+}
+
+// Every input runs from the state the firmware was loaded in
+static void execute(const uint8_t *data, size_t size) {
+    cpu_rewind(cpu, start);
+    cpu_coverage_start(cpu, map, map_size);
+    if (input_address >= 0) {
+        size_t words = size / 2 < 0x10000 - input_address ? size / 2 : 0x10000 - input_address;
+        memcpy(&cpu->memory[input_address], data, words * sizeof(uint16_t));
+        cpu_invalidate(cpu, input_address, words);
+        cpu_cancel(keyboard);
+    } else {
+        memset(&typing, 0, sizeof(typing));
+        typing.keys = data;
+        typing.count = size;
+        cpu_schedule(keyboard, key_cycles);
+    }
+    switch (cpu_run(cpu, budget)) {
+        case CPU_STOP_BUDGET:
+        case CPU_STOP_WATCH:
+            return;
+        case CPU_STOP_HALT:
+            fprintf(stderr, "fuzz: halted on an illegal instruction, PC %04x\n", cpu->reg[8]);
+            break;
+        case CPU_STOP_ON_FIRE:
+            fprintf(stderr, "fuzz: on fire at %04x%s\n", cpu->reg[8],
+                    cpu->iaq_count >= 256 ? ", interrupt queue overflowed" : "");
+            break;
+    }
+    abort();
+}
+
+#if defined(LIBFUZZER)
+// libFuzzer takes extra 8-bit counters from anything that registers them the way instrumented modules do
+static uint8_t counters[MAP_SIZE] __attribute__((aligned(4096)));
+void __sanitizer_cov_8bit_counters_init(uint8_t *start, uint8_t *stop);
+
+__attribute__((constructor)) static void register_counters(void) {
+    __sanitizer_cov_8bit_counters_init(counters, counters + MAP_SIZE);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    map = counters;
+    setup();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    execute(data, size);
+    return 0;
+}
+#else
+#if defined(__AFL_LOOP)
+// Guest edges share AFL++'s map with the harness's own
+extern uint8_t *__afl_area_ptr;
+extern uint32_t __afl_map_size;
+#endif
+
+static uint8_t buffer[0x20000];
+
+static size_t read_input(FILE *fh) {
+    return fread(buffer, 1, sizeof(buffer), fh);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char *argv[]) {
+    setup();
+#if defined(__AFL_LOOP)
+    map = __afl_area_ptr;
+    while (map_size > __afl_map_size)
+        map_size >>= 1;
+    while (__AFL_LOOP(10000))
+        execute(buffer, read_input(stdin));
+#else
+    static uint8_t local[MAP_SIZE];
+    map = local;
+    if (argc < 2) {
+        execute(buffer, read_input(stdin));
+        return 0;
+    }
+    // Each input once to check it, then again to time the resets and runs alone
+    int inputs = argc - 1;
+    size_t *sizes = malloc(inputs * sizeof(size_t));
+    uint8_t **data = malloc(inputs * sizeof(uint8_t*));
+    if (!sizes || !data)
+        abort();
+    for (int i = 0; i < inputs; i++) {
+        FILE *fh = fopen(argv[i + 1], "rb");
+        if (!fh) {
+            fprintf(stderr, "fuzz: can't open %s\n", argv[i + 1]);
+            return 1;
+        }
+        sizes[i] = read_input(fh);
+        fclose(fh);
+        if (!(data[i] = malloc(sizes[i] + 1)))
+            abort();
+        memcpy(data[i], buffer, sizes[i]);
+        fprintf(stderr, "fuzz: %s\n", argv[i + 1]);
+        execute(data[i], sizes[i]);
+    }
+    int runs = 0;
+    double began = now(), seconds;
+    do {
+        for (int i = 0; i < inputs; i++, runs++)
+            execute(data[i], sizes[i]);
+    } while ((seconds = now() - began) < 1);
+    int edges = 0;
+    for (int i = 0; i < MAP_SIZE; i++)
+        edges += local[i] != 0;
+    printf("%d inputs, %d edges, %.0f execs/s\n", inputs, edges, runs / seconds);
+    for (int i = 0; i < inputs; i++)
+        free(data[i]);
+    free(data);
+    free(sizes);
+#endif
+    return 0;
+}
+#endif
@@ -10,22 +10,28 @@
 #include <stdlib.h>
 #include <string.h>
 
-extern int assemble(const char *src, uint16_t dst[0x10000]);
-
-static void load(struct cpu_t *cpu, const char *path) {
-    FILE *fh = fopen(path, "rb");
-    if (!fh)
+static int load(struct cpu_t *cpu, const char *path) {
+    // sample.bin was written out little-endian
+    int words = cpu_load_image(cpu, path, CPU_IMAGE_LITTLE_ENDIAN);
+    if (words < 0)
         abort();
-    fseek(fh, 0, SEEK_END);
-    size_t sz = ftell(fh);
-    if (sz >= 0x10000)
+    return words;
+}
+
+// The disassembly of words from 0 should assemble back to the same words
+static int round_trip(const uint16_t *memory, int words) {
+    static uint16_t image[0x10000];
+    size_t size = 40 * words + 1;
+    char *text = malloc(size);
+    if (!text)
         abort();
-    fseek(fh, 0, SEEK_SET);
-    fread(cpu->memory, sz, 1, fh);
-    fclose(fh);
+    int result = disassemble_image(memory, 0, words, text, size) >= 0 && assemble(text, image) == words &&
+                 !memcmp(memory, image, words * sizeof(uint16_t));
+    free(text);
+    return result;
 }
 
-static void compile(struct cpu_t *cpu, const char *path) {
+static int compile(struct cpu_t *cpu, const char *path) {
     FILE *fh = fopen(path, "rb");
     if (!fh)
         abort();
@@ -34,33 +40,54 @@ static void compile(struct cpu_t *cpu, const char *path) {
     if (sz >= 0x10000)
         abort();
     fseek(fh, 0, SEEK_SET);
-    char *src = malloc(sz * sizeof(char));
-    fread(src, sz, 1, fh);
-    assemble(src, cpu->memory);
+    char *src = malloc(sz + 1);
+    if (!src)
+        abort();
+    src[fread(src, 1, sz, fh)] = '\0';
+    int words = assemble(src, cpu->memory);
     fclose(fh);
     free(src);
+    return words;
 }
 
-int main(int argc, const char *argv[]) {
-    struct cpu_t cpu;
-    memset(&cpu, 0, sizeof(struct cpu_t));
-//    load(&cpu, "tests/sample.bin");
-    compile(&cpu, "tests/sample.s");
-    
+// Steps until the program hangs on :crash, printing each instruction
+static void run(struct cpu_t *cpu) {
     fprintf(stdout,
         "PC   SP   EX   IA   A    B    C    X    Y    Z    I    J    Instruction\n"
         "---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- -----------\n");
-    while (cpu.state != CPU_HALT &&
-         cpu.state != CPU_ON_FIRE) {
+    while (cpu->state != CPU_HALT &&
+         cpu->state != CPU_ON_FIRE) {
         char buf[32];
-        disassemble(&cpu.memory[cpu.reg[8]], buf);
+        disassemble(&cpu->memory[cpu->reg[8]], buf);
         fprintf(stdout,
                 "%04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %04x %s\n",
-                cpu.reg[8], cpu.reg[9], cpu.reg[10], cpu.reg[11],
-                cpu.reg[0], cpu.reg[1], cpu.reg[2], cpu.reg[3],
-                cpu.reg[4], cpu.reg[5], cpu.reg[6], cpu.reg[7],
+                cpu->reg[8], cpu->reg[9], cpu->reg[10], cpu->reg[11],
+                cpu->reg[0], cpu->reg[1], cpu->reg[2], cpu->reg[3],
+                cpu->reg[4], cpu->reg[5], cpu->reg[6], cpu->reg[7],
                 buf);
-        cpu_step(&cpu);
+        uint16_t pc = cpu->reg[8];
+        cpu_step(cpu);
+        if (cpu->reg[8] == pc)
+            break; // Hanging on :crash
     }
-    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    struct cpu_t *cpu = cpu_create(), *image = cpu_create();
+    if (!cpu || !image)
+        abort();
+    if (compile(cpu, "tests/sample.s") < 0)
+        abort();
+    // sample.bin is the same program with every literal in the long form, so the words differ but the
+    // registers it finishes with (bar PC) don't
+    int words = load(image, "tests/sample.bin");
+    if (!round_trip(image->memory, words))
+        abort();
+    run(cpu);
+    run(image);
+    int result = cpu->reg[3] != 0x40 || memcmp(cpu->reg, image->reg, 8 * sizeof(uint16_t)) ||
+                 cpu->reg[9] != image->reg[9] || cpu->reg[10] != image->reg[10];
+    cpu_destroy(cpu);
+    cpu_destroy(image);
+    return result;
 }